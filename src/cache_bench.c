@@ -0,0 +1,511 @@
+/**
+ *  Copyright 2011 Dash Shendy
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+/**
+ * Session cache benchmark
+ *
+ * Drives the session cache callbacks of gnutls_cache.c outside of
+ * Apache: the file is compiled in here, the few httpd functions it
+ * calls are replaced by the macros below, and every operation runs on
+ * a fake conn_rec and mgs_handle_t, the way gnutls_handshake() would
+ * call them.
+ *
+ * A loader process first stores KEYS sessions. Then PROCS processes
+ * of THREADS threads each do OPS lookups: with probability HIT one of
+ * the stored sessions, otherwise a new one, which is stored after the
+ * miss like a full handshake would. Throughput and latency percentiles
+ * of the lookups and stores are reported at the end.
+ *
+ *   make -C src cache_bench
+ *   src/cache_bench -c dbm -a /tmp/bench_cache -p 4 -t 8
+ *
+ * t/runbench runs it for every backend, with memcached on loopback.
+ */
+
+#include "mod_gnutls.h"
+#include "apr_getopt.h"
+#include "apr_thread_proc.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* The httpd functions gnutls_cache.c uses, redirected to this file */
+static int bench_loglevel = APLOG_WARNING;
+static int bench_threads = 1;
+static int bench_procs = 1;
+
+static void bench_vlog(int level, apr_status_t status, const char *fmt,
+        va_list ap) {
+    char err[256];
+
+    if ((level & APLOG_LEVELMASK) > bench_loglevel)
+        return;
+    vfprintf(stderr, fmt, ap);
+    if (status != 0)
+        fprintf(stderr, ": %s", apr_strerror(status, err, sizeof (err)));
+    fputc('\n', stderr);
+}
+
+#ifdef APLOG_MODULE_INDEX
+static void bench_log_error(const char *file, int line, int module_index,
+        int level, apr_status_t status, const server_rec * s,
+        const char *fmt, ...) {
+#else
+static void bench_log_error(const char *file, int line, int level,
+        apr_status_t status, const server_rec * s, const char *fmt, ...) {
+#endif
+    va_list ap;
+
+    va_start(ap, fmt);
+    bench_vlog(level, status, fmt, ap);
+    va_end(ap);
+}
+
+static apr_status_t bench_mpm_query(int query, int *result) {
+    switch (query) {
+    case AP_MPMQ_MAX_THREADS:
+        *result = bench_threads;
+        return APR_SUCCESS;
+    case AP_MPMQ_MAX_DAEMONS:
+        *result = bench_procs;
+        return APR_SUCCESS;
+    }
+    *result = 0;
+    return APR_ENOTIMPL;
+}
+
+/* mod_status output is not used */
+static int bench_rprintf(request_rec * r, const char *fmt, ...) {
+    return 0;
+}
+
+static struct {
+    uid_t user_id;
+} bench_unixd_config;
+
+#undef ap_log_error
+#define ap_log_error bench_log_error
+#define ap_mpm_query bench_mpm_query
+#define ap_rprintf bench_rprintf
+#define ap_rputs(str, r) bench_rprintf(r, "%s", str)
+#undef ap_escape_html
+#define ap_escape_html(p, s) (s)
+#define ap_server_root_relative(p, name) apr_pstrdup(p, name)
+#define ap_lookup_provider(group, name, version) NULL
+#if MODULE_MAGIC_NUMBER_MAJOR < 20081201
+#define unixd_config bench_unixd_config
+#define unixd_set_global_mutex_perms(mutex) APR_SUCCESS
+#else
+#define ap_unixd_config bench_unixd_config
+#define ap_unixd_set_global_mutex_perms(mutex) APR_SUCCESS
+#endif
+
+#include "gnutls_cache.c"
+
+#define BENCH_ID_LEN 32
+
+typedef struct {
+    int keys;
+    int ops;
+    double hit;
+    int size;
+} bench_params_t;
+
+/* Latencies in nanoseconds, one slot per operation of every thread */
+typedef struct {
+    apr_uint32_t ready;
+    apr_uint32_t go;
+    apr_uint32_t hits;
+    apr_uint32_t misses;
+    apr_uint32_t nstore[1];
+} bench_shared_t;
+
+static bench_params_t params;
+static bench_shared_t *shared;
+static apr_uint32_t *fetch_ns;
+static apr_uint32_t *store_ns;
+static server_rec *bench_server;
+static mgs_srvconf_rec *bench_sc;
+
+typedef struct {
+    int index;
+    apr_uint64_t rand;
+} bench_thread_t;
+
+static apr_uint64_t bench_rand(bench_thread_t * t) {
+    /* xorshift64 */
+    t->rand ^= t->rand << 13;
+    t->rand ^= t->rand >> 7;
+    t->rand ^= t->rand << 17;
+    return t->rand;
+}
+
+static apr_uint64_t bench_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (apr_uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static apr_uint32_t bench_elapsed(apr_uint64_t start) {
+    apr_uint64_t ns = bench_now() - start;
+
+    return ns > 0xffffffff ? 0xffffffff : (apr_uint32_t) ns;
+}
+
+static void bench_session_id(unsigned char *id, apr_uint64_t n) {
+    int i;
+
+    memset(id, 0xa5, BENCH_ID_LEN);
+    for (i = 0; i < 8; i++, n >>= 8)
+        id[i] = n & 0xff;
+}
+
+/* A connection the way create_gnutls_handle() sets one up */
+static void bench_handle(mgs_handle_t * ctxt, conn_rec * c,
+        apr_pool_t * p) {
+    memset(c, 0, sizeof (*c));
+    c->pool = p;
+    c->base_server = bench_server;
+    memset(ctxt, 0, sizeof (*ctxt));
+    ctxt->c = c;
+    ctxt->sc = bench_sc;
+    ctxt->session_context = "bench.example:443";
+}
+
+static void *APR_THREAD_FUNC bench_thread(apr_thread_t * thd, void *data) {
+    bench_thread_t *t = data;
+    apr_uint32_t *fns = fetch_ns + (apr_size_t) t->index * params.ops;
+    apr_uint32_t *sns = store_ns + (apr_size_t) t->index * params.ops;
+    unsigned char *blob = malloc(params.size);
+    unsigned char id[BENCH_ID_LEN];
+    apr_uint64_t fresh = params.keys
+            + (apr_uint64_t) t->index * params.ops;
+    apr_uint32_t hits = 0, misses = 0, nstore = 0;
+    apr_pool_t *p;
+    conn_rec c;
+    mgs_handle_t ctxt;
+    int i;
+
+    apr_pool_create(&p, NULL);
+    for (i = 0; i < params.size; i++)
+        blob[i] = bench_rand(t) & 0xff;
+
+    for (i = 0; i < params.ops; i++) {
+        gnutls_datum_t key = {id, BENCH_ID_LEN};
+        gnutls_datum_t data;
+        apr_uint64_t start;
+
+        if ((bench_rand(t) % 1000000) < params.hit * 1000000)
+            bench_session_id(id, bench_rand(t) % params.keys);
+        else
+            bench_session_id(id, fresh++);
+
+        bench_handle(&ctxt, &c, p);
+        start = bench_now();
+        data = cache_fetch(&ctxt, key);
+        fns[i] = bench_elapsed(start);
+
+        if (data.data != NULL) {
+            hits++;
+            gnutls_free(data.data);
+        } else {
+            gnutls_datum_t session = {blob, params.size};
+
+            misses++;
+            start = bench_now();
+            cache_store(&ctxt, key, session);
+            sns[nstore++] = bench_elapsed(start);
+        }
+        apr_pool_clear(p);
+    }
+
+    apr_atomic_add32(&shared->hits, hits);
+    apr_atomic_add32(&shared->misses, misses);
+    shared->nstore[t->index] = nstore;
+
+    apr_pool_destroy(p);
+    free(blob);
+    apr_thread_exit(thd, APR_SUCCESS);
+    return NULL;
+}
+
+/* Store the sessions that lookups are meant to find */
+static int bench_load(apr_pool_t * pconf) {
+    unsigned char *blob = calloc(1, params.size);
+    unsigned char id[BENCH_ID_LEN];
+    apr_pool_t *pchild, *p;
+    conn_rec c;
+    mgs_handle_t ctxt;
+    int i;
+
+    apr_pool_create(&pchild, pconf);
+    if (mgs_cache_child_init(pchild, bench_server, bench_sc) != 0)
+        return 1;
+#if APR_HAS_THREADS
+    /* store synchronously, a full queue would drop sessions */
+    store_queue_cleanup(NULL);
+#endif
+
+    apr_pool_create(&p, pchild);
+    for (i = 0; i < params.keys; i++) {
+        gnutls_datum_t key = {id, BENCH_ID_LEN};
+        gnutls_datum_t session = {blob, params.size};
+
+        bench_session_id(id, i);
+        bench_handle(&ctxt, &c, p);
+        cache_store(&ctxt, key, session);
+        apr_pool_clear(p);
+    }
+
+    apr_pool_destroy(pchild);
+    free(blob);
+    return 0;
+}
+
+static int bench_child(apr_pool_t * pconf, int proc) {
+    apr_thread_t **thds = calloc(bench_threads, sizeof (*thds));
+    bench_thread_t *ts = calloc(bench_threads, sizeof (*ts));
+    apr_pool_t *pchild;
+    apr_status_t rv;
+    int i;
+
+    apr_pool_create(&pchild, pconf);
+    if (mgs_cache_child_init(pchild, bench_server, bench_sc) != 0)
+        return 1;
+
+    apr_atomic_inc32(&shared->ready);
+    while (apr_atomic_read32(&shared->go) == 0)
+        apr_sleep(1000);
+
+    for (i = 0; i < bench_threads; i++) {
+        ts[i].index = proc * bench_threads + i;
+        ts[i].rand = 0x9e3779b97f4a7c15ULL * (ts[i].index + 1);
+        apr_thread_create(&thds[i], NULL, bench_thread, &ts[i], pchild);
+    }
+    for (i = 0; i < bench_threads; i++)
+        apr_thread_join(&rv, thds[i]);
+
+    /* flushes the background writer */
+    apr_pool_destroy(pchild);
+    return 0;
+}
+
+static int bench_cmp(const void *a, const void *b) {
+    apr_uint32_t x = *(const apr_uint32_t *) a;
+    apr_uint32_t y = *(const apr_uint32_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void bench_report(const char *what, apr_uint32_t *ns, apr_size_t n,
+        double seconds) {
+    if (n == 0) {
+        printf("  %-6s %10u ops\n", what, 0);
+        return;
+    }
+    qsort(ns, n, sizeof (*ns), bench_cmp);
+    printf("  %-6s %10" APR_SIZE_T_FMT " ops %12.0f ops/s"
+            "   p50 %8.1fus  p99 %8.1fus  p999 %8.1fus\n",
+            what, n, n / seconds,
+            ns[n / 2] / 1000.0, ns[n * 99 / 100] / 1000.0,
+            ns[n * 999 / 1000] / 1000.0);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s -c TYPE -a ARG [options]\n"
+            "  -c TYPE     cache type: dbm, gdbm, shm, memcache, lmdb\n"
+            "  -a ARG      GnuTLSCache argument: path, size or servers\n"
+            "  -p PROCS    processes (default 1)\n"
+            "  -t THREADS  threads per process (default 1)\n"
+            "  -n OPS      lookups per thread (default 10000)\n"
+            "  -k KEYS     sessions stored before the run (default 10000)\n"
+            "  -h HIT      share of lookups for stored sessions "
+            "(default 0.9)\n"
+            "  -s SIZE     session size in bytes (default 1500)\n"
+            "  -T SECONDS  GnuTLSCacheTimeout (default 300)\n"
+            "  -l SIZE     GnuTLSCacheLocal (default 0)\n"
+            "  -r N        GnuTLSCacheReplicas (default 1)\n"
+            "  -S N        GnuTLSCacheShards (default 1)\n"
+            "  -f SIZE     GnuTLSCacheFilter (default 0)\n"
+            "  -v          log debug messages\n", name);
+    exit(2);
+}
+
+/* The value of a count option, or 0 if ARG is not a positive number */
+static int bench_count(const char *arg) {
+    char *end;
+    apr_int64_t n = apr_strtoi64(arg, &end, 10);
+
+    if (end == arg || *end != '\0' || n < 1 || n > INT_MAX)
+        return 0;
+    return (int) n;
+}
+
+int main(int argc, const char *const *argv) {
+    apr_pool_t *pconf;
+    apr_getopt_t *opt;
+    apr_proc_t *procs;
+    apr_shm_t *shm;
+    const char *type = NULL;
+    const char *arg;
+    apr_size_t nslots, nstore;
+    apr_uint64_t start;
+    apr_status_t rv;
+    apr_proc_t loader;
+    double seconds;
+    unsigned int i;
+    char optch;
+    int status, failed = 0;
+    apr_exit_why_e why;
+
+    apr_app_initialize(&argc, &argv, NULL);
+    atexit(apr_terminate);
+    apr_pool_create(&pconf, NULL);
+    gnutls_global_init();
+
+    bench_server = apr_pcalloc(pconf, sizeof (*bench_server));
+    bench_server->server_hostname = "bench.example";
+    bench_server->port = 443;
+    bench_sc = apr_pcalloc(pconf, sizeof (*bench_sc));
+    bench_sc->cache_type = mgs_cache_unset;
+    bench_sc->cache_timeout = apr_time_from_sec(300);
+    bench_sc->cache_replicas = 1;
+    bench_sc->cache_shards = 1;
+    bench_sc->cache_pool_min = -1;
+    bench_sc->cache_pool_smax = -1;
+    bench_sc->cache_pool_max = -1;
+
+    params.keys = 10000;
+    params.ops = 10000;
+    params.hit = 0.9;
+    params.size = 1500;
+
+    apr_getopt_init(&opt, pconf, argc, argv);
+    while ((rv = apr_getopt(opt, "c:a:p:t:n:k:h:s:T:l:r:S:f:v", &optch,
+            &arg)) == APR_SUCCESS) {
+        switch (optch) {
+        case 'c': type = arg; break;
+        case 'a': bench_sc->cache_config = arg; break;
+        case 'p': bench_procs = bench_count(arg); break;
+        case 't': bench_threads = bench_count(arg); break;
+        case 'n': params.ops = bench_count(arg); break;
+        case 'k': params.keys = bench_count(arg); break;
+        case 'h': params.hit = atof(arg); break;
+        case 's': params.size = bench_count(arg); break;
+        case 'T': bench_sc->cache_timeout = apr_time_from_sec(atoi(arg));
+            break;
+        case 'l': bench_sc->cache_local_size = apr_atoi64(arg); break;
+        case 'r': bench_sc->cache_replicas = atoi(arg); break;
+        case 'S': bench_sc->cache_shards = atoi(arg); break;
+        case 'f': bench_sc->cache_filter_size = apr_atoi64(arg); break;
+        case 'v': bench_loglevel = APLOG_DEBUG; break;
+        }
+    }
+    if (rv != APR_EOF || type == NULL || bench_sc->cache_config == NULL
+            || bench_procs < 1 || bench_threads < 1 || params.ops < 1
+            || params.keys < 1 || params.size < 1
+            || !(params.hit >= 0 && params.hit <= 1))
+        usage(argv[0]);
+
+    for (i = 0; i < sizeof (cache_providers) / sizeof (cache_providers[0]);
+            i++) {
+        if (strcasecmp(cache_providers[i].name, type) == 0)
+            bench_sc->cache_type = cache_providers[i].type;
+    }
+    if (bench_sc->cache_type == mgs_cache_unset) {
+        fprintf(stderr, "%s: unknown or unsupported cache type '%s'\n",
+                argv[0], type);
+        return 2;
+    }
+
+    nslots = (apr_size_t) bench_procs * bench_threads * params.ops;
+    rv = apr_shm_create(&shm, APR_OFFSETOF(bench_shared_t, nstore)
+            + bench_procs * bench_threads * sizeof (apr_uint32_t)
+            + 2 * nslots * sizeof (apr_uint32_t), NULL, pconf);
+    if (rv != APR_SUCCESS) {
+        bench_log_error(APLOG_MARK, APLOG_ERR, rv, bench_server,
+                "cannot allocate %" APR_SIZE_T_FMT " result slots", nslots);
+        return 1;
+    }
+    shared = apr_shm_baseaddr_get(shm);
+    memset(shared, 0, apr_shm_size_get(shm));
+    fetch_ns = &shared->nstore[bench_procs * bench_threads];
+    store_ns = fetch_ns + nslots;
+
+    if (mgs_cache_post_config(pconf, bench_server, bench_sc) != 0) {
+        fprintf(stderr, "%s: cannot set up the %s cache\n", argv[0], type);
+        return 1;
+    }
+
+    if (apr_proc_fork(&loader, pconf) == APR_INCHILD)
+        _exit(bench_load(pconf));
+    apr_proc_wait(&loader, &status, &why, APR_WAIT);
+    if (status != 0) {
+        fprintf(stderr, "%s: loading %d sessions failed\n", argv[0],
+                params.keys);
+        return 1;
+    }
+
+    procs = apr_pcalloc(pconf, bench_procs * sizeof (*procs));
+    for (i = 0; i < (unsigned int) bench_procs; i++) {
+        if (apr_proc_fork(&procs[i], pconf) == APR_INCHILD)
+            _exit(bench_child(pconf, i));
+    }
+
+    while (apr_atomic_read32(&shared->ready) < (apr_uint32_t) bench_procs)
+        apr_sleep(1000);
+    start = bench_now();
+    apr_atomic_set32(&shared->go, 1);
+
+    for (i = 0; i < (unsigned int) bench_procs; i++) {
+        apr_proc_wait(&procs[i], &status, &why, APR_WAIT);
+        if (status != 0)
+            failed++;
+    }
+    seconds = (bench_now() - start) / 1e9;
+
+    /* gather the store latencies of all threads */
+    nstore = 0;
+    for (i = 0; i < (unsigned int) (bench_procs * bench_threads); i++) {
+        memmove(store_ns + nstore, store_ns + (apr_size_t) i * params.ops,
+                shared->nstore[i] * sizeof (apr_uint32_t));
+        nstore += shared->nstore[i];
+    }
+
+    printf("%s %s: %d x %d threads, %d sessions of %d bytes, "
+            "%.0f%% hits wanted\n", type, bench_sc->cache_config,
+            bench_procs, bench_threads, params.keys, params.size,
+            params.hit * 100);
+    printf("  %.2fs, %.1f%% hits", seconds, 100.0 * shared->hits
+            / (shared->hits + shared->misses));
+    if (stats != NULL)
+        printf(", %u stores dropped, %u errors",
+                stats->store_dropped, stats->store_error
+                + stats->fetch_error);
+    if (failed)
+        printf(", %d processes failed", failed);
+    printf("\n");
+    bench_report("fetch", fetch_ns, nslots, seconds);
+    bench_report("store", store_ns, nstore, seconds);
+
+    apr_pool_destroy(pconf);
+    return failed ? 1 : 0;
+}
@@ -21,11 +21,27 @@
 
 #if HAVE_APR_MEMCACHE
 #include "apr_memcache.h"
+#include "apr_md5.h"
 #endif
 
 #include "apr_dbm.h"
+#include "apr_shm.h"
+#include "apr_global_mutex.h"
+#include "apr_hash.h"
+#include "apr_atomic.h"
+#include "apr_thread_proc.h"
+#include "apr_thread_mutex.h"
+#include "apr_thread_cond.h"
 
 #include "ap_mpm.h"
+#include "mod_status.h"
+#if HAVE_LMDB
+#include <lmdb.h>
+#endif
+#if HAVE_AP_SOCACHE
+#include "ap_provider.h"
+#include "ap_socache.h"
+#endif
 
 #include <unistd.h>
 #include <sys/types.h>
@@ -42,6 +58,7 @@
 
 #if MODULE_MAGIC_NUMBER_MAJOR < 20081201
 #define ap_unixd_config unixd_config
+#define ap_unixd_set_global_mutex_perms unixd_set_global_mutex_perms
 #endif
 
 char *mgs_session_id2sz(unsigned char *id, int idlen,
@@ -59,11 +76,12 @@ char *mgs_session_id2sz(unsigned char *id, int idlen,
 }
 
 /* Name the Session ID as:
- * server:port.SessionID
- * to disallow resuming sessions on different servers
+ * context.SessionID
+ * to disallow resuming sessions on different servers.  The context
+ * is server:port unless set with GnuTLSSessionContext.
  */
-static int mgs_session_id2dbm(conn_rec * c, unsigned char *id, int idlen,
-        apr_datum_t * dbmkey) {
+static int mgs_session_id2dbm(mgs_handle_t * ctxt, unsigned char *id,
+        int idlen, apr_datum_t * dbmkey) {
     char buf[STR_SESSION_LEN];
     char *sz;
 
@@ -71,10 +89,8 @@ static int mgs_session_id2dbm(conn_rec * c, unsigned char *id, int idlen,
     if (sz == NULL)
         return -1;
 
-    dbmkey->dptr =
-            apr_psprintf(c->pool, "%s:%d.%s",
-            c->base_server->server_hostname,
-            c->base_server->port, sz);
+    dbmkey->dptr = apr_psprintf(ctxt->c->pool, "%s.%s",
+            ctxt->session_context, sz);
     dbmkey->dsize = strlen(dbmkey->dptr);
 
     return 0;
@@ -95,471 +111,3403 @@ char *mgs_time2sz(time_t in_time, char *str, int strsize) {
     return str;
 }
 
-#if HAVE_APR_MEMCACHE
+/* Create a shared memory segment, anonymous if the platform allows,
+ * otherwise backed by a file named relative to the ServerRoot */
+static apr_status_t cache_shm_create(apr_shm_t **shm, apr_size_t size,
+        const char *name, apr_pool_t * p) {
+    apr_status_t rv;
+    const char *fname;
 
-/* Name the Session ID as:
- * server:port.SessionID
- * to disallow resuming sessions on different servers
- */
-static char *mgs_session_id2mc(conn_rec * c, unsigned char *id, int idlen) {
-    char buf[STR_SESSION_LEN];
-    char *sz;
+    rv = apr_shm_create(shm, size, NULL, p);
+    if (APR_STATUS_IS_ENOTIMPL(rv)) {
+        fname = ap_server_root_relative(p, name);
+        apr_shm_remove(fname, p);
+        rv = apr_shm_create(shm, size, fname, p);
+    }
+    return rv;
+}
 
-    sz = mgs_session_id2sz(id, idlen, buf, sizeof (buf));
-    if (sz == NULL)
-        return NULL;
+/* Create a global mutex usable by the unprivileged children */
+static apr_status_t cache_mutex_create(apr_global_mutex_t **mutex,
+        server_rec * s, apr_pool_t * p) {
+    apr_status_t rv;
 
-    return apr_psprintf(c->pool, MC_TAG "%s:%d.%s",
-            c->base_server->server_hostname,
-            c->base_server->port, sz);
+    rv = apr_global_mutex_create(mutex, NULL, APR_LOCK_DEFAULT, p);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                "GnuTLS: Cannot create cache lock");
+        return rv;
+    }
+#ifdef AP_NEED_SET_MUTEX_PERMS
+    rv = ap_unixd_set_global_mutex_perms(*mutex);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                "GnuTLS: Cannot set permissions on cache lock");
+        return rv;
+    }
+#endif
+    return APR_SUCCESS;
 }
 
 /**
- * GnuTLS Session Cache using libmemcached
+ * Session Cache Providers
  *
+ * Every cache type is described by a provider; the mgs_cache_*
+ * functions at the end of this file only go through the provider of
+ * the configured type, see cache_providers[].
  */
 
-/* The underlying apr_memcache system is thread safe... woohoo */
-static apr_memcache_t *mc;
+/* GnuTLSCacheLocal can be put in front of this cache */
+#define CACHE_USE_LOCAL 0x1
+/* lookups are slow enough for GnuTLSCacheFilter to pay off */
+#define CACHE_USE_FILTER 0x2
+/* sessions can be spread over GnuTLSCacheShards files */
+#define CACHE_USE_SHARDS 0x4
+
+typedef struct {
+    mgs_cache_e type;
+    const char *name;
+    int flags;
+    /* set up shared state in the parent after the config is read */
+    int (*init) (apr_pool_t * p, server_rec * s, mgs_srvconf_rec * sc);
+    int (*child_init) (apr_pool_t * p, server_rec * s,
+            mgs_srvconf_rec * sc);
+    gnutls_db_retr_func fetch;
+    gnutls_db_store_func store;
+    gnutls_db_remove_func remove;
+    /* remove some expired sessions, called by the writer thread when
+     * it is idle; NULL if the cache expires sessions itself */
+    void (*expire) (server_rec * s, mgs_srvconf_rec * sc, apr_pool_t * p);
+    /* mod_status output of the cache itself, may be NULL */
+    void (*stats) (request_rec * r, int flags);
+} cache_provider_t;
+
+/* The provider of the configured cache type, NULL for none */
+static const cache_provider_t *cache;
 
-static int mc_cache_child_init(apr_pool_t * p, server_rec * s,
-        mgs_srvconf_rec * sc) {
-    apr_status_t rv = APR_SUCCESS;
-    int thread_limit = 0;
-    int nservers = 0;
-    char *cache_config;
-    char *split;
-    char *tok;
+/**
+ * Session Cache Statistics
+ *
+ * Counters and latency histograms shared by all children and shown
+ * by mod_status.  Bucket i of a histogram counts the operations that
+ * took less than 2^(i+4) microseconds, the last bucket the slower ones.
+ */
+#define STATS_BUCKETS 16
+
+typedef struct {
+    apr_uint32_t fetch_hit;
+    apr_uint32_t fetch_miss;
+    apr_uint32_t fetch_error;
+    /* the memcache local cache */
+    apr_uint32_t local_hit;
+    apr_uint32_t local_miss;
+    /* fetches answered by GnuTLSCacheFilter */
+    apr_uint32_t filter_skip;
+    apr_uint32_t store;
+    apr_uint32_t store_error;
+    apr_uint32_t store_dropped;
+    apr_uint32_t remove;
+    apr_uint32_t expire;
+    apr_uint32_t evict;
+    apr_uint32_t fetch_time[STATS_BUCKETS];
+    apr_uint32_t store_time[STATS_BUCKETS];
+    apr_uint32_t remove_time[STATS_BUCKETS];
+} cache_stats_t;
+
+/* Counters of one virtual host, see cache_parts below */
+typedef struct {
+    apr_uint32_t fetch_hit;
+    apr_uint32_t fetch_miss;
+    apr_uint32_t store;
+    /* shm table slots holding sessions of the host */
+    apr_uint32_t used;
+    /* sessions not put in the shm table because of GnuTLSCacheQuota */
+    apr_uint32_t over_quota;
+} cache_part_stats_t;
+
+static apr_shm_t *stats_shm;
+static cache_stats_t *stats;
+/* one per partition, after the cache_stats_t in stats_shm */
+static cache_part_stats_t *part_stats;
+
+#define STATS_INC(field) \
+    do { \
+        if (stats != NULL) \
+            apr_atomic_inc32(&stats->field); \
+    } while (0)
+
+static void stats_time(apr_uint32_t *histogram, apr_time_t start) {
+    apr_time_t elapsed = apr_time_now() - start;
+    int i = 0;
+
+    while (i < STATS_BUCKETS - 1 && elapsed >= ((apr_time_t) 16 << i))
+        i++;
+    apr_atomic_inc32(&histogram[i]);
+}
 
-    ap_mpm_query(AP_MPMQ_HARD_LIMIT_THREADS, &thread_limit);
+static apr_status_t stats_cleanup(void *data) {
+    stats = NULL;
+    part_stats = NULL;
+    return APR_SUCCESS;
+}
 
-    /* Find all the servers in the first run to get a total count */
-    cache_config = apr_pstrdup(p, sc->cache_config);
-    split = apr_strtok(cache_config, " ", &tok);
-    while (split) {
-        nservers++;
-        split = apr_strtok(NULL, " ", &tok);
-    }
+static int stats_create(apr_pool_t * p, server_rec * s, int nparts) {
+    apr_size_t size = sizeof (cache_stats_t)
+            + (nparts + 1) * sizeof (cache_part_stats_t);
+    apr_status_t rv;
 
-    rv = apr_memcache_create(p, nservers, 0, &mc);
+    rv = cache_shm_create(&stats_shm, size,
+            "logs/gnutls_cache_stats_shm", p);
     if (rv != APR_SUCCESS) {
-        ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s,
-                "[gnutls_cache] Failed to create Memcache Object of '%d' size.",
-                nservers);
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                "GnuTLS: Cannot create cache statistics");
         return rv;
     }
 
-    /* Now add each server to the memcache */
-    cache_config = apr_pstrdup(p, sc->cache_config);
-    split = apr_strtok(cache_config, " ", &tok);
-    while (split) {
-        apr_memcache_server_t *st;
-        char *host_str;
-        char *scope_id;
-        apr_port_t port;
-
-        rv = apr_parse_addr_port(&host_str, &scope_id, &port,
-                split, p);
-        if (rv != APR_SUCCESS) {
-            ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s,
-                    "[gnutls_cache] Failed to Parse Server: '%s'",
-                    split);
-            return rv;
-        }
+    stats = apr_shm_baseaddr_get(stats_shm);
+    memset(stats, 0, size);
+    part_stats = (cache_part_stats_t *) (stats + 1);
+    apr_pool_cleanup_register(p, NULL, stats_cleanup,
+            apr_pool_cleanup_null);
 
-        if (host_str == NULL) {
-            ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s,
-                    "[gnutls_cache] Failed to Parse Server, "
-                    "no hostname specified: '%s'", split);
-            return rv;
-        }
+    return APR_SUCCESS;
+}
 
-        if (port == 0) {
-            port = 11211; /* default port */
-        }
+static void stats_print_histogram(request_rec * r, int flags,
+        const char *name, apr_uint32_t *histogram) {
+    int i;
 
-        /* Should Max Conns be (thread_limit / nservers) ? */
-        rv = apr_memcache_server_create(p,
-                host_str, port,
-                0,
-                1, thread_limit, 600, &st);
-        if (rv != APR_SUCCESS) {
-            ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s,
-                    "[gnutls_cache] Failed to Create Server: %s:%d",
-                    host_str, port);
-            return rv;
-        }
+    if (flags & AP_STATUS_SHORT) {
+        ap_rprintf(r, "GnuTLSCache%sLatency:", name);
+        for (i = 0; i < STATS_BUCKETS; i++)
+            ap_rprintf(r, " %u", apr_atomic_read32(&histogram[i]));
+        ap_rputs("\n", r);
+        return;
+    }
 
-        rv = apr_memcache_add_server(mc, st);
-        if (rv != APR_SUCCESS) {
-            ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s,
-                    "[gnutls_cache] Failed to Add Server: %s:%d",
-                    host_str, port);
-            return rv;
-        }
+    ap_rprintf(r, "<dt>%s latency:</dt><dd>", name);
+    for (i = 0; i < STATS_BUCKETS; i++) {
+        apr_uint32_t n = apr_atomic_read32(&histogram[i]);
 
-        split = apr_strtok(NULL, " ", &tok);
+        if (n == 0)
+            continue;
+        if (i < STATS_BUCKETS - 1)
+            ap_rprintf(r, "&lt;%uus: %u ", 16U << i, n);
+        else
+            ap_rprintf(r, "slower: %u", n);
     }
-    return rv;
+    ap_rputs("</dd>\n", r);
 }
 
-static int mc_cache_store(void *baton, gnutls_datum_t key,
-        gnutls_datum_t data) {
-    apr_status_t rv = APR_SUCCESS;
-    mgs_handle_t *ctxt = baton;
-    char *strkey = NULL;
-    apr_uint32_t timeout;
+static void stats_print(request_rec * r, int flags, const char *type) {
+    apr_uint32_t hit = apr_atomic_read32(&stats->fetch_hit);
+    apr_uint32_t miss = apr_atomic_read32(&stats->fetch_miss);
+
+    if (flags & AP_STATUS_SHORT) {
+        ap_rprintf(r, "GnuTLSCacheType: %s\n", type);
+        stats_print_histogram(r, flags, "Fetch", stats->fetch_time);
+        stats_print_histogram(r, flags, "Store", stats->store_time);
+        stats_print_histogram(r, flags, "Delete", stats->remove_time);
+        ap_rprintf(r, "GnuTLSCacheFetchHits: %u\n"
+                "GnuTLSCacheFetchMisses: %u\n"
+                "GnuTLSCacheFetchErrors: %u\n"
+                "GnuTLSCacheLocalHits: %u\n"
+                "GnuTLSCacheLocalMisses: %u\n"
+                "GnuTLSCacheFilterSkips: %u\n"
+                "GnuTLSCacheStores: %u\n"
+                "GnuTLSCacheStoreErrors: %u\n"
+                "GnuTLSCacheStoresDropped: %u\n"
+                "GnuTLSCacheDeletes: %u\n"
+                "GnuTLSCacheExpired: %u\n"
+                "GnuTLSCacheEvicted: %u\n",
+                hit, miss,
+                apr_atomic_read32(&stats->fetch_error),
+                apr_atomic_read32(&stats->local_hit),
+                apr_atomic_read32(&stats->local_miss),
+                apr_atomic_read32(&stats->filter_skip),
+                apr_atomic_read32(&stats->store),
+                apr_atomic_read32(&stats->store_error),
+                apr_atomic_read32(&stats->store_dropped),
+                apr_atomic_read32(&stats->remove),
+                apr_atomic_read32(&stats->expire),
+                apr_atomic_read32(&stats->evict));
+        return;
+    }
 
-    strkey = mgs_session_id2mc(ctxt->c, key.data, key.size);
-    if (!strkey)
-        return -1;
+    ap_rprintf(r, "<dt>Session cache:</dt><dd>%s</dd>\n", type);
+    ap_rprintf(r, "<dt>Cache fetches:</dt><dd>%u hits, %u misses "
+            "(%u errors, %u skipped by filter), %.1f%% hit ratio</dd>\n",
+            hit, miss, apr_atomic_read32(&stats->fetch_error),
+            apr_atomic_read32(&stats->filter_skip),
+            hit + miss ? 100.0 * hit / (hit + miss) : 0.0);
+    if (stats->local_hit + stats->local_miss > 0)
+        ap_rprintf(r, "<dt>Local cache:</dt><dd>%u hits, %u misses</dd>\n",
+                apr_atomic_read32(&stats->local_hit),
+                apr_atomic_read32(&stats->local_miss));
+    ap_rprintf(r, "<dt>Cache stores:</dt><dd>%u (%u errors, %u dropped)"
+            "</dd>\n", apr_atomic_read32(&stats->store),
+            apr_atomic_read32(&stats->store_error),
+            apr_atomic_read32(&stats->store_dropped));
+    ap_rprintf(r, "<dt>Cache deletes:</dt><dd>%u</dd>\n",
+            apr_atomic_read32(&stats->remove));
+    ap_rprintf(r, "<dt>Cache expiries:</dt><dd>%u expired, %u evicted"
+            "</dd>\n",
+            apr_atomic_read32(&stats->expire),
+            apr_atomic_read32(&stats->evict));
+    stats_print_histogram(r, flags, "Fetch", stats->fetch_time);
+    stats_print_histogram(r, flags, "Store", stats->store_time);
+    stats_print_histogram(r, flags, "Delete", stats->remove_time);
+}
 
-    timeout = apr_time_sec(ctxt->sc->cache_timeout);
+/* Sessions are stored behind a small header naming the virtual host
+ * they were established with, so a resumed handshake can switch to it
+ * without looking at SNI again.  Entries without the header, written
+ * by older versions, are passed on as they are. */
+#define SESSION_VHOST_MAGIC 0x6d677631 /* "mgv1" */
+#define SESSION_VHOST_LEN 8
+
+static void session_u32_put(unsigned char *buf, apr_uint32_t v) {
+    buf[0] = v >> 24;
+    buf[1] = v >> 16;
+    buf[2] = v >> 8;
+    buf[3] = v;
+}
 
-    rv = apr_memcache_set(mc, strkey, (char *) data.data, data.size, timeout,
-            0);
+static apr_uint32_t session_u32_get(const unsigned char *buf) {
+    return (apr_uint32_t) buf[0] << 24 | (apr_uint32_t) buf[1] << 16
+            | (apr_uint32_t) buf[2] << 8 | buf[3];
+}
 
-    if (rv != APR_SUCCESS) {
-        ap_log_error(APLOG_MARK, APLOG_CRIT, rv,
-                ctxt->c->base_server,
-                "[gnutls_cache] error setting key '%s' "
-                "with %d bytes of data", strkey, data.size);
-        return -1;
-    }
+/**
+ * Per Virtual Host Partitions
+ *
+ * Every enabled virtual host gets a partition, numbered from 1, with
+ * its own counters; partition 0 collects the sessions of unknown hosts.
+ * A session belongs to the partition of the vhost ID in its header.
+ *
+ * In the shm table (the shm cache, or the GnuTLSCacheLocal table in
+ * front of memcache) a host with a GnuTLSCacheQuota may only fill that
+ * share of the slots.  Once it is over its quota, a new session of the
+ * host can only replace one of its own sessions in the same bucket, so
+ * a busy host cannot push the sessions of the others out.  Expired
+ * sessions count against the quota until their slot is reused.
+ */
 
-    return 0;
+typedef struct {
+    const char *name;
+    mgs_srvconf_rec *sc;
+    /* shm table slots the host may fill, 0 for no limit */
+    apr_uint32_t quota_slots;
+} cache_part_t;
+
+static apr_array_header_t *cache_parts;
+/* partition number by vhost ID */
+static apr_hash_t *cache_part_ids;
+/* the longest GnuTLSCacheTimeout of all hosts */
+static apr_interval_time_t cache_max_timeout;
+
+#define PART_INC(part, field) \
+    do { \
+        if (part_stats != NULL) \
+            apr_atomic_inc32(&part_stats[part].field); \
+    } while (0)
+
+static apr_status_t cache_parts_cleanup(void *data) {
+    cache_parts = NULL;
+    cache_part_ids = NULL;
+    return APR_SUCCESS;
 }
 
-static gnutls_datum_t mc_cache_fetch(void *baton, gnutls_datum_t key) {
-    apr_status_t rv = APR_SUCCESS;
-    mgs_handle_t *ctxt = baton;
-    char *strkey = NULL;
-    char *value;
-    apr_size_t value_len;
-    gnutls_datum_t data = {NULL, 0};
-
-    strkey = mgs_session_id2mc(ctxt->c, key.data, key.size);
-    if (!strkey) {
-        return data;
+int mgs_cache_partition_add(apr_pool_t * p, server_rec * s,
+        mgs_srvconf_rec * sc) {
+    cache_part_t *part;
+    int *number;
+
+    if (cache_parts == NULL) {
+        cache_parts = apr_array_make(p, 16, sizeof (cache_part_t));
+        cache_part_ids = apr_hash_make(p);
+        apr_pool_cleanup_register(p, NULL, cache_parts_cleanup,
+                apr_pool_cleanup_null);
     }
 
-    rv = apr_memcache_getp(mc, ctxt->c->pool, strkey,
-            &value, &value_len, NULL);
+    part = apr_array_push(cache_parts);
+    part->name = apr_psprintf(p, "%s:%d", s->server_hostname, s->port);
+    part->sc = sc;
+    part->quota_slots = 0;
 
-    if (rv != APR_SUCCESS) {
-#if MOD_GNUTLS_DEBUG
-        ap_log_error(APLOG_MARK, APLOG_DEBUG, rv,
-                ctxt->c->base_server,
-                "[gnutls_cache] error fetching key '%s' ",
-                strkey);
-#endif
-        data.size = 0;
-        data.data = NULL;
-        return data;
-    }
+    number = apr_palloc(p, sizeof (*number));
+    *number = cache_parts->nelts;
+    /* colliding IDs count towards the first host */
+    if (apr_hash_get(cache_part_ids, &sc->vhost_id,
+            sizeof (sc->vhost_id)) == NULL)
+        apr_hash_set(cache_part_ids, &sc->vhost_id, sizeof (sc->vhost_id),
+                number);
 
-    /* TODO: Eliminate this memcpy. gnutls-- */
-    data.data = gnutls_malloc(value_len);
-    if (data.data == NULL)
-        return data;
+    return *number;
+}
 
-    data.size = value_len;
-    memcpy(data.data, value, value_len);
+static int cache_part_find(apr_uint32_t vhost_id) {
+    int *number;
 
-    return data;
+    if (cache_part_ids == NULL)
+        return 0;
+    number = apr_hash_get(cache_part_ids, &vhost_id, sizeof (vhost_id));
+    return number != NULL ? *number : 0;
 }
 
-static int mc_cache_delete(void *baton, gnutls_datum_t key) {
-    apr_status_t rv = APR_SUCCESS;
-    mgs_handle_t *ctxt = baton;
-    char *strkey = NULL;
-
-    strkey = mgs_session_id2mc(ctxt->c, key.data, key.size);
-    if (!strkey)
-        return -1;
+/* The partition of a session as stored in the cache */
+static int cache_part_of(const gnutls_datum_t * data) {
+    if (data->size <= SESSION_VHOST_LEN
+            || session_u32_get(data->data) != SESSION_VHOST_MAGIC)
+        return 0;
+    return cache_part_find(session_u32_get(data->data + 4));
+}
 
-    rv = apr_memcache_delete(mc, strkey, 0);
+static apr_uint32_t cache_part_quota(int part) {
+    if (part == 0)
+        return 0;
+    return APR_ARRAY_IDX(cache_parts, part - 1, cache_part_t).quota_slots;
+}
 
-    if (rv != APR_SUCCESS) {
-        ap_log_error(APLOG_MARK, APLOG_DEBUG, rv,
-                ctxt->c->base_server,
-                "[gnutls_cache] error deleting key '%s' ",
-                strkey);
-        return -1;
+/* Give the hosts the cache timeout of the main server unless they set
+ * their own, and work out their quotas in a table of nslots slots */
+static void cache_parts_init(server_rec * s, mgs_srvconf_rec * sc,
+        apr_uint32_t nslots) {
+    int i, quotas = 0;
+
+    cache_max_timeout = sc->cache_timeout;
+    for (i = 0; cache_parts != NULL && i < cache_parts->nelts; i++) {
+        cache_part_t *part = &APR_ARRAY_IDX(cache_parts, i, cache_part_t);
+
+        if (part->sc->cache_timeout == -1)
+            part->sc->cache_timeout = sc->cache_timeout;
+        if (part->sc->cache_timeout > cache_max_timeout)
+            cache_max_timeout = part->sc->cache_timeout;
+
+        if (part->sc->cache_quota == 0)
+            continue;
+        quotas++;
+        part->quota_slots = (apr_uint64_t) nslots
+                * part->sc->cache_quota / 100;
+        if (part->quota_slots == 0)
+            part->quota_slots = 1;
     }
 
-    return 0;
+    if (quotas > 0 && nslots == 0)
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+                "GnuTLS: GnuTLSCacheQuota needs a shm table, "
+                "ignoring it with GnuTLSCache %s", cache->name);
 }
 
-#endif	/* have_apr_memcache */
+static void cache_parts_print(request_rec * r, int flags) {
+    int i;
+
+    for (i = 0; cache_parts != NULL && i < cache_parts->nelts; i++) {
+        cache_part_t *part = &APR_ARRAY_IDX(cache_parts, i, cache_part_t);
+        cache_part_stats_t *ps = &part_stats[i + 1];
+        apr_uint32_t hit = apr_atomic_read32(&ps->fetch_hit);
+        apr_uint32_t miss = apr_atomic_read32(&ps->fetch_miss);
+
+        if (flags & AP_STATUS_SHORT) {
+            ap_rprintf(r, "GnuTLSCacheHost: %s %u %u %u %u %u %u\n",
+                    part->name, hit, miss,
+                    apr_atomic_read32(&ps->store),
+                    apr_atomic_read32(&ps->used), part->quota_slots,
+                    apr_atomic_read32(&ps->over_quota));
+            continue;
+        }
 
-static const char *db_type(mgs_srvconf_rec * sc) {
-    if (sc->cache_type == mgs_cache_gdbm)
-        return "gdbm";
-    else
-        return "db";
+        ap_rprintf(r, "<dt>%s:</dt><dd>%u hits, %u misses, "
+                "%.1f%% hit ratio, %u stores",
+                ap_escape_html(r->pool, part->name), hit, miss,
+                hit + miss ? 100.0 * hit / (hit + miss) : 0.0,
+                apr_atomic_read32(&ps->store));
+        if (part->quota_slots != 0)
+            ap_rprintf(r, ", %u of %u cached, %u over quota",
+                    apr_atomic_read32(&ps->used), part->quota_slots,
+                    apr_atomic_read32(&ps->over_quota));
+        ap_rputs("</dd>\n", r);
+    }
 }
 
-#define SSL_DBM_FILE_MODE ( APR_UREAD | APR_UWRITE | APR_GREAD | APR_WREAD )
-
-static void dbm_cache_expire(mgs_handle_t * ctxt) {
-    apr_status_t rv;
-    apr_dbm_t *dbm;
-    apr_datum_t dbmkey;
-    apr_datum_t dbmval;
-    apr_time_t now;
-    apr_time_t dtime;
-    apr_pool_t *spool;
-    int total, deleted;
+/**
+ * Background Session Store
+ *
+ * Storing a session in DBM or memcache happens inside the handshake,
+ * but nobody needs the session before a later connection.  So each
+ * child queues stores for a writer thread instead, which hands them to
+ * the backend in batches.  When the queue is full the session is not
+ * cached at all, which is cheaper than making the handshake wait.
+ */
 
-    now = apr_time_now();
+/* A session on its way to the backend */
+typedef struct {
+    char *key;
+    apr_size_t key_len;
+    unsigned char *data;
+    apr_size_t data_len;
+    apr_time_t expiry;
+} store_item_t;
+
+/* Store a batch of sessions, returns the last error */
+typedef apr_status_t (*store_batch_fn) (server_rec * s,
+        mgs_srvconf_rec * sc, apr_pool_t * p, store_item_t * items, int n);
+
+#if APR_HAS_THREADS
+#define STORE_QUEUE_SIZE 256
+#define STORE_BATCH 32
+/* how long the writer waits for work before expiring sessions */
+#define STORE_IDLE_EXPIRE apr_time_from_sec(1)
+
+static struct {
+    store_item_t items[STORE_QUEUE_SIZE];
+    int head;
+    int count;
+    int stop;
+    apr_uint32_t dropped;
+    apr_thread_mutex_t *mutex;
+    apr_thread_cond_t *cond;
+    apr_thread_t *thread;
+    apr_pool_t *pool;
+    store_batch_fn write;
+    server_rec *s;
+    mgs_srvconf_rec *sc;
+} store_queue;
+
+/* Queued items own malloc()ed copies of key and data */
+static void store_item_free(store_item_t * item) {
+    free(item->key);
+    free(item->data);
+}
 
-    if (now - ctxt->sc->last_cache_check <
-            (ctxt->sc->cache_timeout) / 2)
-        return;
+static void *APR_THREAD_FUNC store_queue_thread(apr_thread_t * thd,
+        void *data) {
+    store_item_t batch[STORE_BATCH];
+    int n;
 
-    ctxt->sc->last_cache_check = now;
+    for (;;) {
+        apr_thread_mutex_lock(store_queue.mutex);
+        while (store_queue.count == 0 && !store_queue.stop) {
+            if (cache == NULL || cache->expire == NULL) {
+                apr_thread_cond_wait(store_queue.cond, store_queue.mutex);
+            } else if (apr_thread_cond_timedwait(store_queue.cond,
+                    store_queue.mutex, STORE_IDLE_EXPIRE)
+                    == APR_TIMEUP) {
+                apr_thread_mutex_unlock(store_queue.mutex);
+                cache->expire(store_queue.s, store_queue.sc,
+                        store_queue.pool);
+                apr_pool_clear(store_queue.pool);
+                apr_thread_mutex_lock(store_queue.mutex);
+            }
+        }
+        if (store_queue.count == 0) {
+            apr_thread_mutex_unlock(store_queue.mutex);
+            break;
+        }
+        for (n = 0; n < STORE_BATCH && store_queue.count > 0; n++) {
+            batch[n] = store_queue.items[store_queue.head];
+            store_queue.head = (store_queue.head + 1) % STORE_QUEUE_SIZE;
+            store_queue.count--;
+        }
+        apr_thread_mutex_unlock(store_queue.mutex);
 
-    apr_pool_create(&spool, ctxt->c->pool);
+        store_queue.write(store_queue.s, store_queue.sc, store_queue.pool,
+                batch, n);
+        apr_pool_clear(store_queue.pool);
+        while (n > 0)
+            store_item_free(&batch[--n]);
+    }
 
-    total = 0;
-    deleted = 0;
+    apr_thread_exit(thd, APR_SUCCESS);
+    return NULL;
+}
 
-    rv = apr_dbm_open_ex(&dbm, db_type(ctxt->sc),
-            ctxt->sc->cache_config, APR_DBM_RWCREATE,
-            SSL_DBM_FILE_MODE, spool);
-    if (rv != APR_SUCCESS) {
-        ap_log_error(APLOG_MARK, APLOG_NOTICE, rv,
-                ctxt->c->base_server,
-                "[gnutls_cache] error opening cache searcher '%s'",
-                ctxt->sc->cache_config);
-        apr_pool_destroy(spool);
-        return;
-    }
+/* Runs when the child exits: write what is left and stop the thread */
+static apr_status_t store_queue_cleanup(void *data) {
+    apr_status_t rv;
 
-    apr_dbm_firstkey(dbm, &dbmkey);
-    while (dbmkey.dptr != NULL) {
-        apr_dbm_fetch(dbm, dbmkey, &dbmval);
-        if (dbmval.dptr != NULL
-                && dbmval.dsize >= sizeof (apr_time_t)) {
-            memcpy(&dtime, dbmval.dptr, sizeof (apr_time_t));
-
-            if (now >= dtime) {
-                apr_dbm_delete(dbm, dbmkey);
-                deleted++;
-            }
-            apr_dbm_freedatum(dbm, dbmval);
-        } else {
-            apr_dbm_delete(dbm, dbmkey);
-            deleted++;
-        }
-        total++;
-        apr_dbm_nextkey(dbm, &dbmkey);
-    }
-    apr_dbm_close(dbm);
+    if (store_queue.thread == NULL)
+        return APR_SUCCESS;
 
-    ap_log_error(APLOG_MARK, APLOG_DEBUG, rv,
-            ctxt->c->base_server,
-            "[gnutls_cache] Cleaned up cache '%s'. Deleted %d and left %d",
-            ctxt->sc->cache_config, deleted, total - deleted);
+    apr_thread_mutex_lock(store_queue.mutex);
+    store_queue.stop = 1;
+    apr_thread_cond_signal(store_queue.cond);
+    apr_thread_mutex_unlock(store_queue.mutex);
 
-    apr_pool_destroy(spool);
+    apr_thread_join(&rv, store_queue.thread);
+    store_queue.thread = NULL;
 
-    return;
+    return APR_SUCCESS;
 }
 
-static gnutls_datum_t dbm_cache_fetch(void *baton, gnutls_datum_t key) {
-    gnutls_datum_t data = {NULL, 0};
-    apr_dbm_t *dbm;
-    apr_datum_t dbmkey;
-    apr_datum_t dbmval;
-    mgs_handle_t *ctxt = baton;
+static apr_status_t store_queue_start(apr_pool_t * p, server_rec * s,
+        mgs_srvconf_rec * sc, store_batch_fn write) {
     apr_status_t rv;
 
-    if (mgs_session_id2dbm(ctxt->c, key.data, key.size, &dbmkey) < 0)
-        return data;
-
-    rv = apr_dbm_open_ex(&dbm, db_type(ctxt->sc),
-            ctxt->sc->cache_config, APR_DBM_READONLY,
-            SSL_DBM_FILE_MODE, ctxt->c->pool);
+    store_queue.head = 0;
+    store_queue.count = 0;
+    store_queue.stop = 0;
+    store_queue.write = write;
+    store_queue.s = s;
+    store_queue.sc = sc;
+
+    rv = apr_thread_mutex_create(&store_queue.mutex,
+            APR_THREAD_MUTEX_DEFAULT, p);
+    if (rv == APR_SUCCESS)
+        rv = apr_thread_cond_create(&store_queue.cond, p);
+    if (rv == APR_SUCCESS)
+        rv = apr_pool_create(&store_queue.pool, p);
+    if (rv == APR_SUCCESS)
+        rv = apr_thread_create(&store_queue.thread, NULL,
+                store_queue_thread, NULL, p);
     if (rv != APR_SUCCESS) {
-        ap_log_error(APLOG_MARK, APLOG_NOTICE, rv,
-                ctxt->c->base_server,
-                "[gnutls_cache] error opening cache '%s'",
-                ctxt->sc->cache_config);
-        return data;
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s,
+                "[gnutls_cache] Failed to start the cache writer thread, "
+                "storing sessions synchronously");
+        store_queue.thread = NULL;
+        return rv;
     }
 
-    rv = apr_dbm_fetch(dbm, dbmkey, &dbmval);
+    /* before the subpools the thread uses go away */
+    apr_pool_pre_cleanup_register(p, NULL, store_queue_cleanup);
 
-    if (rv != APR_SUCCESS) {
-        apr_dbm_close(dbm);
-        return data;
-    }
+    return APR_SUCCESS;
+}
 
-    if (dbmval.dptr == NULL || dbmval.dsize <= sizeof (apr_time_t)) {
-        apr_dbm_freedatum(dbm, dbmval);
-        apr_dbm_close(dbm);
-        return data;
-    }
+/* Queue a session for the writer thread.  Returns 0 if it was queued
+ * or dropped because the queue is full, -1 if there is no writer and
+ * the caller has to store it itself. */
+static int store_queue_push(server_rec * s, const char *key,
+        apr_size_t key_len, gnutls_datum_t data, apr_time_t expiry) {
+    store_item_t *item;
 
-    data.size = dbmval.dsize - sizeof (apr_time_t);
+    if (store_queue.thread == NULL)
+        return -1;
 
-    data.data = gnutls_malloc(data.size);
-    if (data.data == NULL) {
-        apr_dbm_freedatum(dbm, dbmval);
-        apr_dbm_close(dbm);
-        return data;
+    apr_thread_mutex_lock(store_queue.mutex);
+    if (store_queue.count == STORE_QUEUE_SIZE) {
+        apr_thread_mutex_unlock(store_queue.mutex);
+        STATS_INC(store_dropped);
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
+                "[gnutls_cache] writer queue full, not caching session "
+                "(%u dropped)", apr_atomic_inc32(&store_queue.dropped) + 1);
+        return 0;
     }
 
-    memcpy(data.data, dbmval.dptr + sizeof (apr_time_t), data.size);
+    item = &store_queue.items[(store_queue.head + store_queue.count)
+            % STORE_QUEUE_SIZE];
+    item->key = malloc(key_len + 1);
+    item->data = malloc(data.size);
+    if (item->key == NULL || item->data == NULL) {
+        store_item_free(item);
+        apr_thread_mutex_unlock(store_queue.mutex);
+        return 0;
+    }
+    memcpy(item->key, key, key_len);
+    item->key[key_len] = '\0';
+    item->key_len = key_len;
+    memcpy(item->data, data.data, data.size);
+    item->data_len = data.size;
+    item->expiry = expiry;
+    store_queue.count++;
 
-    apr_dbm_freedatum(dbm, dbmval);
-    apr_dbm_close(dbm);
+    apr_thread_cond_signal(store_queue.cond);
+    apr_thread_mutex_unlock(store_queue.mutex);
 
-    return data;
+    return 0;
 }
+#else
+#define store_queue_push(s, key, key_len, data, expiry) (-1)
+#endif /* APR_HAS_THREADS */
 
-static int dbm_cache_store(void *baton, gnutls_datum_t key,
-        gnutls_datum_t data) {
-    apr_dbm_t *dbm;
-    apr_datum_t dbmkey;
+/**
+ * Filter of Issued Session IDs
+ *
+ * A Bloom filter in shared memory remembers the session IDs we stored,
+ * so that fetches for IDs we never issued (or long ago) can return
+ * without asking DBM or memcache.  Bits cannot be taken out of a Bloom
+ * filter, so there are two generations: new IDs go into the current
+ * one, lookups check both, and every GnuTLSCacheTimeout the older one
+ * is cleared and becomes current.  An ID thus stays for at least one
+ * timeout, which is as long as the backend keeps the session.  Deleted
+ * IDs stay in the filter, which only costs a backend lookup.
+ *
+ * The time since the filter was created, in timeouts, is its epoch and
+ * the current generation is the epoch's lowest bit.  The epoch is a
+ * 32 bit word that is only moved forward by compare-and-swap, so of
+ * all processes that see a new epoch exactly one clears a generation.
+ *
+ * The backend may hold sessions stored before the filter was created
+ * in a persistent DBM file, so the filter only answers "absent" once it
+ * has been running for a full timeout.  Backends that other servers
+ * may store sessions in (memcache, socache) cannot use the filter at
+ * all, since their sessions never reach this server's filter.
+ */
+#define FILTER_HASHES 4
+
+typedef struct {
+    apr_time_t created;
+    /* timeouts since created, when the current generation was last
+     * cleared */
+    apr_uint32_t epoch;
+    /* 32 bit words per generation */
+    apr_uint32_t nwords;
+    apr_uint32_t bits[1];
+} filter_header_t;
+
+static apr_shm_t *filter_shm;
+static filter_header_t *filter_hdr;
+static apr_time_t filter_timeout;
+
+static void filter_hash(const unsigned char *id, int idlen,
+        apr_uint32_t *h1, apr_uint32_t *h2) {
+    apr_ssize_t len = idlen;
+    apr_uint32_t fnv = 2166136261U;
+    int i;
+
+    *h1 = apr_hashfunc_default((const char *) id, &len);
+    for (i = 0; i < idlen; i++)
+        fnv = (fnv ^ id[i]) * 16777619U;
+    /* odd, so that the probes never repeat */
+    *h2 = fnv | 1;
+}
+
+/* Start a new generation if the current one is older than a timeout */
+static void filter_rotate(apr_time_t now) {
+    apr_uint32_t old = apr_atomic_read32(&filter_hdr->epoch);
+    apr_uint32_t epoch;
+
+    if (now < filter_hdr->created)
+        return;
+    epoch = (apr_uint32_t) ((now - filter_hdr->created) / filter_timeout);
+    if (epoch == old)
+        return;
+
+    /* One process wins.  IDs that others add to the new current
+     * generation while it is still being cleared may be lost, which
+     * costs those sessions a full handshake. */
+    if (apr_atomic_cas32(&filter_hdr->epoch, epoch, old) != old)
+        return;
+    if (epoch - old == 1)
+        memset(&filter_hdr->bits[(epoch & 1) * filter_hdr->nwords], 0,
+                filter_hdr->nwords * sizeof (apr_uint32_t));
+    else
+        /* nothing was added for a whole timeout, both are stale */
+        memset(filter_hdr->bits, 0,
+                2 * filter_hdr->nwords * sizeof (apr_uint32_t));
+}
+
+static void filter_add(const unsigned char *id, int idlen) {
+    apr_uint32_t h1, h2, bit, old, *words;
+    int i;
+
+    if (filter_hdr == NULL)
+        return;
+
+    filter_rotate(apr_time_now());
+
+    words = &filter_hdr->bits[(apr_atomic_read32(&filter_hdr->epoch) & 1)
+            * filter_hdr->nwords];
+    filter_hash(id, idlen, &h1, &h2);
+    for (i = 0; i < FILTER_HASHES; i++) {
+        bit = (h1 + i * h2) % (filter_hdr->nwords * 32);
+        do {
+            old = apr_atomic_read32(&words[bit / 32]);
+        } while ((old & (1U << (bit % 32))) == 0
+                && apr_atomic_cas32(&words[bit / 32],
+                old | (1U << (bit % 32)), old) != old);
+    }
+}
+
+static int filter_generation_has(apr_uint32_t *words, apr_uint32_t nbits,
+        apr_uint32_t h1, apr_uint32_t h2) {
+    apr_uint32_t bit;
+    int i;
+
+    for (i = 0; i < FILTER_HASHES; i++) {
+        bit = (h1 + i * h2) % nbits;
+        if ((words[bit / 32] & (1U << (bit % 32))) == 0)
+            return 0;
+    }
+    return 1;
+}
+
+/* Returns 1 if the ID was certainly never stored (in the last timeout) */
+static int filter_absent(const unsigned char *id, int idlen) {
+    apr_uint32_t h1, h2, nbits;
+    apr_time_t now;
+
+    if (filter_hdr == NULL)
+        return 0;
+
+    now = apr_time_now();
+    if (now - filter_hdr->created < filter_timeout)
+        return 0;
+    filter_rotate(now);
+
+    nbits = filter_hdr->nwords * 32;
+    filter_hash(id, idlen, &h1, &h2);
+    if (filter_generation_has(filter_hdr->bits, nbits, h1, h2)
+            || filter_generation_has(&filter_hdr->bits[filter_hdr->nwords],
+            nbits, h1, h2))
+        return 0;
+
+    STATS_INC(filter_skip);
+    return 1;
+}
+
+static apr_status_t filter_cleanup(void *data) {
+    filter_hdr = NULL;
+    return APR_SUCCESS;
+}
+
+static int filter_create(apr_pool_t * p, server_rec * s,
+        mgs_srvconf_rec * sc) {
+    apr_size_t size;
+    apr_status_t rv;
+    apr_uint32_t nwords;
+
+    if (cache_max_timeout <= 0) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+                "GnuTLS: GnuTLSCacheFilter needs a GnuTLSCacheTimeout, "
+                "ignoring it");
+        return APR_SUCCESS;
+    }
+
+    nwords = (sc->cache_filter_size / 2) / sizeof (apr_uint32_t);
+    if (nwords == 0) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                "GnuTLS: GnuTLSCacheFilter size is too small");
+        return APR_EINVAL;
+    }
+    size = APR_OFFSETOF(filter_header_t, bits)
+            + 2 * nwords * sizeof (apr_uint32_t);
+
+    rv = cache_shm_create(&filter_shm, size, "logs/gnutls_cache_filter_shm",
+            p);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                "GnuTLS: Cannot create session ID filter of %"
+                APR_SIZE_T_FMT " bytes", size);
+        return rv;
+    }
+
+    filter_hdr = apr_shm_baseaddr_get(filter_shm);
+    memset(filter_hdr, 0, size);
+    filter_hdr->created = apr_time_now();
+    filter_hdr->nwords = nwords;
+    filter_timeout = cache_max_timeout;
+    apr_pool_cleanup_register(p, NULL, filter_cleanup,
+            apr_pool_cleanup_null);
+
+    return APR_SUCCESS;
+}
+
+/* The shared memory table further down is also the local cache in
+ * front of memcache */
+typedef struct shm_header_t shm_header_t;
+static shm_header_t *shm_hdr;
+
+static int shm_cache_get(server_rec * s, const char *key,
+        apr_size_t key_len, gnutls_datum_t *data);
+static int shm_cache_put(server_rec * s, const char *key,
+        apr_size_t key_len, gnutls_datum_t data, apr_time_t expiry);
+static int shm_cache_remove(server_rec * s, const char *key,
+        apr_size_t key_len);
+static int shm_cache_create(apr_pool_t * p, server_rec * s,
+        apr_size_t size);
+static int shm_cache_child_init(apr_pool_t * p, server_rec * s,
+        mgs_srvconf_rec * sc);
+
+#if HAVE_APR_MEMCACHE
+
+/* Name the Session ID as:
+ * context.SessionID
+ * to disallow resuming sessions on different servers
+ */
+static char *mgs_session_id2mc(mgs_handle_t * ctxt, unsigned char *id,
+        int idlen) {
+    char buf[STR_SESSION_LEN];
+    char *sz;
+
+    sz = mgs_session_id2sz(id, idlen, buf, sizeof (buf));
+    if (sz == NULL)
+        return NULL;
+
+    return apr_psprintf(ctxt->c->pool, MC_TAG "%s.%s",
+            ctxt->session_context, sz);
+}
+
+/**
+ * GnuTLS Session Cache using libmemcached
+ *
+ * With GnuTLSCacheLocal, sessions are also kept in a shared memory
+ * table (see below) which is consulted before asking memcache.  A
+ * delete only reaches the local table of the server that handles it,
+ * so other servers may resume a deleted session until their copy
+ * expires.
+ */
+
+/* Every server gets its own apr_memcache_t, and we pick servers
+ * ourselves from a ketama style consistent hash ring: each server is
+ * placed at MC_RING_POINTS points on the ring, and a key is stored on
+ * the first GnuTLSCacheReplicas distinct servers found clockwise from
+ * the key's hash.  Adding or removing a server then only moves the
+ * keys next to its points, and a dead server's sessions can still be
+ * read from the other replicas.
+ *
+ * The underlying apr_memcache system is thread safe... woohoo */
+#define MC_RING_POINTS 160
+
+typedef struct {
+    apr_memcache_t *mc;
+    apr_memcache_server_t *server;
+    const char *name;
+} mc_node_t;
+
+typedef struct {
+    apr_uint32_t point;
+    int node;
+} mc_ring_point_t;
+
+/* Health of a server, shared by all children.  After
+ * MC_BREAKER_FAILURES errors in a row the server is skipped until
+ * retry_at; then a single request probes it, and every failed probe
+ * doubles the wait up to MC_BREAKER_BACKOFF_MAX.  A skipped server
+ * just means a cache miss, so the handshake goes on as a full one
+ * instead of waiting for a dead server. */
+#define MC_BREAKER_FAILURES 3
+#define MC_BREAKER_BACKOFF 5
+#define MC_BREAKER_BACKOFF_MAX 300
+
+typedef struct {
+    /* consecutive errors */
+    apr_uint32_t failures;
+    /* apr_time_sec() when to probe again, 0 while the server is up */
+    apr_uint32_t retry_at;
+    /* seconds to wait after the next failed probe */
+    apr_uint32_t backoff;
+    /* how often the breaker opened, for mod_status */
+    apr_uint32_t trips;
+} mc_health_t;
+
+/* Idle connections above the soft maximum are closed after this */
+#define MC_POOL_TTL apr_time_from_sec(60)
+
+static mc_node_t *mc_nodes;
+static int mc_nnodes;
+static apr_shm_t *mc_shm;
+static mc_health_t *mc_health;
+static mc_ring_point_t *mc_ring;
+static int mc_npoints;
+static int mc_replicas;
+
+static apr_uint32_t mc_ring_hash(const unsigned char *digest, int i) {
+    return ((apr_uint32_t) digest[3 + i * 4] << 24)
+            | ((apr_uint32_t) digest[2 + i * 4] << 16)
+            | ((apr_uint32_t) digest[1 + i * 4] << 8)
+            | digest[i * 4];
+}
+
+static int mc_ring_cmp(const void *a, const void *b) {
+    const mc_ring_point_t *pa = a;
+    const mc_ring_point_t *pb = b;
+
+    if (pa->point < pb->point)
+        return -1;
+    return pa->point > pb->point;
+}
+
+static void mc_ring_build(apr_pool_t * p) {
+    unsigned char digest[APR_MD5_DIGESTSIZE];
+    int i, j, k;
+
+    mc_npoints = mc_nnodes * MC_RING_POINTS;
+    mc_ring = apr_palloc(p, mc_npoints * sizeof (*mc_ring));
+
+    k = 0;
+    for (i = 0; i < mc_nnodes; i++) {
+        /* every digest gives four points */
+        for (j = 0; j < MC_RING_POINTS / 4; j++) {
+            const char *label = apr_psprintf(p, "%s-%d", mc_nodes[i].name, j);
+            int h;
+
+            apr_md5(digest, label, strlen(label));
+            for (h = 0; h < 4; h++) {
+                mc_ring[k].point = mc_ring_hash(digest, h);
+                mc_ring[k].node = i;
+                k++;
+            }
+        }
+    }
+
+    qsort(mc_ring, mc_npoints, sizeof (*mc_ring), mc_ring_cmp);
+}
+
+/* Fill nodes with the servers responsible for key, in the order they
+ * should be tried.  Returns the number of servers. */
+static int mc_ring_lookup(const char *key, int *nodes) {
+    unsigned char digest[APR_MD5_DIGESTSIZE];
+    apr_uint32_t hash;
+    int lo, hi, i, j, n;
+
+    apr_md5(digest, key, strlen(key));
+    hash = mc_ring_hash(digest, 0);
+
+    /* first point at or after hash */
+    lo = 0;
+    hi = mc_npoints;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (mc_ring[mid].point < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    n = 0;
+    for (i = 0; i < mc_npoints && n < mc_replicas; i++) {
+        int node = mc_ring[(lo + i) % mc_npoints].node;
+
+        for (j = 0; j < n; j++)
+            if (nodes[j] == node)
+                break;
+        if (j == n)
+            nodes[n++] = node;
+    }
+
+    return n;
+}
+
+/* May we talk to this server now? */
+static int mc_node_usable(int node) {
+    mc_health_t *h = &mc_health[node];
+    apr_uint32_t retry_at = apr_atomic_read32(&h->retry_at);
+    apr_uint32_t now;
+
+    if (retry_at == 0)
+        return 1;
+
+    now = apr_time_sec(apr_time_now());
+    if (now < retry_at)
+        return 0;
+
+    /* Let only the request that moves retry_at probe the server */
+    return apr_atomic_cas32(&h->retry_at,
+            now + apr_atomic_read32(&h->backoff), retry_at) == retry_at;
+}
+
+/* Record the result of a request to a server, and return whether the
+ * server failed.  apr_memcache also answers APR_NOTFOUND without
+ * asking a server it has marked dead after a connect or I/O error, so
+ * APR_NOTFOUND is only a miss, which says nothing about the server's
+ * health, while the server is live. */
+static int mc_node_report(server_rec * s, int node, apr_status_t rv) {
+    mc_health_t *h = &mc_health[node];
+    apr_uint32_t now, backoff;
+
+    if (rv == APR_NOTFOUND
+            && mc_nodes[node].server->status != APR_MC_SERVER_DEAD)
+        return 0;
+
+    if (rv == APR_SUCCESS) {
+        apr_atomic_set32(&h->failures, 0);
+        if (apr_atomic_xchg32(&h->retry_at, 0) != 0) {
+            apr_atomic_set32(&h->backoff, MC_BREAKER_BACKOFF);
+            ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, s,
+                    "[gnutls_cache] memcache server %s is back",
+                    mc_nodes[node].name);
+        }
+        return 0;
+    }
+
+    now = apr_time_sec(apr_time_now());
+    if (apr_atomic_read32(&h->retry_at) != 0) {
+        /* a probe failed, wait longer */
+        backoff = apr_atomic_read32(&h->backoff) * 2;
+        if (backoff > MC_BREAKER_BACKOFF_MAX)
+            backoff = MC_BREAKER_BACKOFF_MAX;
+        apr_atomic_set32(&h->backoff, backoff);
+        apr_atomic_set32(&h->retry_at, now + backoff);
+    } else if (apr_atomic_inc32(&h->failures) + 1 >= MC_BREAKER_FAILURES) {
+        apr_atomic_set32(&h->backoff, MC_BREAKER_BACKOFF);
+        apr_atomic_set32(&h->retry_at, now + MC_BREAKER_BACKOFF);
+        apr_atomic_inc32(&h->trips);
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s,
+                "[gnutls_cache] memcache server %s failed %d times, "
+                "skipping it for %d seconds", mc_nodes[node].name,
+                MC_BREAKER_FAILURES, MC_BREAKER_BACKOFF);
+    }
+    return 1;
+}
+
+static int mc_count_servers(apr_pool_t * p, const char *config) {
+    char *cache_config;
+    char *split;
+    char *tok;
+    int nservers = 0;
+
+    cache_config = apr_pstrdup(p, config);
+    split = apr_strtok(cache_config, " ", &tok);
+    while (split) {
+        nservers++;
+        split = apr_strtok(NULL, " ", &tok);
+    }
+    return nservers;
+}
+
+static apr_status_t mc_cache_cleanup(void *data) {
+    mc_health = NULL;
+    return APR_SUCCESS;
+}
+
+static int mc_cache_post_config(apr_pool_t * p, server_rec * s,
+        mgs_srvconf_rec * sc) {
+    apr_size_t size;
+    apr_status_t rv;
+    int i, nservers;
+
+    nservers = mc_count_servers(p, sc->cache_config);
+    if (nservers == 0) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                "GnuTLS: No servers given for memcache");
+        return APR_EINVAL;
+    }
+    size = nservers * sizeof (*mc_health);
+    rv = cache_shm_create(&mc_shm, size, "logs/gnutls_cache_mc_shm", p);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                "GnuTLS: Cannot create memcache health table");
+        return rv;
+    }
+    mc_health = apr_shm_baseaddr_get(mc_shm);
+    memset(mc_health, 0, size);
+    for (i = 0; i < nservers; i++)
+        mc_health[i].backoff = MC_BREAKER_BACKOFF;
+    apr_pool_cleanup_register(p, NULL, mc_cache_cleanup,
+            apr_pool_cleanup_null);
+
+    if (sc->cache_local_size == 0)
+        return APR_SUCCESS;
+
+    return shm_cache_create(p, s, sc->cache_local_size);
+}
+
+static apr_status_t mc_cache_write(server_rec * s, mgs_srvconf_rec * sc,
+        apr_pool_t * p, store_item_t * items, int n) {
+    apr_status_t rv, ret = APR_SUCCESS;
+    apr_time_t now = apr_time_now();
+    apr_uint32_t timeout;
+    int nodes[MAX_CACHE_REPLICAS];
+    int i, j, nnodes, stored;
+
+    for (i = 0; i < n; i++) {
+        if (items[i].expiry <= now)
+            continue;
+        timeout = apr_time_sec(items[i].expiry - now);
+        if (timeout == 0)
+            timeout = 1;
+
+        rv = APR_NOTFOUND;
+        stored = 0;
+        nnodes = mc_ring_lookup(items[i].key, nodes);
+        for (j = 0; j < nnodes; j++) {
+            if (!mc_node_usable(nodes[j]))
+                continue;
+            rv = apr_memcache_set(mc_nodes[nodes[j]].mc, items[i].key,
+                    (char *) items[i].data, items[i].data_len, timeout, 0);
+            mc_node_report(s, nodes[j], rv);
+            if (rv == APR_SUCCESS) {
+                stored++;
+            } else {
+                ap_log_error(APLOG_MARK, APLOG_NOTICE, rv, s,
+                        "[gnutls_cache] error setting key '%s' on %s",
+                        items[i].key, mc_nodes[nodes[j]].name);
+            }
+        }
+
+        if (stored == 0) {
+            STATS_INC(store_error);
+            ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s,
+                    "[gnutls_cache] error setting key '%s' "
+                    "with %" APR_SIZE_T_FMT " bytes of data",
+                    items[i].key, items[i].data_len);
+            ret = (rv == APR_SUCCESS) ? APR_EGENERAL : rv;
+        }
+    }
+
+    return ret;
+}
+
+static int mc_cache_child_init(apr_pool_t * p, server_rec * s,
+        mgs_srvconf_rec * sc) {
+    apr_status_t rv = APR_SUCCESS;
+    int threads = 0;
+    int nservers;
+    int pool_min, pool_smax, pool_max;
+    char *cache_config;
+    char *split;
+    char *tok;
+
+    if (shm_hdr != NULL) {
+        rv = shm_cache_child_init(p, s, sc);
+        if (rv != APR_SUCCESS)
+            return rv;
+    }
+
+    nservers = mc_count_servers(p, sc->cache_config);
+
+    mc_replicas = sc->cache_replicas;
+    if (mc_replicas > nservers)
+        mc_replicas = nservers;
+
+    /* Unless configured, allow a connection per thread in this child,
+     * and keep as many as a thread would use on average; the rest are
+     * closed when idle for MC_POOL_TTL */
+    ap_mpm_query(AP_MPMQ_MAX_THREADS, &threads);
+    if (threads < 1)
+        threads = 1;
+    pool_min = sc->cache_pool_min;
+    pool_smax = sc->cache_pool_smax;
+    pool_max = sc->cache_pool_max;
+    if (pool_max < 0)
+        pool_max = threads;
+    if (pool_smax < 0)
+        pool_smax = (pool_max * mc_replicas + nservers - 1) / nservers;
+    if (pool_min < 0)
+        pool_min = 0;
+
+    mc_nodes = apr_pcalloc(p, nservers * sizeof (*mc_nodes));
+    mc_nnodes = 0;
+
+    /* Now create a memcache for each server */
+    cache_config = apr_pstrdup(p, sc->cache_config);
+    split = apr_strtok(cache_config, " ", &tok);
+    while (split) {
+        apr_memcache_server_t *st;
+        mc_node_t *node = &mc_nodes[mc_nnodes];
+        char *host_str;
+        char *scope_id;
+        apr_port_t port;
+
+        rv = apr_parse_addr_port(&host_str, &scope_id, &port,
+                split, p);
+        if (rv != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s,
+                    "[gnutls_cache] Failed to Parse Server: '%s'",
+                    split);
+            return rv;
+        }
+
+        if (host_str == NULL) {
+            ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s,
+                    "[gnutls_cache] Failed to Parse Server, "
+                    "no hostname specified: '%s'", split);
+            return rv;
+        }
+
+        if (port == 0) {
+            port = 11211; /* default port */
+        }
+
+        rv = apr_memcache_create(p, 1, 0, &node->mc);
+        if (rv != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s,
+                    "[gnutls_cache] Failed to create Memcache Object "
+                    "for %s:%d", host_str, port);
+            return rv;
+        }
+
+        rv = apr_memcache_server_create(p,
+                host_str, port,
+                pool_min, pool_smax, pool_max, MC_POOL_TTL, &st);
+        if (rv != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s,
+                    "[gnutls_cache] Failed to Create Server: %s:%d",
+                    host_str, port);
+            return rv;
+        }
+
+        rv = apr_memcache_add_server(node->mc, st);
+        if (rv != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s,
+                    "[gnutls_cache] Failed to Add Server: %s:%d",
+                    host_str, port);
+            return rv;
+        }
+
+        node->server = st;
+        node->name = apr_psprintf(p, "%s:%d", host_str, port);
+        mc_nnodes++;
+
+        split = apr_strtok(NULL, " ", &tok);
+    }
+
+    mc_ring_build(p);
+
+#if APR_HAS_THREADS
+    store_queue_start(p, s, sc, mc_cache_write);
+#endif
+
+    return rv;
+}
+
+static int mc_cache_store(void *baton, gnutls_datum_t key,
+        gnutls_datum_t data) {
+    mgs_handle_t *ctxt = baton;
+    char *strkey = NULL;
+    store_item_t item;
+
+    strkey = mgs_session_id2mc(ctxt, key.data, key.size);
+    if (!strkey)
+        return -1;
+
+    item.expiry = apr_time_now() + ctxt->sc->cache_timeout;
+
+    shm_cache_put(ctxt->c->base_server, strkey, strlen(strkey), data,
+            item.expiry);
+    filter_add(key.data, key.size);
+
+    if (store_queue_push(ctxt->c->base_server, strkey, strlen(strkey),
+            data, item.expiry) == 0)
+        return 0;
+
+    item.key = strkey;
+    item.key_len = strlen(strkey);
+    item.data = data.data;
+    item.data_len = data.size;
+
+    if (mc_cache_write(ctxt->c->base_server, ctxt->sc, ctxt->c->pool,
+            &item, 1) != APR_SUCCESS)
+        return -1;
+
+    return 0;
+}
+
+static gnutls_datum_t mc_cache_fetch(void *baton, gnutls_datum_t key) {
+    apr_status_t rv = APR_SUCCESS;
+    mgs_handle_t *ctxt = baton;
+    char *strkey = NULL;
+    char *value;
+    apr_size_t value_len;
+    gnutls_datum_t data = {NULL, 0};
+    int nodes[MAX_CACHE_REPLICAS];
+    int i, n;
+
+    strkey = mgs_session_id2mc(ctxt, key.data, key.size);
+    if (!strkey) {
+        return data;
+    }
+
+    if (shm_hdr != NULL) {
+        if (shm_cache_get(ctxt->c->base_server, strkey, strlen(strkey),
+                &data) == 0) {
+            STATS_INC(local_hit);
+            return data;
+        }
+        STATS_INC(local_miss);
+    }
+
+    if (filter_absent(key.data, key.size))
+        return data;
+
+    /* try the replicas in ring order, so that a dead or restarted
+     * server only costs a miss */
+    rv = APR_NOTFOUND;
+    n = mc_ring_lookup(strkey, nodes);
+    for (i = 0; i < n && rv != APR_SUCCESS; i++) {
+        if (!mc_node_usable(nodes[i]))
+            continue;
+        rv = apr_memcache_getp(mc_nodes[nodes[i]].mc, ctxt->c->pool,
+                strkey, &value, &value_len, NULL);
+        if (mc_node_report(ctxt->c->base_server, nodes[i], rv))
+            STATS_INC(fetch_error);
+    }
+
+    if (rv != APR_SUCCESS) {
+#if MOD_GNUTLS_DEBUG
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, rv,
+                ctxt->c->base_server,
+                "[gnutls_cache] error fetching key '%s' ",
+                strkey);
+#endif
+        data.size = 0;
+        data.data = NULL;
+        return data;
+    }
+
+    /* TODO: Eliminate this memcpy. gnutls-- */
+    data.data = gnutls_malloc(value_len);
+    if (data.data == NULL)
+        return data;
+
+    data.size = value_len;
+    memcpy(data.data, value, value_len);
+
+    /* We don't know how long memcache will keep it, so give the local
+     * copy a full timeout */
+    shm_cache_put(ctxt->c->base_server, strkey, strlen(strkey), data,
+            apr_time_now() + ctxt->sc->cache_timeout);
+
+    return data;
+}
+
+static int mc_cache_delete(void *baton, gnutls_datum_t key) {
+    apr_status_t rv = APR_SUCCESS;
+    mgs_handle_t *ctxt = baton;
+    char *strkey = NULL;
+    int nodes[MAX_CACHE_REPLICAS];
+    int i, n, deleted = 0;
+
+    strkey = mgs_session_id2mc(ctxt, key.data, key.size);
+    if (!strkey)
+        return -1;
+
+    shm_cache_remove(ctxt->c->base_server, strkey, strlen(strkey));
+
+    rv = APR_NOTFOUND;
+    n = mc_ring_lookup(strkey, nodes);
+    for (i = 0; i < n; i++) {
+        if (!mc_node_usable(nodes[i]))
+            continue;
+        rv = apr_memcache_delete(mc_nodes[nodes[i]].mc, strkey, 0);
+        mc_node_report(ctxt->c->base_server, nodes[i], rv);
+        if (rv == APR_SUCCESS)
+            deleted++;
+    }
+
+    if (deleted == 0) {
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, rv,
+                ctxt->c->base_server,
+                "[gnutls_cache] error deleting key '%s' ",
+                strkey);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void mc_cache_status(request_rec * r, int flags) {
+    apr_uint32_t now = apr_time_sec(apr_time_now());
+    int i;
+
+    for (i = 0; i < mc_nnodes; i++) {
+        mc_health_t *h = &mc_health[i];
+        apr_uint32_t retry_at = apr_atomic_read32(&h->retry_at);
+        const char *state;
+
+        if (retry_at == 0)
+            state = "up";
+        else if (retry_at > now)
+            state = apr_psprintf(r->pool, "down, retry in %us",
+                    retry_at - now);
+        else
+            state = "down, retrying";
+
+        if (flags & AP_STATUS_SHORT) {
+            ap_rprintf(r, "GnuTLSMemcache%d: %s %s failures=%u trips=%u\n",
+                    i, mc_nodes[i].name, retry_at == 0 ? "up" : "down",
+                    apr_atomic_read32(&h->failures),
+                    apr_atomic_read32(&h->trips));
+        } else {
+            ap_rprintf(r, "<dt>memcache %s:</dt><dd>%s "
+                    "(%u errors, down %u times)</dd>\n",
+                    ap_escape_html(r->pool, mc_nodes[i].name), state,
+                    apr_atomic_read32(&h->failures),
+                    apr_atomic_read32(&h->trips));
+        }
+    }
+}
+
+#endif	/* have_apr_memcache */
+
+static const char *db_type(mgs_srvconf_rec * sc) {
+    if (sc->cache_type == mgs_cache_gdbm)
+        return "gdbm";
+    else
+        return "db";
+}
+
+#define SSL_DBM_FILE_MODE ( APR_UREAD | APR_UWRITE | APR_GREAD | APR_WREAD )
+
+/* Expiry index granularity in seconds, and how many index entries a
+ * single store may process */
+#define DBM_EXPIRE_SLOT 10
+#define DBM_EXPIRE_BATCH 16
+
+/* Keys of the expiry index. Session keys always start with a host
+ * name, so these can never collide with them. */
+#define DBM_INDEX_PREFIX "\001mod_gnutls:"
+#define DBM_CURSOR_KEY DBM_INDEX_PREFIX "cursor"
+
+/* With GnuTLSCacheShards N > 1 the sessions are spread over N DBM
+ * files, PATH.0 to PATH.N-1, by a hash of their key. Every shard has
+ * its own lock and expiry index, so children storing or fetching
+ * sessions of different shards do not wait for each other.
+ *
+ * All access to a shard happens with its lock held, which also
+ * serialises the children against each other. The file is opened when
+ * the lock is taken and closed before it is released: Berkeley DB only
+ * writes its cache back on close, and GDBM holds an exclusive lock on
+ * the file for as long as a writer has it open, so a handle kept open
+ * by one child would lock all the others out. The writer thread stores
+ * a whole batch of sessions with one open.
+ */
+typedef struct {
+    /* next expiry index entry to process */
+    apr_uint32_t expire_slot;
+    apr_uint32_t expire_seq;
+} dbm_shared_t;
+
+typedef struct {
+    const char *file;
+    apr_global_mutex_t *lock;
+    dbm_shared_t *shared;
+
+    /* per-child state, protected by lock */
+    apr_pool_t *pool;
+    apr_dbm_t *handle;
+} dbm_shard_t;
+
+static apr_shm_t *dbm_shm;
+static dbm_shard_t *dbm_shards;
+static int dbm_nshards;
+
+static dbm_shard_t *dbm_shard_for(const char *key, apr_size_t key_len) {
+    apr_ssize_t len = key_len;
+
+    if (dbm_nshards == 1)
+        return &dbm_shards[0];
+    return &dbm_shards[apr_hashfunc_default(key, &len) % dbm_nshards];
+}
+
+static void dbm_cache_close(dbm_shard_t * shard) {
+    if (shard->handle != NULL) {
+        apr_dbm_close(shard->handle);
+        shard->handle = NULL;
+        apr_pool_clear(shard->pool);
+    }
+}
+
+/* Open the shard's file. Must be called with the shard's lock held. */
+static apr_status_t dbm_cache_open(server_rec * s, mgs_srvconf_rec * sc,
+        dbm_shard_t * shard) {
+    apr_status_t rv;
+
+    rv = apr_dbm_open_ex(&shard->handle, db_type(sc), shard->file,
+            APR_DBM_RWCREATE, SSL_DBM_FILE_MODE, shard->pool);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_NOTICE, rv, s,
+                "[gnutls_cache] error opening cache '%s'", shard->file);
+        shard->handle = NULL;
+        return rv;
+    }
+
+    return APR_SUCCESS;
+}
+
+/* Take the shard's lock and open its file */
+static apr_status_t dbm_cache_lock(server_rec * s, mgs_srvconf_rec * sc,
+        dbm_shard_t * shard) {
+    apr_status_t rv;
+
+    rv = apr_global_mutex_lock(shard->lock);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_NOTICE, rv, s,
+                "[gnutls_cache] error locking cache '%s'", shard->file);
+        return rv;
+    }
+
+    rv = dbm_cache_open(s, sc, shard);
+    if (rv != APR_SUCCESS)
+        apr_global_mutex_unlock(shard->lock);
+
+    return rv;
+}
+
+/* Close the shard's file, which also flushes what was written, and
+ * release its lock */
+static void dbm_cache_unlock(dbm_shard_t * shard) {
+    dbm_cache_close(shard);
+    apr_global_mutex_unlock(shard->lock);
+}
+
+/* The expiry index
+ *
+ * Scanning the whole file for expired sessions gets slower the bigger
+ * the cache is. Instead, every store also records the session key in a
+ * time ordered index inside the DBM:
+ *
+ *   PREFIX "exp:SLOT"      number of entries in SLOT
+ *   PREFIX "exp:SLOT:SEQ"  session key expiring during SLOT
+ *   PREFIX "cursor"        next SLOT and SEQ to look at
+ *
+ * where SLOT is the expiry time divided by DBM_EXPIRE_SLOT seconds.
+ * Each store then walks at most DBM_EXPIRE_BATCH index entries of slots
+ * that are entirely in the past, so the cost of expiry stays constant
+ * no matter how large the cache gets. A session stored again after it
+ * was indexed is only deleted once its current expiry time has passed.
+ * Each shard has its own index, covering the sessions in its file.
+ */
+
+static apr_datum_t dbm_index_key(apr_pool_t * p, apr_uint32_t slot,
+        apr_uint32_t seq, int with_seq) {
+    apr_datum_t key;
+
+    if (with_seq)
+        key.dptr = apr_psprintf(p, DBM_INDEX_PREFIX "exp:%u:%u",
+                slot, seq);
+    else
+        key.dptr = apr_psprintf(p, DBM_INDEX_PREFIX "exp:%u", slot);
+    key.dsize = strlen(key.dptr);
+    return key;
+}
+
+static int dbm_fetch_u32(apr_dbm_t * dbm, apr_datum_t key,
+        apr_uint32_t * val, int n) {
+    apr_datum_t dbmval;
+
+    if (apr_dbm_fetch(dbm, key, &dbmval) != APR_SUCCESS
+            || dbmval.dptr == NULL)
+        return 0;
+    if (dbmval.dsize != n * sizeof (apr_uint32_t)) {
+        apr_dbm_freedatum(dbm, dbmval);
+        return 0;
+    }
+    memcpy(val, dbmval.dptr, dbmval.dsize);
+    apr_dbm_freedatum(dbm, dbmval);
+    return 1;
+}
+
+static apr_status_t dbm_store_u32(apr_dbm_t * dbm, apr_datum_t key,
+        apr_uint32_t * val, int n) {
+    apr_datum_t dbmval;
+
+    dbmval.dptr = (char *) val;
+    dbmval.dsize = n * sizeof (apr_uint32_t);
+    return apr_dbm_store(dbm, key, dbmval);
+}
+
+/* Returns the expiry time of a cached session, 0 if not found */
+static apr_time_t dbm_entry_expiry(apr_dbm_t * dbm, apr_datum_t key) {
+    apr_datum_t dbmval;
+    apr_time_t expiry = 0;
+
+    if (apr_dbm_fetch(dbm, key, &dbmval) != APR_SUCCESS
+            || dbmval.dptr == NULL)
+        return 0;
+    if (dbmval.dsize >= sizeof (apr_time_t))
+        memcpy(&expiry, dbmval.dptr, sizeof (apr_time_t));
+    apr_dbm_freedatum(dbm, dbmval);
+    return expiry;
+}
+
+/* Add a session key to the expiry index */
+static apr_status_t dbm_index_add(apr_dbm_t * dbm, apr_pool_t * p,
+        apr_datum_t dbmkey, apr_time_t expiry) {
+    apr_uint32_t slot = apr_time_sec(expiry) / DBM_EXPIRE_SLOT;
+    apr_uint32_t count = 0;
+    apr_datum_t ckey;
+    apr_status_t rv;
+
+    ckey = dbm_index_key(p, slot, 0, 0);
+    dbm_fetch_u32(dbm, ckey, &count, 1);
+
+    rv = apr_dbm_store(dbm, dbm_index_key(p, slot, count, 1), dbmkey);
+    if (rv != APR_SUCCESS)
+        return rv;
+
+    count++;
+    return dbm_store_u32(dbm, ckey, &count, 1);
+}
+
+/* Process up to DBM_EXPIRE_BATCH index entries of a shard. The shard's
+ * lock must be held. Passing over empty slots does not write the
+ * cursor. */
+static void dbm_cache_expire(dbm_shard_t * shard, apr_pool_t * p) {
+    apr_dbm_t *dbm = shard->handle;
+    dbm_shared_t *shared = shard->shared;
+    apr_uint32_t now_slot;
+    apr_uint32_t count, cursor[2];
+    apr_time_t now;
+    apr_datum_t ikey, ckey, skey, dbmval;
+    int work;
+    int modified = 0;
+
+    now = apr_time_now();
+    now_slot = apr_time_sec(now) / DBM_EXPIRE_SLOT;
+
+    for (work = 0; work < DBM_EXPIRE_BATCH
+            && shared->expire_slot < now_slot; work++) {
+        ckey = dbm_index_key(p, shared->expire_slot, 0, 0);
+        count = 0;
+        if (!dbm_fetch_u32(dbm, ckey, &count, 1)
+                || shared->expire_seq >= count) {
+            /* slot is empty or done */
+            if (count > 0) {
+                apr_dbm_delete(dbm, ckey);
+                modified = 1;
+            }
+            shared->expire_slot++;
+            shared->expire_seq = 0;
+            continue;
+        }
+
+        ikey = dbm_index_key(p, shared->expire_slot, shared->expire_seq, 1);
+        if (apr_dbm_fetch(dbm, ikey, &dbmval) == APR_SUCCESS
+                && dbmval.dptr != NULL) {
+            skey.dptr = apr_pstrmemdup(p, dbmval.dptr, dbmval.dsize);
+            skey.dsize = dbmval.dsize;
+            apr_dbm_freedatum(dbm, dbmval);
+            if (now >= dbm_entry_expiry(dbm, skey)) {
+                apr_dbm_delete(dbm, skey);
+                STATS_INC(expire);
+            }
+            apr_dbm_delete(dbm, ikey);
+            modified = 1;
+        }
+        shared->expire_seq++;
+    }
+
+    if (modified) {
+        cursor[0] = shared->expire_slot;
+        cursor[1] = shared->expire_seq;
+        ckey.dptr = DBM_CURSOR_KEY;
+        ckey.dsize = sizeof (DBM_CURSOR_KEY) - 1;
+        dbm_store_u32(dbm, ckey, cursor, 2);
+    }
+}
+
+static void dbm_cache_expire_idle(server_rec * s, mgs_srvconf_rec * sc,
+        apr_pool_t * p) {
+    apr_uint32_t now_slot = apr_time_sec(apr_time_now()) / DBM_EXPIRE_SLOT;
+    int i;
+
+    for (i = 0; i < dbm_nshards; i++) {
+        dbm_shard_t *shard = &dbm_shards[i];
+
+        /* unlocked peek, a stale value only delays the work */
+        if (shard->shared->expire_slot >= now_slot)
+            continue;
+
+        if (dbm_cache_lock(s, sc, shard) != APR_SUCCESS)
+            continue;
+        dbm_cache_expire(shard, p);
+        dbm_cache_unlock(shard);
+    }
+}
+
+static gnutls_datum_t dbm_cache_fetch(void *baton, gnutls_datum_t key) {
+    gnutls_datum_t data = {NULL, 0};
+    apr_datum_t dbmkey;
+    apr_datum_t dbmval;
+    mgs_handle_t *ctxt = baton;
+    dbm_shard_t *shard;
+    apr_status_t rv;
+    apr_time_t expiry;
+
+    if (filter_absent(key.data, key.size))
+        return data;
+
+    if (mgs_session_id2dbm(ctxt, key.data, key.size, &dbmkey) < 0)
+        return data;
+
+    shard = dbm_shard_for(dbmkey.dptr, dbmkey.dsize);
+    if (dbm_cache_lock(ctxt->c->base_server, ctxt->sc, shard)
+            != APR_SUCCESS) {
+        STATS_INC(fetch_error);
+        return data;
+    }
+
+    rv = apr_dbm_fetch(shard->handle, dbmkey, &dbmval);
+
+    if (rv != APR_SUCCESS) {
+        STATS_INC(fetch_error);
+        dbm_cache_unlock(shard);
+        return data;
+    }
+
+    if (dbmval.dptr == NULL || dbmval.dsize <= sizeof (apr_time_t)) {
+        apr_dbm_freedatum(shard->handle, dbmval);
+        dbm_cache_unlock(shard);
+        return data;
+    }
+
+    memcpy(&expiry, dbmval.dptr, sizeof (apr_time_t));
+    if (apr_time_now() >= expiry) {
+        /* left for the expiry index to remove */
+        apr_dbm_freedatum(shard->handle, dbmval);
+        dbm_cache_unlock(shard);
+        return data;
+    }
+
+    data.size = dbmval.dsize - sizeof (apr_time_t);
+
+    data.data = gnutls_malloc(data.size);
+    if (data.data == NULL) {
+        data.size = 0;
+        apr_dbm_freedatum(shard->handle, dbmval);
+        dbm_cache_unlock(shard);
+        return data;
+    }
+
+    memcpy(data.data, dbmval.dptr + sizeof (apr_time_t), data.size);
+
+    apr_dbm_freedatum(shard->handle, dbmval);
+    dbm_cache_unlock(shard);
+
+    return data;
+}
+
+/* Store the items of a batch that belong to one shard, under a single
+ * acquisition of its lock. */
+static apr_status_t dbm_cache_write_shard(server_rec * s,
+        mgs_srvconf_rec * sc, dbm_shard_t * shard, apr_pool_t * p,
+        store_item_t * items, dbm_shard_t ** item_shards, int n) {
+    apr_datum_t dbmkey;
     apr_datum_t dbmval;
+    apr_status_t rv, ret = APR_SUCCESS;
+    int i, count = 0;
+
+    for (i = 0; i < n; i++)
+        if (item_shards[i] == shard)
+            count++;
+
+    rv = dbm_cache_lock(s, sc, shard);
+    if (rv != APR_SUCCESS) {
+        if (stats != NULL)
+            apr_atomic_add32(&stats->store_error, count);
+        return rv;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (item_shards[i] != shard)
+            continue;
+
+        dbmkey.dptr = items[i].key;
+        dbmkey.dsize = items[i].key_len;
+
+        /* create DBM value */
+        dbmval.dsize = items[i].data_len + sizeof (apr_time_t);
+        dbmval.dptr = (char *) apr_palloc(p, dbmval.dsize);
+
+        memcpy((char *) dbmval.dptr, &items[i].expiry, sizeof (apr_time_t));
+        memcpy((char *) dbmval.dptr + sizeof (apr_time_t),
+                items[i].data, items[i].data_len);
+
+        /* we expire dbm only on every store, a bounded batch at a time
+         */
+        dbm_cache_expire(shard, p);
+
+        rv = apr_dbm_store(shard->handle, dbmkey, dbmval);
+        if (rv == APR_SUCCESS)
+            rv = dbm_index_add(shard->handle, p, dbmkey, items[i].expiry);
+
+        if (rv != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_DEBUG, rv, s,
+                    "[gnutls_cache] error storing in cache '%s'",
+                    shard->file);
+            STATS_INC(store_error);
+            ret = rv;
+        }
+    }
+
+    dbm_cache_unlock(shard);
+
+    return ret;
+}
+
+static apr_status_t dbm_cache_write(server_rec * s, mgs_srvconf_rec * sc,
+        apr_pool_t * p, store_item_t * items, int n) {
+    dbm_shard_t **item_shards;
+    apr_status_t rv, ret = APR_SUCCESS;
+    int i, j;
+
+    item_shards = apr_palloc(p, n * sizeof (*item_shards));
+    for (i = 0; i < n; i++)
+        item_shards[i] = dbm_shard_for(items[i].key, items[i].key_len);
+
+    /* visit each shard of the batch once, in the order of first use */
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < i && item_shards[j] != item_shards[i]; j++)
+            ;
+        if (j < i)
+            continue;
+        rv = dbm_cache_write_shard(s, sc, item_shards[i], p, items,
+                item_shards, n);
+        if (rv != APR_SUCCESS)
+            ret = rv;
+    }
+
+    return ret;
+}
+
+static int dbm_cache_store(void *baton, gnutls_datum_t key,
+        gnutls_datum_t data) {
+    apr_datum_t dbmkey;
+    mgs_handle_t *ctxt = baton;
+    apr_status_t rv;
+    apr_pool_t *spool;
+    store_item_t item;
+
+    if (mgs_session_id2dbm(ctxt, key.data, key.size, &dbmkey) < 0)
+        return -1;
+
+    item.expiry = apr_time_now() + ctxt->sc->cache_timeout;
+    filter_add(key.data, key.size);
+
+    if (store_queue_push(ctxt->c->base_server, dbmkey.dptr, dbmkey.dsize,
+            data, item.expiry) == 0)
+        return 0;
+
+    item.key = dbmkey.dptr;
+    item.key_len = dbmkey.dsize;
+    item.data = data.data;
+    item.data_len = data.size;
+
+    apr_pool_create(&spool, ctxt->c->pool);
+    rv = dbm_cache_write(ctxt->c->base_server, ctxt->sc, spool, &item, 1);
+    apr_pool_destroy(spool);
+
+    return rv == APR_SUCCESS ? 0 : -1;
+}
+
+/* Load the expiry cursor of a shard. A cache file written before the
+ * expiry index existed has no cursor; its sessions are indexed (or
+ * dropped if already expired) once, before any child is started. */
+static apr_status_t dbm_cache_load_index(apr_dbm_t * dbm, apr_pool_t * p,
+        server_rec * s, dbm_shard_t * shard) {
+    apr_array_header_t *keys;
+    apr_datum_t ckey, dbmkey;
+    apr_uint32_t cursor[2];
+    apr_time_t now, expiry;
+    int i, indexed = 0, deleted = 0;
+
+    ckey.dptr = DBM_CURSOR_KEY;
+    ckey.dsize = sizeof (DBM_CURSOR_KEY) - 1;
+    if (dbm_fetch_u32(dbm, ckey, cursor, 2)) {
+        shard->shared->expire_slot = cursor[0];
+        shard->shared->expire_seq = cursor[1];
+        return APR_SUCCESS;
+    }
+
+    now = apr_time_now();
+    shard->shared->expire_slot = apr_time_sec(now) / DBM_EXPIRE_SLOT;
+    shard->shared->expire_seq = 0;
+
+    /* collect first, the DBM cannot be modified while iterating */
+    keys = apr_array_make(p, 64, sizeof (apr_datum_t));
+    apr_dbm_firstkey(dbm, &dbmkey);
+    while (dbmkey.dptr != NULL) {
+        dbmkey.dptr = apr_pstrmemdup(p, dbmkey.dptr, dbmkey.dsize);
+        APR_ARRAY_PUSH(keys, apr_datum_t) = dbmkey;
+        apr_dbm_nextkey(dbm, &dbmkey);
+    }
+
+    for (i = 0; i < keys->nelts; i++) {
+        dbmkey = APR_ARRAY_IDX(keys, i, apr_datum_t);
+        expiry = dbm_entry_expiry(dbm, dbmkey);
+        if (now >= expiry) {
+            apr_dbm_delete(dbm, dbmkey);
+            deleted++;
+        } else {
+            dbm_index_add(dbm, p, dbmkey, expiry);
+            indexed++;
+        }
+    }
+
+    cursor[0] = shard->shared->expire_slot;
+    cursor[1] = shard->shared->expire_seq;
+    if (keys->nelts > 0)
+        ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, s,
+                "GnuTLS: Built expiry index for DBM Cache at `%s': "
+                "indexed %d and deleted %d sessions",
+                shard->file, indexed, deleted);
+    return dbm_store_u32(dbm, ckey, cursor, 2);
+}
+
+static int dbm_cache_delete(void *baton, gnutls_datum_t key) {
+    apr_datum_t dbmkey;
+    mgs_handle_t *ctxt = baton;
+    dbm_shard_t *shard;
+    apr_status_t rv;
+
+    if (mgs_session_id2dbm(ctxt, key.data, key.size, &dbmkey) < 0)
+        return -1;
+
+    shard = dbm_shard_for(dbmkey.dptr, dbmkey.dsize);
+    if (dbm_cache_lock(ctxt->c->base_server, ctxt->sc, shard)
+            != APR_SUCCESS)
+        return -1;
+
+    rv = apr_dbm_delete(shard->handle, dbmkey);
+
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_NOTICE, rv,
+                ctxt->c->base_server,
+                "[gnutls_cache] error deleting from cache '%s'",
+                shard->file);
+        dbm_cache_unlock(shard);
+        return -1;
+    }
+
+    dbm_cache_unlock(shard);
+
+    return 0;
+}
+
+/* Create (or open) the file of one shard and build its index */
+static int dbm_shard_post_config(apr_pool_t * p, server_rec * s,
+        mgs_srvconf_rec * sc, dbm_shard_t * shard) {
+    apr_status_t rv;
+    apr_dbm_t *dbm;
+    const char *path1;
+    const char *path2;
+
+    rv = apr_dbm_open_ex(&dbm, db_type(sc), shard->file,
+            APR_DBM_RWCREATE, SSL_DBM_FILE_MODE, p);
+
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                "GnuTLS: Cannot create DBM Cache at `%s'", shard->file);
+        return rv;
+    }
+
+    rv = cache_mutex_create(&shard->lock, s, p);
+    if (rv != APR_SUCCESS) {
+        apr_dbm_close(dbm);
+        return rv;
+    }
+
+    rv = dbm_cache_load_index(dbm, p, s, shard);
+    apr_dbm_close(dbm);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                "GnuTLS: Cannot build expiry index for DBM Cache at `%s'",
+                shard->file);
+        return rv;
+    }
+
+    apr_dbm_get_usednames_ex(p, db_type(sc), shard->file, &path1, &path2);
+
+    /* The Following Code takes logic directly from mod_ssl's DBM Cache */
+#if !defined(OS2) && !defined(WIN32) && !defined(BEOS) && !defined(NETWARE)
+    /* Running as Root */
+    if (path1 && geteuid() == 0) {
+        if (0 != chown(path1, ap_unixd_config.user_id, -1))
+            ap_log_error(APLOG_MARK, APLOG_NOTICE, -1, s,
+                         "GnuTLS: could not chown cache path1 `%s' to uid %d (errno: %d)",
+                         path1, ap_unixd_config.user_id, errno);
+        if (path2 != NULL) {
+            if (0 != chown(path2, ap_unixd_config.user_id, -1))
+                ap_log_error(APLOG_MARK, APLOG_NOTICE, -1, s,
+                             "GnuTLS: could not chown cache path2 `%s' to uid %d (errno: %d)",
+                             path2, ap_unixd_config.user_id, errno);
+        }
+    }
+#endif
+
+    return rv;
+}
+
+static int dbm_cache_post_config(apr_pool_t * p, server_rec * s,
+        mgs_srvconf_rec * sc) {
+    dbm_shared_t *shared;
+    apr_status_t rv;
+    int i;
+
+    dbm_nshards = sc->cache_shards;
+    dbm_shards = apr_pcalloc(p, dbm_nshards * sizeof (*dbm_shards));
+
+    rv = cache_shm_create(&dbm_shm, dbm_nshards * sizeof (dbm_shared_t),
+            "logs/gnutls_cache_dbm_shm", p);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                "GnuTLS: Cannot create shared memory for DBM Cache");
+        return rv;
+    }
+    shared = apr_shm_baseaddr_get(dbm_shm);
+    memset(shared, 0, dbm_nshards * sizeof (dbm_shared_t));
+
+    for (i = 0; i < dbm_nshards; i++) {
+        dbm_shards[i].shared = &shared[i];
+        if (dbm_nshards == 1)
+            dbm_shards[i].file = sc->cache_config;
+        else
+            dbm_shards[i].file = apr_psprintf(p, "%s.%d",
+                    sc->cache_config, i);
+
+        rv = dbm_shard_post_config(p, s, sc, &dbm_shards[i]);
+        if (rv != APR_SUCCESS)
+            return rv;
+    }
+
+    return APR_SUCCESS;
+}
+
+static int dbm_cache_child_init(apr_pool_t * p, server_rec * s,
+        mgs_srvconf_rec * sc) {
+    apr_status_t rv;
+    int i;
+
+    for (i = 0; i < dbm_nshards; i++) {
+        dbm_shard_t *shard = &dbm_shards[i];
+
+        rv = apr_global_mutex_child_init(&shard->lock,
+                apr_global_mutex_lockfile(shard->lock), p);
+        if (rv != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s,
+                    "[gnutls_cache] Failed to attach to DBM cache lock");
+            return rv;
+        }
+
+        apr_pool_create(&shard->pool, p);
+        shard->handle = NULL;
+    }
+
+#if APR_HAS_THREADS
+    store_queue_start(p, s, sc, dbm_cache_write);
+#endif
+
+    return APR_SUCCESS;
+}
+
+/**
+ * GnuTLS Session Cache in Shared Memory
+ *
+ * The segment holds a fixed number of buckets, each with SHM_BUCKET_WAYS
+ * slots. A key hashes to exactly one bucket, so lookups probe at most
+ * SHM_BUCKET_WAYS slots. When a bucket is full the victim is chosen with
+ * the CLOCK algorithm: slots that were used since the hand last passed
+ * get a second chance. Buckets are protected by a set of striped global
+ * mutexes so that children only contend when they touch the same stripe.
+ */
+
+#define SHM_BUCKET_WAYS 8
+#define SHM_STRIPES 16
+#define SHM_KEY_MAX 320
+#define SHM_DATA_MAX 2048
+#define SHM_MAGIC 0x4d475331 /* "MGS1" */
+
+typedef struct {
+    /* Expiration time, only valid if key_len != 0 */
+    apr_time_t expiry;
+    /* Full hash of the key, to avoid most key comparisons */
+    apr_uint32_t hash;
+    /* CLOCK reference bit */
+    apr_uint32_t referenced;
+    /* Key length, 0 means the slot is free */
+    apr_uint16_t key_len;
+    apr_uint16_t data_len;
+    /* Partition of the session, see cache_parts */
+    apr_uint32_t part;
+    char key[SHM_KEY_MAX];
+    unsigned char data[SHM_DATA_MAX];
+} shm_slot_t;
+
+typedef struct {
+    /* CLOCK hand */
+    apr_uint32_t hand;
+    shm_slot_t slots[SHM_BUCKET_WAYS];
+} shm_bucket_t;
+
+struct shm_header_t {
+    apr_uint32_t magic;
+    apr_uint32_t nbuckets;
+    /* Last snapshot, in seconds since the epoch */
+    apr_uint32_t snapshot_time;
+    shm_bucket_t buckets[1];
+};
+
+static apr_shm_t *shm_cache;
+static apr_global_mutex_t *shm_locks[SHM_STRIPES];
+
+#define shm_lock_for(b) (shm_locks[(b) % SHM_STRIPES])
+
+/* Empty a slot and give it back to its partition */
+static void shm_slot_free(shm_slot_t *slot) {
+    if (slot->key_len != 0 && part_stats != NULL)
+        apr_atomic_dec32(&part_stats[slot->part].used);
+    slot->key_len = 0;
+}
+
+/* Parse the size given to "GnuTLSCache shm", returns 0 if invalid */
+static apr_size_t shm_cache_size(const char *config) {
+    char *end;
+    apr_int64_t size;
+
+    if (config == NULL)
+        return 0;
+    size = apr_strtoi64(config, &end, 10);
+    if (*end != '\0' || size < (apr_int64_t) sizeof (shm_header_t))
+        return 0;
+    return (apr_size_t) size;
+}
+
+/* Look up a key in a bucket; returns the slot or NULL. Expired
+ * entries encountered on the way are released.
+ * Must be called with the bucket's stripe lock held. */
+static shm_slot_t *shm_bucket_find(shm_bucket_t *bucket, apr_uint32_t hash,
+        const char *key, apr_size_t key_len, apr_time_t now) {
+    int i;
+
+    for (i = 0; i < SHM_BUCKET_WAYS; i++) {
+        shm_slot_t *slot = &bucket->slots[i];
+        if (slot->key_len == 0)
+            continue;
+        if (now >= slot->expiry) {
+            shm_slot_free(slot);
+            STATS_INC(expire);
+            continue;
+        }
+        if (slot->hash == hash && slot->key_len == key_len
+                && memcmp(slot->key, key, key_len) == 0)
+            return slot;
+    }
+    return NULL;
+}
+
+/* Pick a slot to store a new entry in: a free or expired one if
+ * available, otherwise evict with CLOCK.
+ * Must be called with the bucket's stripe lock held. */
+static shm_slot_t *shm_bucket_victim(shm_bucket_t *bucket, apr_time_t now) {
+    int i;
+
+    for (i = 0; i < SHM_BUCKET_WAYS; i++) {
+        shm_slot_t *slot = &bucket->slots[i];
+        if (slot->key_len == 0 || now >= slot->expiry)
+            return slot;
+    }
+
+    /* at most two sweeps: the first clears every reference bit */
+    for (i = 0; i < 2 * SHM_BUCKET_WAYS; i++) {
+        shm_slot_t *slot = &bucket->slots[bucket->hand];
+        bucket->hand = (bucket->hand + 1) % SHM_BUCKET_WAYS;
+        if (!slot->referenced)
+            return slot;
+        slot->referenced = 0;
+    }
+    return &bucket->slots[bucket->hand];
+}
+
+/* Pick one of the sessions of a partition that is over its quota to
+ * replace: an expired one, or the one that expires first.  Returns
+ * NULL if the bucket holds none of them.
+ * Must be called with the bucket's stripe lock held. */
+static shm_slot_t *shm_bucket_own_victim(shm_bucket_t *bucket, int part,
+        apr_time_t now) {
+    shm_slot_t *victim = NULL;
+    int i;
+
+    for (i = 0; i < SHM_BUCKET_WAYS; i++) {
+        shm_slot_t *slot = &bucket->slots[i];
+        if (slot->key_len == 0 || slot->part != (apr_uint32_t) part)
+            continue;
+        if (now >= slot->expiry)
+            return slot;
+        if (victim == NULL || slot->expiry < victim->expiry)
+            victim = slot;
+    }
+    return victim;
+}
+
+/* Find the bucket for a key and lock its stripe */
+static apr_status_t shm_lock_bucket(server_rec * s, const char *key,
+        apr_size_t key_len, apr_uint32_t *hash, apr_uint32_t *b) {
+    apr_ssize_t len = key_len;
+    apr_status_t rv;
+
+    *hash = apr_hashfunc_default(key, &len);
+    *b = *hash % shm_hdr->nbuckets;
+
+    rv = apr_global_mutex_lock(shm_lock_for(*b));
+    if (rv != APR_SUCCESS)
+        ap_log_error(APLOG_MARK, APLOG_NOTICE, rv, s,
+                "[gnutls_cache] error locking shm cache");
+    return rv;
+}
+
+/* Copy an entry out of the cache into gnutls_malloc()ed memory.
+ * Returns 0 if found. */
+static int shm_cache_get(server_rec * s, const char *key,
+        apr_size_t key_len, gnutls_datum_t *data) {
+    apr_uint32_t hash, b;
+    shm_slot_t *slot;
+    int ret = -1;
+
+    if (shm_hdr == NULL)
+        return -1;
+
+    if (shm_lock_bucket(s, key, key_len, &hash, &b) != APR_SUCCESS)
+        return -1;
+
+    slot = shm_bucket_find(&shm_hdr->buckets[b], hash, key, key_len,
+            apr_time_now());
+    if (slot != NULL) {
+        data->data = gnutls_malloc(slot->data_len);
+        if (data->data != NULL) {
+            data->size = slot->data_len;
+            memcpy(data->data, slot->data, slot->data_len);
+            slot->referenced = 1;
+            ret = 0;
+        }
+    }
+
+    apr_global_mutex_unlock(shm_lock_for(b));
+
+    return ret;
+}
+
+static int shm_cache_put(server_rec * s, const char *key,
+        apr_size_t key_len, gnutls_datum_t data, apr_time_t expiry) {
+    apr_uint32_t hash, b, quota;
+    apr_time_t now;
+    shm_slot_t *slot;
+    int part;
+
+    if (shm_hdr == NULL)
+        return -1;
+
+    if (key_len > SHM_KEY_MAX || data.size > SHM_DATA_MAX) {
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
+                "[gnutls_cache] session too large for shm cache "
+                "(%d bytes)", data.size);
+        return -1;
+    }
+
+    if (shm_lock_bucket(s, key, key_len, &hash, &b) != APR_SUCCESS)
+        return -1;
+
+    now = apr_time_now();
+    part = cache_part_of(&data);
+    quota = cache_part_quota(part);
+    slot = shm_bucket_find(&shm_hdr->buckets[b], hash, key, key_len, now);
+    if (slot == NULL) {
+        if (quota != 0 && part_stats != NULL
+                && apr_atomic_read32(&part_stats[part].used) >= quota)
+            slot = shm_bucket_own_victim(&shm_hdr->buckets[b], part, now);
+        else
+            slot = shm_bucket_victim(&shm_hdr->buckets[b], now);
+        if (slot == NULL) {
+            apr_global_mutex_unlock(shm_lock_for(b));
+            PART_INC(part, over_quota);
+            return -1;
+        }
+        if (slot->key_len != 0)
+            STATS_INC(evict);
+    }
+
+    shm_slot_free(slot);
+    PART_INC(part, used);
+    slot->part = part;
+    slot->hash = hash;
+    slot->expiry = expiry;
+    slot->referenced = 1;
+    slot->key_len = key_len;
+    slot->data_len = data.size;
+    memcpy(slot->key, key, key_len);
+    memcpy(slot->data, data.data, data.size);
+
+    apr_global_mutex_unlock(shm_lock_for(b));
+
+    return 0;
+}
+
+static int shm_cache_remove(server_rec * s, const char *key,
+        apr_size_t key_len) {
+    apr_uint32_t hash, b;
+    shm_slot_t *slot;
+
+    if (shm_hdr == NULL)
+        return -1;
+
+    if (shm_lock_bucket(s, key, key_len, &hash, &b) != APR_SUCCESS)
+        return -1;
+
+    slot = shm_bucket_find(&shm_hdr->buckets[b], hash, key, key_len,
+            apr_time_now());
+    if (slot != NULL)
+        shm_slot_free(slot);
+
+    apr_global_mutex_unlock(shm_lock_for(b));
+
+    return 0;
+}
+
+static gnutls_datum_t shm_cache_fetch(void *baton, gnutls_datum_t key) {
+    gnutls_datum_t data = {NULL, 0};
+    mgs_handle_t *ctxt = baton;
+    apr_datum_t dbmkey;
+
+    if (mgs_session_id2dbm(ctxt, key.data, key.size, &dbmkey) < 0)
+        return data;
+
+    shm_cache_get(ctxt->c->base_server, dbmkey.dptr, dbmkey.dsize, &data);
+
+    return data;
+}
+
+static int shm_cache_store(void *baton, gnutls_datum_t key,
+        gnutls_datum_t data) {
+    mgs_handle_t *ctxt = baton;
+    apr_datum_t dbmkey;
+
+    if (mgs_session_id2dbm(ctxt, key.data, key.size, &dbmkey) < 0)
+        return -1;
+
+    return shm_cache_put(ctxt->c->base_server, dbmkey.dptr, dbmkey.dsize,
+            data, apr_time_now() + ctxt->sc->cache_timeout);
+}
+
+static int shm_cache_delete(void *baton, gnutls_datum_t key) {
+    mgs_handle_t *ctxt = baton;
+    apr_datum_t dbmkey;
+
+    if (mgs_session_id2dbm(ctxt, key.data, key.size, &dbmkey) < 0)
+        return -1;
+
+    return shm_cache_remove(ctxt->c->base_server, dbmkey.dptr,
+            dbmkey.dsize);
+}
+
+static apr_status_t shm_cache_cleanup(void *data) {
+    shm_hdr = NULL;
+    return APR_SUCCESS;
+}
+
+/* Create the shared memory table, used by "GnuTLSCache shm" and as the
+ * local cache in front of memcache */
+static int shm_cache_create(apr_pool_t * p, server_rec * s,
+        apr_size_t size) {
+    apr_status_t rv;
+    int i;
+
+    rv = cache_shm_create(&shm_cache, size, "logs/gnutls_cache_shm", p);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                "GnuTLS: Cannot create shm cache of %" APR_SIZE_T_FMT
+                " bytes", size);
+        return rv;
+    }
+
+    size = apr_shm_size_get(shm_cache);
+    shm_hdr = apr_shm_baseaddr_get(shm_cache);
+    memset(shm_hdr, 0, size);
+    shm_hdr->magic = SHM_MAGIC;
+    shm_hdr->nbuckets = (size - APR_OFFSETOF(shm_header_t, buckets))
+            / sizeof (shm_bucket_t);
+    apr_pool_cleanup_register(p, NULL, shm_cache_cleanup,
+            apr_pool_cleanup_null);
+    if (shm_hdr->nbuckets == 0) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                "GnuTLS: shm cache of %" APR_SIZE_T_FMT " bytes is too "
+                "small, need at least %" APR_SIZE_T_FMT, size,
+                (apr_size_t) sizeof (shm_header_t));
+        return APR_EINVAL;
+    }
+
+    for (i = 0; i < SHM_STRIPES; i++) {
+        rv = cache_mutex_create(&shm_locks[i], s, p);
+        if (rv != APR_SUCCESS)
+            return rv;
+    }
+
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
+            "GnuTLS: shm cache has %u buckets of %d entries",
+            shm_hdr->nbuckets, SHM_BUCKET_WAYS);
+
+    return APR_SUCCESS;
+}
+
+static int shm_cache_post_config(apr_pool_t * p, server_rec * s,
+        mgs_srvconf_rec * sc) {
+    apr_size_t size;
+
+    size = shm_cache_size(sc->cache_config);
+    if (size == 0) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                "GnuTLS: Invalid size '%s' for shm cache",
+                sc->cache_config);
+        return APR_EINVAL;
+    }
+
+    return shm_cache_create(p, s, size);
+}
+
+static int shm_cache_child_init(apr_pool_t * p, server_rec * s,
+        mgs_srvconf_rec * sc) {
+    apr_status_t rv;
+    int i;
+
+    for (i = 0; i < SHM_STRIPES; i++) {
+        rv = apr_global_mutex_child_init(&shm_locks[i],
+                apr_global_mutex_lockfile(shm_locks[i]), p);
+        if (rv != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s,
+                    "[gnutls_cache] Failed to attach to shm cache lock");
+            return rv;
+        }
+    }
+    return APR_SUCCESS;
+}
+
+/**
+ * Snapshots of the Shared Memory Cache
+ *
+ * GnuTLSCacheSnapshot saves the live entries of the shm table (the shm
+ * cache, or the GnuTLSCacheLocal table in front of memcache) to a file
+ * when the parent shuts down or restarts, and every INTERVAL from a
+ * thread in one of the children, never from inside a handshake.
+ * post_config restores the file, skipping the sessions that expired
+ * in between.
+ *
+ * The file holds SNAPSHOT_MAGIC followed by one snapshot_record_t per
+ * session, each followed by its key and data. It is only meant to be
+ * read back by the same build on the same host.
+ */
+
+#define SNAPSHOT_MAGIC 0x4d475353 /* "MGSS" */
+
+typedef struct {
+    apr_time_t expiry;
+    apr_uint16_t key_len;
+    apr_uint16_t data_len;
+} snapshot_record_t;
+
+static const char *snapshot_file;
+static apr_interval_time_t snapshot_interval;
+/* Set in the process that restored the snapshot, cleared in children */
+static int snapshot_owner;
+
+static apr_status_t shm_snapshot_write(apr_pool_t * p, server_rec * s) {
+    apr_file_t *fp;
+    char *tmp = apr_pstrcat(p, snapshot_file, ".XXXXXX", NULL);
+    apr_uint32_t magic = SNAPSHOT_MAGIC;
+    apr_time_t now = apr_time_now();
+    shm_bucket_t *bucket;
+    apr_uint32_t b;
+    apr_status_t rv;
+    int i, count = 0;
+
+    rv = apr_file_mktemp(&fp, tmp,
+            APR_CREATE | APR_WRITE | APR_EXCL | APR_BUFFERED, p);
+    if (rv != APR_SUCCESS)
+        return rv;
+
+    rv = apr_file_write_full(fp, &magic, sizeof (magic), NULL);
+
+    /* copy each bucket out so that its stripe is not held during I/O */
+    bucket = apr_palloc(p, sizeof (*bucket));
+    for (b = 0; rv == APR_SUCCESS && b < shm_hdr->nbuckets; b++) {
+        rv = apr_global_mutex_lock(shm_lock_for(b));
+        if (rv != APR_SUCCESS)
+            break;
+        memcpy(bucket, &shm_hdr->buckets[b], sizeof (*bucket));
+        apr_global_mutex_unlock(shm_lock_for(b));
+
+        for (i = 0; rv == APR_SUCCESS && i < SHM_BUCKET_WAYS; i++) {
+            shm_slot_t *slot = &bucket->slots[i];
+            snapshot_record_t rec;
+
+            if (slot->key_len == 0 || now >= slot->expiry)
+                continue;
+            rec.expiry = slot->expiry;
+            rec.key_len = slot->key_len;
+            rec.data_len = slot->data_len;
+            rv = apr_file_write_full(fp, &rec, sizeof (rec), NULL);
+            if (rv == APR_SUCCESS)
+                rv = apr_file_write_full(fp, slot->key, slot->key_len, NULL);
+            if (rv == APR_SUCCESS)
+                rv = apr_file_write_full(fp, slot->data, slot->data_len,
+                    NULL);
+            count++;
+        }
+    }
+
+    if (rv == APR_SUCCESS)
+        rv = apr_file_close(fp);
+    else
+        apr_file_close(fp);
+    if (rv == APR_SUCCESS)
+        rv = apr_file_rename(tmp, snapshot_file, p);
+    if (rv != APR_SUCCESS) {
+        apr_file_remove(tmp, p);
+        return rv;
+    }
+
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
+            "GnuTLS: Saved %d sessions to `%s'", count, snapshot_file);
+    return APR_SUCCESS;
+}
+
+/* Restore the sessions of a snapshot that have not expired yet. Ones
+ * valid for longer than GnuTLSCacheTimeout are cut short. */
+static void shm_snapshot_load(apr_pool_t * p, server_rec * s,
+        mgs_srvconf_rec * sc) {
+    apr_file_t *fp;
+    apr_uint32_t magic;
+    apr_time_t now = apr_time_now();
+    char *key = apr_palloc(p, SHM_KEY_MAX);
+    unsigned char *data = apr_palloc(p, SHM_DATA_MAX);
+    snapshot_record_t rec;
+    apr_status_t rv;
+    int total = 0, restored = 0;
+
+    rv = apr_file_open(&fp, snapshot_file, APR_READ | APR_BUFFERED,
+            APR_OS_DEFAULT, p);
+    if (APR_STATUS_IS_ENOENT(rv))
+        return;
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s,
+                "GnuTLS: Cannot open session cache snapshot `%s'",
+                snapshot_file);
+        return;
+    }
+
+    rv = apr_file_read_full(fp, &magic, sizeof (magic), NULL);
+    if (rv != APR_SUCCESS || magic != SNAPSHOT_MAGIC) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+                "GnuTLS: `%s' is not a session cache snapshot, ignoring it",
+                snapshot_file);
+        apr_file_close(fp);
+        return;
+    }
+
+    while (apr_file_read_full(fp, &rec, sizeof (rec), NULL) == APR_SUCCESS) {
+        gnutls_datum_t datum;
+
+        if (rec.key_len > SHM_KEY_MAX || rec.data_len > SHM_DATA_MAX
+                || apr_file_read_full(fp, key, rec.key_len, NULL)
+                != APR_SUCCESS
+                || apr_file_read_full(fp, data, rec.data_len, NULL)
+                != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+                    "GnuTLS: Session cache snapshot `%s' is truncated",
+                    snapshot_file);
+            break;
+        }
+        total++;
+
+        if (now >= rec.expiry)
+            continue;
+        if (rec.expiry > now + cache_max_timeout)
+            rec.expiry = now + cache_max_timeout;
+        datum.data = data;
+        datum.size = rec.data_len;
+        if (shm_cache_put(s, key, rec.key_len, datum, rec.expiry) == 0)
+            restored++;
+    }
+
+    apr_file_close(fp);
+    ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, s,
+            "GnuTLS: Restored %d of %d sessions from `%s'",
+            restored, total, snapshot_file);
+}
+
+/* Save the snapshot when the configuration pool of the parent goes
+ * away, i.e. on shutdown and restarts */
+static apr_status_t shm_snapshot_cleanup(void *data) {
+    server_rec *s = data;
+    apr_pool_t *p;
+    apr_status_t rv;
+
+    if (!snapshot_owner || shm_hdr == NULL)
+        return APR_SUCCESS;
+    snapshot_owner = 0;
+
+    if (apr_pool_create(&p, NULL) != APR_SUCCESS)
+        return APR_SUCCESS;
+    rv = shm_snapshot_write(p, s);
+    if (rv != APR_SUCCESS)
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s,
+                "GnuTLS: Cannot save session cache snapshot `%s'",
+                snapshot_file);
+    apr_pool_destroy(p);
+    return APR_SUCCESS;
+}
+
+static void shm_snapshot_init(apr_pool_t * p, server_rec * s,
+        mgs_srvconf_rec * sc) {
+    snapshot_file = sc->cache_snapshot_file;
+    snapshot_interval = sc->cache_snapshot_interval;
+
+    shm_snapshot_load(p, s, sc);
+    shm_hdr->snapshot_time = (apr_uint32_t) apr_time_sec(apr_time_now());
+
+    snapshot_owner = 1;
+    apr_pool_cleanup_register(p, s, shm_snapshot_cleanup,
+            apr_pool_cleanup_null);
+}
+
+/* Called by the snapshot threads of the children: the first one to
+ * see that a periodic snapshot is due writes it */
+static void shm_snapshot_tick(server_rec * s) {
+    apr_uint32_t now = (apr_uint32_t) apr_time_sec(apr_time_now());
+    apr_uint32_t last = shm_hdr->snapshot_time;
+    apr_pool_t *p;
+    apr_status_t rv;
+
+    if (now - last < (apr_uint32_t) apr_time_sec(snapshot_interval))
+        return;
+    if (apr_atomic_cas32(&shm_hdr->snapshot_time, now, last) != last)
+        return;
+
+    if (apr_pool_create(&p, NULL) != APR_SUCCESS)
+        return;
+    rv = shm_snapshot_write(p, s);
+    if (rv != APR_SUCCESS)
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s,
+                "GnuTLS: Cannot save session cache snapshot `%s'",
+                snapshot_file);
+    apr_pool_destroy(p);
+}
+
+#if APR_HAS_THREADS
+/* how often the snapshot threads look whether a snapshot is due */
+#define SNAPSHOT_CHECK apr_time_from_sec(1)
+
+static struct {
+    int stop;
+    apr_thread_mutex_t *mutex;
+    apr_thread_cond_t *cond;
+    apr_thread_t *thread;
+    server_rec *s;
+} snapshot_thread;
+
+static void *APR_THREAD_FUNC shm_snapshot_thread(apr_thread_t * thd,
+        void *data) {
+    apr_interval_time_t wait = snapshot_interval < SNAPSHOT_CHECK
+            ? snapshot_interval : SNAPSHOT_CHECK;
+
+    apr_thread_mutex_lock(snapshot_thread.mutex);
+    while (!snapshot_thread.stop) {
+        if (apr_thread_cond_timedwait(snapshot_thread.cond,
+                snapshot_thread.mutex, wait) != APR_TIMEUP)
+            continue;
+        apr_thread_mutex_unlock(snapshot_thread.mutex);
+        shm_snapshot_tick(snapshot_thread.s);
+        apr_thread_mutex_lock(snapshot_thread.mutex);
+    }
+    apr_thread_mutex_unlock(snapshot_thread.mutex);
+
+    apr_thread_exit(thd, APR_SUCCESS);
+    return NULL;
+}
+
+/* Runs when the child exits: stop the thread */
+static apr_status_t shm_snapshot_thread_cleanup(void *data) {
+    apr_status_t rv;
+
+    if (snapshot_thread.thread == NULL)
+        return APR_SUCCESS;
+
+    apr_thread_mutex_lock(snapshot_thread.mutex);
+    snapshot_thread.stop = 1;
+    apr_thread_cond_signal(snapshot_thread.cond);
+    apr_thread_mutex_unlock(snapshot_thread.mutex);
+
+    apr_thread_join(&rv, snapshot_thread.thread);
+    snapshot_thread.thread = NULL;
+
+    return APR_SUCCESS;
+}
+
+static void shm_snapshot_thread_start(apr_pool_t * p, server_rec * s) {
+    apr_status_t rv;
+
+    snapshot_thread.stop = 0;
+    snapshot_thread.s = s;
+
+    rv = apr_thread_mutex_create(&snapshot_thread.mutex,
+            APR_THREAD_MUTEX_DEFAULT, p);
+    if (rv == APR_SUCCESS)
+        rv = apr_thread_cond_create(&snapshot_thread.cond, p);
+    if (rv == APR_SUCCESS)
+        rv = apr_thread_create(&snapshot_thread.thread, NULL,
+                shm_snapshot_thread, NULL, p);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s,
+                "GnuTLS: Failed to start the cache snapshot thread, "
+                "saving `%s' only on shutdown", snapshot_file);
+        snapshot_thread.thread = NULL;
+        return;
+    }
+
+    apr_pool_pre_cleanup_register(p, NULL, shm_snapshot_thread_cleanup);
+}
+#else
+static void shm_snapshot_thread_start(apr_pool_t * p, server_rec * s) {
+    ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+            "GnuTLS: Periodic cache snapshots need thread support, "
+            "saving `%s' only on shutdown", snapshot_file);
+}
+#endif
+
+#if HAVE_LMDB
+/**
+ * GnuTLS Session Cache using LMDB
+ *
+ * "GnuTLSCache lmdb PATH[(SIZE)]" keeps the sessions in the LMDB
+ * environment PATH (with its lock file PATH-lock), memory mapped with
+ * room for SIZE bytes, LMDB_DEFAULT_SIZE if not given. Fetches are
+ * read-only transactions that take no lock and copy the session
+ * straight out of the map. Stores are write transactions, which LMDB
+ * serialises between all children; a batch from the background writer
+ * shares a single one.
+ *
+ * The environment holds two databases:
+ *
+ *   "sessions"  session key -> expiry time, session data
+ *   "expiry"    expiry time (big-endian) and session key -> nothing
+ *
+ * Every write transaction walks "expiry" from its start and removes up
+ * to LMDB_EXPIRE_BATCH sessions that expired. A session stored again
+ * after it was indexed is only removed once its current expiry passed.
+ *
+ * The environment must not be carried across fork(), so post_config
+ * only creates it and every child opens its own.
+ */
+
+#define LMDB_DEFAULT_SIZE (64 * 1024 * 1024)
+#define LMDB_EXPIRE_BATCH 32
+#define LMDB_TIME_LEN 8
+
+static MDB_env *lmdb_env;
+static MDB_dbi lmdb_sessions;
+static MDB_dbi lmdb_expiry;
+static const char *lmdb_path;
+static apr_size_t lmdb_size;
+
+/* Split "PATH(SIZE)" into lmdb_path and lmdb_size */
+static int lmdb_parse_config(apr_pool_t * p, const char *config) {
+    const char *paren = ap_strchr_c(config, '(');
+    apr_int64_t size;
+    char *end;
+
+    lmdb_path = config;
+    lmdb_size = LMDB_DEFAULT_SIZE;
+    if (paren == NULL)
+        return 0;
+
+    size = apr_strtoi64(paren + 1, &end, 10);
+    if (size <= 0 || strcmp(end, ")") != 0)
+        return -1;
+    lmdb_path = apr_pstrmemdup(p, config, paren - config);
+    lmdb_size = (apr_size_t) size;
+    return 0;
+}
+
+static void lmdb_time_put(unsigned char *buf, apr_time_t t) {
+    apr_uint64_t v = (apr_uint64_t) t;
+    int i;
+
+    for (i = LMDB_TIME_LEN - 1; i >= 0; i--, v >>= 8)
+        buf[i] = v & 0xff;
+}
+
+static apr_time_t lmdb_time_get(const unsigned char *buf) {
+    apr_uint64_t v = 0;
+    int i;
+
+    for (i = 0; i < LMDB_TIME_LEN; i++)
+        v = (v << 8) | buf[i];
+    return (apr_time_t) v;
+}
+
+/* Open lmdb_env and its databases, creating them if asked to */
+static int lmdb_env_open(server_rec * s, int create) {
+    MDB_txn *txn;
+    int threads = 1, daemons = 1;
+    unsigned int dbi_flags = create ? MDB_CREATE : 0;
+    int rc;
+
+    ap_mpm_query(AP_MPMQ_MAX_THREADS, &threads);
+    ap_mpm_query(AP_MPMQ_MAX_DAEMONS, &daemons);
+    if (threads < 1)
+        threads = 1;
+    if (daemons < 1)
+        daemons = 1;
+
+    rc = mdb_env_create(&lmdb_env);
+    if (rc != 0)
+        goto error;
+    rc = mdb_env_set_mapsize(lmdb_env, lmdb_size);
+    if (rc == 0)
+        rc = mdb_env_set_maxdbs(lmdb_env, 2);
+    /* with MDB_NOTLS a reader slot is only held during a fetch */
+    if (rc == 0)
+        rc = mdb_env_set_maxreaders(lmdb_env, threads * daemons + 126);
+    /* without the meta page sync a system crash may lose the last
+     * sessions stored, but never corrupts the file */
+    if (rc == 0)
+        rc = mdb_env_open(lmdb_env, lmdb_path,
+                MDB_NOSUBDIR | MDB_NOTLS | MDB_NOMETASYNC, 0600);
+    if (rc != 0) {
+        mdb_env_close(lmdb_env);
+        lmdb_env = NULL;
+        goto error;
+    }
+
+    rc = mdb_txn_begin(lmdb_env, NULL, 0, &txn);
+    if (rc == 0) {
+        rc = mdb_dbi_open(txn, "sessions", dbi_flags, &lmdb_sessions);
+        if (rc == 0)
+            rc = mdb_dbi_open(txn, "expiry", dbi_flags, &lmdb_expiry);
+        if (rc == 0)
+            rc = mdb_txn_commit(txn);
+        else
+            mdb_txn_abort(txn);
+    }
+    if (rc != 0) {
+        mdb_env_close(lmdb_env);
+        lmdb_env = NULL;
+        goto error;
+    }
+
+    return 0;
+
+error:
+    ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+            "GnuTLS: Cannot open LMDB Cache at `%s': %s",
+            lmdb_path, mdb_strerror(rc));
+    return rc;
+}
+
+static apr_status_t lmdb_env_cleanup(void *data) {
+    if (lmdb_env != NULL)
+        mdb_env_close(lmdb_env);
+    lmdb_env = NULL;
+    return APR_SUCCESS;
+}
+
+/* Remove up to LMDB_EXPIRE_BATCH expired sessions, returns how many
+ * index entries were processed */
+static int lmdb_cache_expire(MDB_txn * txn, apr_time_t now) {
+    MDB_cursor *cursor;
+    MDB_val ikey, ival, skey, sval;
+    int work, rc;
+
+    if (mdb_cursor_open(txn, lmdb_expiry, &cursor) != 0)
+        return 0;
+
+    rc = mdb_cursor_get(cursor, &ikey, &ival, MDB_FIRST);
+    for (work = 0; rc == 0 && work < LMDB_EXPIRE_BATCH; work++) {
+        if (ikey.mv_size <= LMDB_TIME_LEN
+                || lmdb_time_get(ikey.mv_data) > now)
+            break;
+
+        skey.mv_data = (char *) ikey.mv_data + LMDB_TIME_LEN;
+        skey.mv_size = ikey.mv_size - LMDB_TIME_LEN;
+        if (mdb_get(txn, lmdb_sessions, &skey, &sval) == 0
+                && sval.mv_size >= LMDB_TIME_LEN
+                && lmdb_time_get(sval.mv_data) <= now) {
+            mdb_del(txn, lmdb_sessions, &skey, NULL);
+            STATS_INC(expire);
+        }
+
+        if (mdb_cursor_del(cursor, 0) != 0)
+            break;
+        rc = mdb_cursor_get(cursor, &ikey, &ival, MDB_NEXT);
+    }
+
+    mdb_cursor_close(cursor);
+    return work;
+}
+
+static apr_status_t lmdb_cache_write(server_rec * s, mgs_srvconf_rec * sc,
+        apr_pool_t * p, store_item_t * items, int n) {
+    MDB_txn *txn;
+    int i, rc;
+
+    rc = mdb_txn_begin(lmdb_env, NULL, 0, &txn);
+    if (rc == 0) {
+        lmdb_cache_expire(txn, apr_time_now());
+
+        for (i = 0; rc == 0 && i < n; i++) {
+            MDB_val key, val, ikey, empty;
+            unsigned char *ibuf;
+
+            key.mv_data = items[i].key;
+            key.mv_size = items[i].key_len;
+            val.mv_size = LMDB_TIME_LEN + items[i].data_len;
+            rc = mdb_put(txn, lmdb_sessions, &key, &val, MDB_RESERVE);
+            if (rc != 0)
+                break;
+            lmdb_time_put(val.mv_data, items[i].expiry);
+            memcpy((char *) val.mv_data + LMDB_TIME_LEN, items[i].data,
+                    items[i].data_len);
+
+            ibuf = apr_palloc(p, LMDB_TIME_LEN + items[i].key_len);
+            lmdb_time_put(ibuf, items[i].expiry);
+            memcpy(ibuf + LMDB_TIME_LEN, items[i].key, items[i].key_len);
+            ikey.mv_data = ibuf;
+            ikey.mv_size = LMDB_TIME_LEN + items[i].key_len;
+            empty.mv_data = NULL;
+            empty.mv_size = 0;
+            rc = mdb_put(txn, lmdb_expiry, &ikey, &empty, 0);
+        }
+
+        if (rc == 0)
+            rc = mdb_txn_commit(txn);
+        else
+            mdb_txn_abort(txn);
+    }
+
+    if (rc != 0) {
+        ap_log_error(APLOG_MARK,
+                rc == MDB_MAP_FULL ? APLOG_NOTICE : APLOG_DEBUG, 0, s,
+                "[gnutls_cache] error storing in cache '%s': %s",
+                lmdb_path, mdb_strerror(rc));
+        if (stats != NULL)
+            apr_atomic_add32(&stats->store_error, n);
+        return APR_EGENERAL;
+    }
+
+    return APR_SUCCESS;
+}
+
+static void lmdb_cache_expire_idle(server_rec * s, mgs_srvconf_rec * sc,
+        apr_pool_t * p) {
+    MDB_txn *txn;
+
+    if (mdb_txn_begin(lmdb_env, NULL, 0, &txn) != 0)
+        return;
+    /* nothing was expired: no need to write anything */
+    if (lmdb_cache_expire(txn, apr_time_now()) > 0)
+        mdb_txn_commit(txn);
+    else
+        mdb_txn_abort(txn);
+}
+
+static gnutls_datum_t lmdb_cache_fetch(void *baton, gnutls_datum_t key) {
+    gnutls_datum_t data = {NULL, 0};
+    mgs_handle_t *ctxt = baton;
+    apr_datum_t dbmkey;
+    MDB_txn *txn;
+    MDB_val k, v;
+    int rc;
+
+    if (mgs_session_id2dbm(ctxt, key.data, key.size, &dbmkey) < 0)
+        return data;
+
+    rc = mdb_txn_begin(lmdb_env, NULL, MDB_RDONLY, &txn);
+    if (rc != 0) {
+        STATS_INC(fetch_error);
+        return data;
+    }
+
+    k.mv_data = dbmkey.dptr;
+    k.mv_size = dbmkey.dsize;
+    rc = mdb_get(txn, lmdb_sessions, &k, &v);
+    if (rc == 0 && v.mv_size > LMDB_TIME_LEN
+            && apr_time_now() < lmdb_time_get(v.mv_data)) {
+        data.data = gnutls_malloc(v.mv_size - LMDB_TIME_LEN);
+        if (data.data != NULL) {
+            data.size = v.mv_size - LMDB_TIME_LEN;
+            memcpy(data.data, (char *) v.mv_data + LMDB_TIME_LEN,
+                    data.size);
+        }
+    } else if (rc != 0 && rc != MDB_NOTFOUND) {
+        STATS_INC(fetch_error);
+    }
+
+    mdb_txn_abort(txn);
+
+    return data;
+}
+
+static int lmdb_cache_store(void *baton, gnutls_datum_t key,
+        gnutls_datum_t data) {
+    apr_datum_t dbmkey;
     mgs_handle_t *ctxt = baton;
     apr_status_t rv;
-    apr_time_t expiry;
     apr_pool_t *spool;
+    store_item_t item;
 
-    if (mgs_session_id2dbm(ctxt->c, key.data, key.size, &dbmkey) < 0)
+    if (mgs_session_id2dbm(ctxt, key.data, key.size, &dbmkey) < 0)
         return -1;
 
-    /* we expire dbm only on every store
-     */
-    dbm_cache_expire(ctxt);
+    item.expiry = apr_time_now() + ctxt->sc->cache_timeout;
+
+    if (store_queue_push(ctxt->c->base_server, dbmkey.dptr, dbmkey.dsize,
+            data, item.expiry) == 0)
+        return 0;
+
+    item.key = dbmkey.dptr;
+    item.key_len = dbmkey.dsize;
+    item.data = data.data;
+    item.data_len = data.size;
 
     apr_pool_create(&spool, ctxt->c->pool);
+    rv = lmdb_cache_write(ctxt->c->base_server, ctxt->sc, spool, &item, 1);
+    apr_pool_destroy(spool);
 
-    /* create DBM value */
-    dbmval.dsize = data.size + sizeof (apr_time_t);
-    dbmval.dptr = (char *) apr_palloc(spool, dbmval.dsize);
+    return rv == APR_SUCCESS ? 0 : -1;
+}
 
-    expiry = apr_time_now() + ctxt->sc->cache_timeout;
+static int lmdb_cache_delete(void *baton, gnutls_datum_t key) {
+    apr_datum_t dbmkey;
+    mgs_handle_t *ctxt = baton;
+    MDB_txn *txn;
+    MDB_val k;
+    int rc;
 
-    memcpy((char *) dbmval.dptr, &expiry, sizeof (apr_time_t));
-    memcpy((char *) dbmval.dptr + sizeof (apr_time_t),
-            data.data, data.size);
+    if (mgs_session_id2dbm(ctxt, key.data, key.size, &dbmkey) < 0)
+        return -1;
 
-    rv = apr_dbm_open_ex(&dbm, db_type(ctxt->sc),
-            ctxt->sc->cache_config, APR_DBM_RWCREATE,
-            SSL_DBM_FILE_MODE, ctxt->c->pool);
-    if (rv != APR_SUCCESS) {
-        ap_log_error(APLOG_MARK, APLOG_NOTICE, rv,
-                ctxt->c->base_server,
-                "[gnutls_cache] error opening cache '%s'",
-                ctxt->sc->cache_config);
-        apr_pool_destroy(spool);
+    rc = mdb_txn_begin(lmdb_env, NULL, 0, &txn);
+    if (rc != 0)
+        return -1;
+
+    /* the index entry is dropped once it expires */
+    k.mv_data = dbmkey.dptr;
+    k.mv_size = dbmkey.dsize;
+    rc = mdb_del(txn, lmdb_sessions, &k, NULL);
+    if (rc == 0) {
+        rc = mdb_txn_commit(txn);
+    } else {
+        mdb_txn_abort(txn);
+        if (rc == MDB_NOTFOUND)
+            rc = 0;
+    }
+
+    if (rc != 0) {
+        ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, ctxt->c->base_server,
+                "[gnutls_cache] error deleting from cache '%s': %s",
+                lmdb_path, mdb_strerror(rc));
         return -1;
     }
 
-    rv = apr_dbm_store(dbm, dbmkey, dbmval);
+    return 0;
+}
+
+static int lmdb_cache_post_config(apr_pool_t * p, server_rec * s,
+        mgs_srvconf_rec * sc) {
+    int rc;
+
+    if (lmdb_parse_config(p, sc->cache_config) != 0) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                "GnuTLS: Invalid LMDB Cache `%s', expected PATH[(SIZE)]",
+                sc->cache_config);
+        return APR_EINVAL;
+    }
+
+    rc = lmdb_env_open(s, 1);
+    if (rc != 0)
+        return APR_EGENERAL;
+    mdb_env_close(lmdb_env);
+    lmdb_env = NULL;
+
+#if !defined(OS2) && !defined(WIN32) && !defined(BEOS) && !defined(NETWARE)
+    /* Running as Root */
+    if (geteuid() == 0) {
+        const char *lock = apr_pstrcat(p, lmdb_path, "-lock", NULL);
+
+        if (0 != chown(lmdb_path, ap_unixd_config.user_id, -1))
+            ap_log_error(APLOG_MARK, APLOG_NOTICE, -1, s,
+                         "GnuTLS: could not chown cache path `%s' to uid %d (errno: %d)",
+                         lmdb_path, ap_unixd_config.user_id, errno);
+        if (0 != chown(lock, ap_unixd_config.user_id, -1))
+            ap_log_error(APLOG_MARK, APLOG_NOTICE, -1, s,
+                         "GnuTLS: could not chown cache path `%s' to uid %d (errno: %d)",
+                         lock, ap_unixd_config.user_id, errno);
+    }
+#endif
+
+    return APR_SUCCESS;
+}
+
+static int lmdb_cache_child_init(apr_pool_t * p, server_rec * s,
+        mgs_srvconf_rec * sc) {
+    if (lmdb_env_open(s, 0) != 0)
+        return APR_EGENERAL;
+    apr_pool_cleanup_register(p, NULL, lmdb_env_cleanup,
+            apr_pool_cleanup_null);
+
+#if APR_HAS_THREADS
+    store_queue_start(p, s, sc, lmdb_cache_write);
+#endif
+
+    return APR_SUCCESS;
+}
+
+static void lmdb_cache_status(request_rec * r, int flags) {
+    MDB_envinfo info;
+    MDB_stat st;
+    MDB_txn *txn;
+    apr_size_t entries = 0;
+
+    if (lmdb_env == NULL || mdb_env_info(lmdb_env, &info) != 0
+            || mdb_env_stat(lmdb_env, &st) != 0)
+        return;
+
+    if (mdb_txn_begin(lmdb_env, NULL, MDB_RDONLY, &txn) == 0) {
+        MDB_stat sst;
+
+        if (mdb_stat(txn, lmdb_sessions, &sst) == 0)
+            entries = sst.ms_entries;
+        mdb_txn_abort(txn);
+    }
+
+    if (flags & AP_STATUS_SHORT) {
+        ap_rprintf(r, "GnuTLSCacheLMDBEntries: %" APR_SIZE_T_FMT "\n",
+                entries);
+        ap_rprintf(r, "GnuTLSCacheLMDBUsed: %" APR_SIZE_T_FMT "\n",
+                (apr_size_t) (info.me_last_pgno + 1) * st.ms_psize);
+        ap_rprintf(r, "GnuTLSCacheLMDBSize: %" APR_SIZE_T_FMT "\n",
+                (apr_size_t) info.me_mapsize);
+    } else {
+        ap_rprintf(r, "<dt>LMDB sessions:</dt><dd>%" APR_SIZE_T_FMT
+                ", %" APR_SIZE_T_FMT " of %" APR_SIZE_T_FMT
+                " bytes used</dd>\n", entries,
+                (apr_size_t) (info.me_last_pgno + 1) * st.ms_psize,
+                (apr_size_t) info.me_mapsize);
+    }
+}
+
+#endif /* HAVE_LMDB */
+
+#if HAVE_AP_SOCACHE
+/**
+ * GnuTLS Session Cache using mod_socache
+ *
+ * "GnuTLSCache socache:NAME[:ARGS]" hands the sessions to one of the
+ * ap_socache providers (shmcb, dbm, memcache, dc, ...), with the same
+ * arguments as mod_ssl's SSLSessionCache.
+ */
+
+/* the largest session we can fetch */
+#define SOCACHE_DATA_MAX (10 * 1024)
+
+static const ap_socache_provider_t *socache_provider;
+static ap_socache_instance_t *socache_instance;
+/* only for providers that are not safe across processes */
+static apr_global_mutex_t *socache_lock;
+
+static apr_status_t socache_cache_cleanup(void *data) {
+    server_rec *s = data;
+
+    if (socache_instance != NULL)
+        socache_provider->destroy(socache_instance, s);
+    socache_instance = NULL;
+    socache_lock = NULL;
+    return APR_SUCCESS;
+}
+
+static int socache_cache_post_config(apr_pool_t * p, server_rec * s,
+        mgs_srvconf_rec * sc) {
+    struct ap_socache_hints hints;
+    const char *args = NULL;
+    const char *err;
+    char *name;
+    char *sep;
+    apr_status_t rv;
+
+    name = apr_pstrdup(p, sc->cache_config);
+    sep = strchr(name, ':');
+    if (sep != NULL) {
+        *sep = '\0';
+        args = sep + 1;
+    }
+
+    socache_provider = ap_lookup_provider(AP_SOCACHE_PROVIDER_GROUP, name,
+            AP_SOCACHE_PROVIDER_VERSION);
+    if (socache_provider == NULL) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                "GnuTLS: Unknown socache provider '%s', "
+                "is mod_socache_%s loaded?", name, name);
+        return APR_EINVAL;
+    }
+
+    err = socache_provider->create(&socache_instance, args, p, p);
+    if (err != NULL) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                "GnuTLS: socache provider '%s': %s", name, err);
+        return APR_EINVAL;
+    }
+
+    hints.avg_id_len = 64;
+    hints.avg_obj_size = 1024;
+    hints.expiry_interval = apr_time_from_sec(30);
 
+    rv = socache_provider->init(socache_instance, "mod_gnutls-session",
+            &hints, s, p);
     if (rv != APR_SUCCESS) {
-        ap_log_error(APLOG_MARK, APLOG_DEBUG, rv,
-                ctxt->c->base_server,
-                "[gnutls_cache] error storing in cache '%s'",
-                ctxt->sc->cache_config);
-        apr_dbm_close(dbm);
-        apr_pool_destroy(spool);
-        return -1;
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                "GnuTLS: Cannot initialize socache provider '%s'", name);
+        return rv;
     }
+    apr_pool_cleanup_register(p, s, socache_cache_cleanup,
+            apr_pool_cleanup_null);
 
-    apr_dbm_close(dbm);
+    if (socache_provider->flags & AP_SOCACHE_FLAG_NOTMPSAFE)
+        return cache_mutex_create(&socache_lock, s, p);
 
-    apr_pool_destroy(spool);
+    return APR_SUCCESS;
+}
 
-    return 0;
+static int socache_cache_child_init(apr_pool_t * p, server_rec * s,
+        mgs_srvconf_rec * sc) {
+    apr_status_t rv;
+
+    if (socache_lock == NULL)
+        return APR_SUCCESS;
+
+    rv = apr_global_mutex_child_init(&socache_lock,
+            apr_global_mutex_lockfile(socache_lock), p);
+    if (rv != APR_SUCCESS)
+        ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s,
+                "[gnutls_cache] Failed to attach to socache lock");
+    return rv;
 }
 
-static int dbm_cache_delete(void *baton, gnutls_datum_t key) {
-    apr_dbm_t *dbm;
-    apr_datum_t dbmkey;
+static gnutls_datum_t socache_cache_fetch(void *baton, gnutls_datum_t key) {
+    gnutls_datum_t data = {NULL, 0};
     mgs_handle_t *ctxt = baton;
+    apr_datum_t dbmkey;
+    unsigned char buf[SOCACHE_DATA_MAX];
+    unsigned int len = sizeof (buf);
     apr_status_t rv;
 
-    if (mgs_session_id2dbm(ctxt->c, key.data, key.size, &dbmkey) < 0)
-        return -1;
+    if (filter_absent(key.data, key.size))
+        return data;
+
+    if (mgs_session_id2dbm(ctxt, key.data, key.size, &dbmkey) < 0)
+        return data;
+
+    if (socache_lock != NULL)
+        apr_global_mutex_lock(socache_lock);
+    rv = socache_provider->retrieve(socache_instance, ctxt->c->base_server,
+            (unsigned char *) dbmkey.dptr, dbmkey.dsize, buf, &len,
+            ctxt->c->pool);
+    if (socache_lock != NULL)
+        apr_global_mutex_unlock(socache_lock);
 
-    rv = apr_dbm_open_ex(&dbm, db_type(ctxt->sc),
-            ctxt->sc->cache_config, APR_DBM_RWCREATE,
-            SSL_DBM_FILE_MODE, ctxt->c->pool);
     if (rv != APR_SUCCESS) {
-        ap_log_error(APLOG_MARK, APLOG_NOTICE, rv,
-                ctxt->c->base_server,
-                "[gnutls_cache] error opening cache '%s'",
-                ctxt->sc->cache_config);
-        return -1;
+        if (!APR_STATUS_IS_NOTFOUND(rv))
+            STATS_INC(fetch_error);
+        return data;
     }
 
-    rv = apr_dbm_delete(dbm, dbmkey);
+    data.data = gnutls_malloc(len);
+    if (data.data == NULL)
+        return data;
+
+    data.size = len;
+    memcpy(data.data, buf, len);
+
+    return data;
+}
+
+static int socache_cache_store(void *baton, gnutls_datum_t key,
+        gnutls_datum_t data) {
+    mgs_handle_t *ctxt = baton;
+    apr_datum_t dbmkey;
+    apr_status_t rv;
+
+    if (mgs_session_id2dbm(ctxt, key.data, key.size, &dbmkey) < 0)
+        return -1;
+
+    filter_add(key.data, key.size);
+
+    if (socache_lock != NULL)
+        apr_global_mutex_lock(socache_lock);
+    rv = socache_provider->store(socache_instance, ctxt->c->base_server,
+            (unsigned char *) dbmkey.dptr, dbmkey.dsize,
+            apr_time_now() + ctxt->sc->cache_timeout,
+            data.data, data.size, ctxt->c->pool);
+    if (socache_lock != NULL)
+        apr_global_mutex_unlock(socache_lock);
 
     if (rv != APR_SUCCESS) {
-        ap_log_error(APLOG_MARK, APLOG_NOTICE, rv,
-                ctxt->c->base_server,
-                "[gnutls_cache] error deleting from cache '%s'",
+        STATS_INC(store_error);
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, rv, ctxt->c->base_server,
+                "[gnutls_cache] error storing in socache '%s'",
                 ctxt->sc->cache_config);
-        apr_dbm_close(dbm);
         return -1;
     }
 
-    apr_dbm_close(dbm);
-
     return 0;
 }
 
-static int dbm_cache_post_config(apr_pool_t * p, server_rec * s,
-        mgs_srvconf_rec * sc) {
+static int socache_cache_delete(void *baton, gnutls_datum_t key) {
+    mgs_handle_t *ctxt = baton;
+    apr_datum_t dbmkey;
     apr_status_t rv;
-    apr_dbm_t *dbm;
-    const char *path1;
-    const char *path2;
 
-    rv = apr_dbm_open_ex(&dbm, db_type(sc), sc->cache_config,
-            APR_DBM_RWCREATE, SSL_DBM_FILE_MODE, p);
+    if (mgs_session_id2dbm(ctxt, key.data, key.size, &dbmkey) < 0)
+        return -1;
 
-    if (rv != APR_SUCCESS) {
-        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
-                "GnuTLS: Cannot create DBM Cache at `%s'",
-                sc->cache_config);
-        return rv;
-    }
+    if (socache_lock != NULL)
+        apr_global_mutex_lock(socache_lock);
+    rv = socache_provider->remove(socache_instance, ctxt->c->base_server,
+            (unsigned char *) dbmkey.dptr, dbmkey.dsize, ctxt->c->pool);
+    if (socache_lock != NULL)
+        apr_global_mutex_unlock(socache_lock);
 
-    apr_dbm_close(dbm);
+    return rv == APR_SUCCESS ? 0 : -1;
+}
 
-    apr_dbm_get_usednames_ex(p, db_type(sc), sc->cache_config, &path1,
-            &path2);
+static void socache_cache_status(request_rec * r, int flags) {
+    if (socache_instance == NULL)
+        return;
 
-    /* The Following Code takes logic directly from mod_ssl's DBM Cache */
-#if !defined(OS2) && !defined(WIN32) && !defined(BEOS) && !defined(NETWARE)
-    /* Running as Root */
-    if (path1 && geteuid() == 0) {
-        if (0 != chown(path1, ap_unixd_config.user_id, -1))
-            ap_log_error(APLOG_MARK, APLOG_NOTICE, -1, s,
-                         "GnuTLS: could not chown cache path1 `%s' to uid %d (errno: %d)",
-                         path1, ap_unixd_config.user_id, errno);
-        if (path2 != NULL) {
-            if (0 != chown(path2, ap_unixd_config.user_id, -1))
-                ap_log_error(APLOG_MARK, APLOG_NOTICE, -1, s,
-                             "GnuTLS: could not chown cache path2 `%s' to uid %d (errno: %d)",
-                             path2, ap_unixd_config.user_id, errno);
-        }
-    }
+    if (socache_lock != NULL)
+        apr_global_mutex_lock(socache_lock);
+    socache_provider->status(socache_instance, r, flags);
+    if (socache_lock != NULL)
+        apr_global_mutex_unlock(socache_lock);
+}
+
+#endif /* HAVE_AP_SOCACHE */
+
+static const cache_provider_t cache_providers[] = {
+    {mgs_cache_dbm, "dbm", CACHE_USE_FILTER | CACHE_USE_SHARDS,
+        dbm_cache_post_config, dbm_cache_child_init,
+        dbm_cache_fetch, dbm_cache_store, dbm_cache_delete,
+        dbm_cache_expire_idle, NULL},
+    {mgs_cache_gdbm, "gdbm", CACHE_USE_FILTER | CACHE_USE_SHARDS,
+        dbm_cache_post_config, dbm_cache_child_init,
+        dbm_cache_fetch, dbm_cache_store, dbm_cache_delete,
+        dbm_cache_expire_idle, NULL},
+    {mgs_cache_shm, "shm", 0,
+        shm_cache_post_config, shm_cache_child_init,
+        shm_cache_fetch, shm_cache_store, shm_cache_delete,
+        NULL, NULL},
+#if HAVE_LMDB
+    {mgs_cache_lmdb, "lmdb", 0,
+        lmdb_cache_post_config, lmdb_cache_child_init,
+        lmdb_cache_fetch, lmdb_cache_store, lmdb_cache_delete,
+        lmdb_cache_expire_idle, lmdb_cache_status},
+#endif
+#if HAVE_APR_MEMCACHE
+    {mgs_cache_memcache, "memcache", CACHE_USE_LOCAL,
+        mc_cache_post_config, mc_cache_child_init,
+        mc_cache_fetch, mc_cache_store, mc_cache_delete,
+        NULL, mc_cache_status},
+#endif
+#if HAVE_AP_SOCACHE
+    {mgs_cache_socache, "socache", 0,
+        socache_cache_post_config, socache_cache_child_init,
+        socache_cache_fetch, socache_cache_store, socache_cache_delete,
+        NULL, socache_cache_status},
 #endif
+};
 
-    return rv;
+static const cache_provider_t *cache_provider_get(mgs_cache_e type) {
+    unsigned int i;
+
+    for (i = 0; i < sizeof (cache_providers) / sizeof (cache_providers[0]);
+            i++) {
+        if (cache_providers[i].type == type)
+            return &cache_providers[i];
+    }
+    return NULL;
 }
 
 int mgs_cache_post_config(apr_pool_t * p, server_rec * s,
         mgs_srvconf_rec * sc) {
+    apr_status_t rv;
 
     /* if GnuTLSCache was never explicitly set: */
     if (sc->cache_type == mgs_cache_unset)
@@ -568,51 +3516,146 @@ int mgs_cache_post_config(apr_pool_t * p, server_rec * s,
     if (sc->cache_timeout == -1)
         sc->cache_timeout = apr_time_from_sec(300);
 
-    if (sc->cache_type == mgs_cache_dbm
-            || sc->cache_type == mgs_cache_gdbm) {
-        return dbm_cache_post_config(p, s, sc);
+    snapshot_interval = 0;
+    cache = cache_provider_get(sc->cache_type);
+    if (cache == NULL)
+        return APR_SUCCESS;
+
+    rv = stats_create(p, s, cache_parts != NULL ? cache_parts->nelts : 0);
+    if (rv != APR_SUCCESS)
+        return rv;
+
+    rv = cache->init(p, s, sc);
+    if (rv != APR_SUCCESS)
+        return rv;
+
+    cache_parts_init(s, sc, shm_hdr != NULL
+            ? shm_hdr->nbuckets * SHM_BUCKET_WAYS : 0);
+
+    if (sc->cache_local_size != 0 && !(cache->flags & CACHE_USE_LOCAL))
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+                "GnuTLS: GnuTLSCacheLocal is not used with "
+                "GnuTLSCache %s, ignoring it", cache->name);
+
+    if (sc->cache_shards != 1 && !(cache->flags & CACHE_USE_SHARDS))
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+                "GnuTLS: GnuTLSCacheShards is not used with "
+                "GnuTLSCache %s, ignoring it", cache->name);
+
+    if (sc->cache_snapshot_file != NULL) {
+        if (shm_hdr != NULL)
+            shm_snapshot_init(p, s, sc);
+        else
+            ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+                    "GnuTLS: GnuTLSCacheSnapshot needs a shm table, "
+                    "ignoring it with GnuTLSCache %s", cache->name);
     }
-    return 0;
+
+    if (sc->cache_filter_size != 0) {
+        if (cache->flags & CACHE_USE_FILTER)
+            rv = filter_create(p, s, sc);
+        else
+            ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+                    "GnuTLS: GnuTLSCacheFilter is not used with "
+                    "GnuTLSCache %s, ignoring it", cache->name);
+    }
+
+    return rv;
 }
 
 int mgs_cache_child_init(apr_pool_t * p, server_rec * s,
         mgs_srvconf_rec * sc) {
-    if (sc->cache_type == mgs_cache_dbm
-            || sc->cache_type == mgs_cache_gdbm) {
+    if (cache == NULL)
         return 0;
+    snapshot_owner = 0;
+    if (snapshot_interval != 0 && shm_hdr != NULL)
+        shm_snapshot_thread_start(p, s);
+    return cache->child_init(p, s, sc);
+}
+
+void mgs_cache_status(request_rec * r, int flags) {
+    if (cache == NULL)
+        return;
+
+    if (stats != NULL) {
+        stats_print(r, flags, cache->name);
+        cache_parts_print(r, flags);
     }
-#if HAVE_APR_MEMCACHE
-    else if (sc->cache_type == mgs_cache_memcache) {
-        return mc_cache_child_init(p, s, sc);
+    if (cache->stats != NULL)
+        cache->stats(r, flags);
+}
+
+/* The callbacks of the provider are wrapped to keep statistics */
+static gnutls_datum_t cache_fetch(void *baton, gnutls_datum_t key) {
+    mgs_handle_t *ctxt = baton;
+    apr_time_t start = apr_time_now();
+    gnutls_datum_t data = cache->fetch(baton, key);
+
+    if (stats != NULL) {
+        stats_time(stats->fetch_time, start);
+        if (data.data != NULL)
+            apr_atomic_inc32(&stats->fetch_hit);
+        else
+            apr_atomic_inc32(&stats->fetch_miss);
     }
-#endif
-    return 0;
+
+    if (data.data == NULL) {
+        PART_INC(cache_part_find(ctxt->sc->vhost_id), fetch_miss);
+        return data;
+    }
+
+    PART_INC(cache_part_of(&data), fetch_hit);
+    if (data.size > SESSION_VHOST_LEN
+            && session_u32_get(data.data) == SESSION_VHOST_MAGIC) {
+        ctxt->session_vhost_id = session_u32_get(data.data + 4);
+        data.size -= SESSION_VHOST_LEN;
+        memmove(data.data, data.data + SESSION_VHOST_LEN, data.size);
+    }
+    return data;
 }
 
-#include <assert.h>
+static int cache_store(void *baton, gnutls_datum_t key,
+        gnutls_datum_t data) {
+    mgs_handle_t *ctxt = baton;
+    apr_time_t start = apr_time_now();
+    gnutls_datum_t tagged;
+    int ret;
 
-int mgs_cache_session_init(mgs_handle_t * ctxt) {
-    if (ctxt->sc->cache_type == mgs_cache_dbm
-            || ctxt->sc->cache_type == mgs_cache_gdbm) {
-        gnutls_db_set_retrieve_function(ctxt->session,
-                dbm_cache_fetch);
-        gnutls_db_set_remove_function(ctxt->session,
-                dbm_cache_delete);
-        gnutls_db_set_store_function(ctxt->session,
-                dbm_cache_store);
-        gnutls_db_set_ptr(ctxt->session, ctxt);
+    tagged.size = data.size + SESSION_VHOST_LEN;
+    tagged.data = apr_palloc(ctxt->c->pool, tagged.size);
+    session_u32_put(tagged.data, SESSION_VHOST_MAGIC);
+    session_u32_put(tagged.data + 4, ctxt->sc->vhost_id);
+    memcpy(tagged.data + SESSION_VHOST_LEN, data.data, data.size);
+
+    ret = cache->store(baton, key, tagged);
+
+    if (stats != NULL) {
+        stats_time(stats->store_time, start);
+        apr_atomic_inc32(&stats->store);
     }
-#if HAVE_APR_MEMCACHE
-    else if (ctxt->sc->cache_type == mgs_cache_memcache) {
-        gnutls_db_set_retrieve_function(ctxt->session,
-                mc_cache_fetch);
-        gnutls_db_set_remove_function(ctxt->session,
-                mc_cache_delete);
-        gnutls_db_set_store_function(ctxt->session,
-                mc_cache_store);
-        gnutls_db_set_ptr(ctxt->session, ctxt);
+    PART_INC(cache_part_find(ctxt->sc->vhost_id), store);
+    return ret;
+}
+
+static int cache_delete(void *baton, gnutls_datum_t key) {
+    apr_time_t start = apr_time_now();
+    int ret = cache->remove(baton, key);
+
+    if (stats != NULL) {
+        stats_time(stats->remove_time, start);
+        apr_atomic_inc32(&stats->remove);
     }
-#endif
+    return ret;
+}
+
+int mgs_cache_session_init(mgs_handle_t * ctxt) {
+    if (cache == NULL)
+        return 0;
+
+    gnutls_db_set_retrieve_function(ctxt->session, cache_fetch);
+    gnutls_db_set_remove_function(ctxt->session, cache_delete);
+    gnutls_db_set_store_function(ctxt->session, cache_store);
+    gnutls_db_set_ptr(ctxt->session, ctxt);
 
     return 0;
 }
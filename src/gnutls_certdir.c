@@ -0,0 +1,465 @@
+/**
+ *  Copyright 2004-2005 Paul Querna
+ *  Copyright 2008 Nikos Mavrogiannopoulos
+ *  Copyright 2011 Dash Shendy
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include "mod_gnutls.h"
+
+#include "apr_hash.h"
+#include "apr_lib.h"
+#include "apr_thread_mutex.h"
+
+#include "mod_status.h"
+
+/**
+ * Certificate Directory
+ *
+ * With GnuTLSCertificateDirectory the certificate and key of a name
+ * are read from DIR/NAME.crt and DIR/NAME.key the first time a client
+ * asks for NAME, instead of parsing every certificate at startup.
+ * NAME is the SNI name in lower case, and _.example.com stands in for
+ * the names directly below example.com.
+ *
+ * Parsed GnuTLS structures can not be shared between processes, so
+ * every child keeps its own cache of each directory, at most
+ * GnuTLSCertificateDirectory MAX entries ordered by last use.  The
+ * least recently used entry is dropped when a new one is loaded.
+ * Connections hold a reference to their entry, which keeps it alive
+ * after it has been dropped until the connection closes.  Names
+ * without files are remembered for CERTDIR_NEGATIVE_TTL, so clients
+ * asking for unknown names do not reach the file system every time.
+ * They are kept in a list of their own, so that a client sending many
+ * unknown names can not push the certificates out of the cache.
+ */
+
+/* How long a name without files is remembered */
+#define CERTDIR_NEGATIVE_TTL apr_time_from_sec(60)
+/* How many names without files are remembered */
+#define CERTDIR_NEGATIVE_MAX 1024
+
+typedef struct certdir_entry_t certdir_entry_t;
+
+struct certdir_entry_t {
+    /* must come first, connections only see this part */
+    mgs_dir_cert_t cert;
+    char *name;
+    /* when a name without files should be looked for again */
+    apr_time_t expires;
+    /* one for the cache, one for every connection using it */
+    int refs;
+    /* least recently used list, the cache holds the head */
+    certdir_entry_t *prev;
+    certdir_entry_t *next;
+    mgs_certdir_t *dir;
+};
+
+/* A least recently used list */
+typedef struct {
+    certdir_entry_t *head;
+    certdir_entry_t *tail;
+    int count;
+} certdir_lru_t;
+
+struct mgs_certdir_t {
+    const char *path;
+    int max;
+    apr_hash_t *entries;
+    /* entries with a certificate, at most max */
+    certdir_lru_t certs;
+    /* names without files, at most CERTDIR_NEGATIVE_MAX */
+    certdir_lru_t negative;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+    /* counters of this process */
+    apr_uint32_t hits;
+    apr_uint32_t misses;
+    apr_uint32_t loads;
+    apr_uint32_t load_errors;
+    apr_uint32_t evictions;
+};
+
+#if APR_HAS_THREADS
+#define CERTDIR_LOCK(d) apr_thread_mutex_lock((d)->mutex)
+#define CERTDIR_UNLOCK(d) apr_thread_mutex_unlock((d)->mutex)
+#else
+#define CERTDIR_LOCK(d)
+#define CERTDIR_UNLOCK(d)
+#endif
+
+/* The caches of this process, by directory */
+static apr_hash_t *certdirs = NULL;
+
+void mgs_certdir_child_init(apr_pool_t *p, server_rec *s) {
+    certdirs = apr_hash_make(p);
+
+    for (; s; s = s->next) {
+        mgs_srvconf_rec *sc = (mgs_srvconf_rec *)
+                ap_get_module_config(s->module_config, &gnutls_module);
+        mgs_certdir_t *dir;
+        int max;
+
+        if (sc->enabled != GNUTLS_ENABLED_TRUE || sc->cert_dir == NULL)
+            continue;
+
+        max = sc->cert_dir_max > 0 ? sc->cert_dir_max : DEFAULT_CERT_DIR_MAX;
+        dir = apr_hash_get(certdirs, sc->cert_dir, APR_HASH_KEY_STRING);
+        if (dir != NULL) {
+            /* virtual hosts sharing a directory share the cache */
+            if (max > dir->max)
+                dir->max = max;
+            continue;
+        }
+
+        dir = apr_pcalloc(p, sizeof (*dir));
+        dir->path = sc->cert_dir;
+        dir->max = max;
+        dir->entries = apr_hash_make(p);
+#if APR_HAS_THREADS
+        if (apr_thread_mutex_create(&dir->mutex, APR_THREAD_MUTEX_DEFAULT,
+                p) != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_EMERG, 0, s,
+                    "GnuTLS: Cannot create the mutex of the certificate "
+                    "directory '%s'", dir->path);
+            continue;
+        }
+#endif
+        apr_hash_set(certdirs, dir->path, APR_HASH_KEY_STRING, dir);
+    }
+}
+
+static void certdir_entry_free(certdir_entry_t *e) {
+    unsigned int i;
+
+    for (i = 0; i < e->cert.certs_x509_chain_num; i++)
+        gnutls_x509_crt_deinit(e->cert.certs_x509_chain[i]);
+    if (e->cert.privkey_x509 != NULL)
+        gnutls_x509_privkey_deinit(e->cert.privkey_x509);
+    free(e->name);
+    free(e);
+}
+
+/* Drop a reference, with the lock held. */
+static void certdir_entry_unref(certdir_entry_t *e) {
+    if (--e->refs == 0)
+        certdir_entry_free(e);
+}
+
+/* The list E belongs to */
+static certdir_lru_t *certdir_lru(mgs_certdir_t *dir, certdir_entry_t *e) {
+    return e->cert.certs_x509_chain_num > 0 ? &dir->certs : &dir->negative;
+}
+
+static void certdir_unlink(mgs_certdir_t *dir, certdir_entry_t *e) {
+    certdir_lru_t *lru = certdir_lru(dir, e);
+
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        lru->head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        lru->tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void certdir_push(mgs_certdir_t *dir, certdir_entry_t *e) {
+    certdir_lru_t *lru = certdir_lru(dir, e);
+
+    e->prev = NULL;
+    e->next = lru->head;
+    if (lru->head)
+        lru->head->prev = e;
+    lru->head = e;
+    if (lru->tail == NULL)
+        lru->tail = e;
+}
+
+static void certdir_remove(mgs_certdir_t *dir, certdir_entry_t *e) {
+    certdir_unlink(dir, e);
+    apr_hash_set(dir->entries, e->name, APR_HASH_KEY_STRING, NULL);
+    certdir_lru(dir, e)->count--;
+    certdir_entry_unref(e);
+}
+
+static apr_status_t certdir_release(void *data) {
+    certdir_entry_t *e = data;
+    mgs_certdir_t *dir = e->dir;
+
+    CERTDIR_LOCK(dir);
+    certdir_entry_unref(e);
+    CERTDIR_UNLOCK(dir);
+    return APR_SUCCESS;
+}
+
+static apr_status_t certdir_read(apr_pool_t *p, const char *file,
+        gnutls_datum_t *data) {
+    apr_file_t *fp;
+    apr_finfo_t finfo;
+    apr_size_t br = 0;
+    apr_status_t rv;
+
+    rv = apr_file_open(&fp, file, APR_READ | APR_BINARY, APR_OS_DEFAULT, p);
+    if (rv != APR_SUCCESS)
+        return rv;
+
+    rv = apr_file_info_get(&finfo, APR_FINFO_SIZE, fp);
+    if (rv == APR_SUCCESS) {
+        data->data = apr_palloc(p, finfo.size + 1);
+        rv = apr_file_read_full(fp, data->data, finfo.size, &br);
+    }
+    apr_file_close(fp);
+    if (rv != APR_SUCCESS)
+        return rv;
+
+    data->data[br] = '\0';
+    data->size = br;
+    return APR_SUCCESS;
+}
+
+/* Parse NAME.crt and NAME.key into E.  Returns APR_ENOENT if there is
+ * no certificate for NAME, which is not an error. */
+static apr_status_t certdir_load(server_rec *s, apr_pool_t *p,
+        mgs_certdir_t *dir, certdir_entry_t *e) {
+    gnutls_datum_t data;
+    const char *file;
+    apr_status_t rv;
+    int ret;
+
+    file = apr_pstrcat(p, dir->path, "/", e->name, ".crt", NULL);
+    rv = certdir_read(p, file, &data);
+    if (APR_STATUS_IS_ENOENT(rv))
+        return APR_ENOENT;
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                "GnuTLS: Error Reading Certificate '%s'", file);
+        return rv;
+    }
+
+    e->cert.certs_x509_chain_num = MAX_CHAIN_SIZE;
+    ret = gnutls_x509_crt_list_import(e->cert.certs_x509_chain,
+            &e->cert.certs_x509_chain_num, &data, GNUTLS_X509_FMT_PEM, 0);
+    if (ret < 0) {
+        e->cert.certs_x509_chain_num = 0;
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                "GnuTLS: Failed to Import Certificate '%s': (%d) %s",
+                file, ret, gnutls_strerror(ret));
+        return APR_EGENERAL;
+    }
+
+    file = apr_pstrcat(p, dir->path, "/", e->name, ".key", NULL);
+    rv = certdir_read(p, file, &data);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                "GnuTLS: Error Reading Private Key '%s'", file);
+        return rv;
+    }
+
+    ret = gnutls_x509_privkey_init(&e->cert.privkey_x509);
+    if (ret < 0) {
+        e->cert.privkey_x509 = NULL;
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                "GnuTLS: Failed to initialize: (%d) %s",
+                ret, gnutls_strerror(ret));
+        return APR_EGENERAL;
+    }
+
+    ret = gnutls_x509_privkey_import(e->cert.privkey_x509, &data,
+            GNUTLS_X509_FMT_PEM);
+    if (ret < 0)
+        ret = gnutls_x509_privkey_import_pkcs8(e->cert.privkey_x509, &data,
+                GNUTLS_X509_FMT_PEM, NULL, GNUTLS_PKCS_PLAIN);
+    if (ret < 0) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                "GnuTLS: Failed to Import Private Key '%s': (%d) %s",
+                file, ret, gnutls_strerror(ret));
+        return APR_EGENERAL;
+    }
+
+    return APR_SUCCESS;
+}
+
+/* Find the entry for NAME, loading it if it is not cached.  Returns
+ * the entry with a reference for the caller, or NULL if NAME has no
+ * usable certificate. */
+static certdir_entry_t *certdir_get(mgs_handle_t *ctxt, mgs_certdir_t *dir,
+        const char *name) {
+    certdir_entry_t *e, *old;
+    certdir_lru_t *lru;
+    apr_pool_t *p;
+    apr_status_t rv;
+    int max;
+
+    CERTDIR_LOCK(dir);
+    e = apr_hash_get(dir->entries, name, APR_HASH_KEY_STRING);
+    if (e != NULL && (e->cert.certs_x509_chain_num > 0
+            || e->expires > apr_time_now())) {
+        certdir_unlink(dir, e);
+        certdir_push(dir, e);
+        dir->hits++;
+        if (e->cert.certs_x509_chain_num == 0) {
+            CERTDIR_UNLOCK(dir);
+            return NULL;
+        }
+        e->refs++;
+        CERTDIR_UNLOCK(dir);
+        return e;
+    }
+    dir->misses++;
+    CERTDIR_UNLOCK(dir);
+
+    /* parse without the lock, other names need not wait for this one */
+    e = calloc(1, sizeof (*e));
+    if (e == NULL)
+        return NULL;
+    e->name = strdup(name);
+    if (e->name == NULL) {
+        free(e);
+        return NULL;
+    }
+    e->dir = dir;
+    e->refs = 1;
+
+    apr_pool_create(&p, ctxt->c->pool);
+    rv = certdir_load(ctxt->c->base_server, p, dir, e);
+    apr_pool_destroy(p);
+    if (rv != APR_SUCCESS) {
+        /* remember that there is nothing to serve for this name */
+        unsigned int i;
+
+        for (i = 0; i < e->cert.certs_x509_chain_num; i++)
+            gnutls_x509_crt_deinit(e->cert.certs_x509_chain[i]);
+        e->cert.certs_x509_chain_num = 0;
+        if (e->cert.privkey_x509 != NULL)
+            gnutls_x509_privkey_deinit(e->cert.privkey_x509);
+        e->cert.privkey_x509 = NULL;
+        e->expires = apr_time_now() + CERTDIR_NEGATIVE_TTL;
+    }
+
+    CERTDIR_LOCK(dir);
+    if (rv == APR_SUCCESS)
+        dir->loads++;
+    else if (!APR_STATUS_IS_ENOENT(rv))
+        dir->load_errors++;
+
+    /* another thread may have loaded the same name meanwhile */
+    old = apr_hash_get(dir->entries, name, APR_HASH_KEY_STRING);
+    if (old != NULL)
+        certdir_remove(dir, old);
+
+    apr_hash_set(dir->entries, e->name, APR_HASH_KEY_STRING, e);
+    certdir_push(dir, e);
+    lru = certdir_lru(dir, e);
+    lru->count++;
+    max = lru == &dir->certs ? dir->max : CERTDIR_NEGATIVE_MAX;
+    while (lru->count > max && lru->tail != e) {
+        certdir_remove(dir, lru->tail);
+        if (lru == &dir->certs)
+            dir->evictions++;
+    }
+
+    if (e->cert.certs_x509_chain_num == 0) {
+        CERTDIR_UNLOCK(dir);
+        return NULL;
+    }
+    e->refs++;
+    CERTDIR_UNLOCK(dir);
+    return e;
+}
+
+mgs_dir_cert_t *mgs_certdir_acquire(mgs_handle_t *ctxt, const char *name) {
+    mgs_certdir_t *dir;
+    certdir_entry_t *e;
+    char key[MAX_HOST_LEN + 2];
+    apr_size_t len;
+    char *c;
+
+    if (certdirs == NULL || ctxt->sc->cert_dir == NULL)
+        return NULL;
+    dir = apr_hash_get(certdirs, ctxt->sc->cert_dir, APR_HASH_KEY_STRING);
+    if (dir == NULL)
+        return NULL;
+
+    /* the name becomes part of a file name */
+    len = strlen(name);
+    if (len == 0 || len >= MAX_HOST_LEN || name[0] == '.'
+            || strchr(name, '/') != NULL || strstr(name, "..") != NULL)
+        return NULL;
+
+    for (c = key; *name; name++)
+        *c++ = apr_tolower(*name);
+    *c = '\0';
+
+    e = certdir_get(ctxt, dir, key);
+    if (e == NULL && (c = strchr(key, '.')) != NULL && c[1] != '\0') {
+        /* _.example.com covers www.example.com */
+        key[0] = '_';
+        memmove(key + 1, c, strlen(c) + 1);
+        e = certdir_get(ctxt, dir, key);
+    }
+    if (e == NULL)
+        return NULL;
+
+    apr_pool_cleanup_register(ctxt->c->pool, e, certdir_release,
+            apr_pool_cleanup_null);
+    return &e->cert;
+}
+
+void mgs_certdir_status(request_rec *r, int flags) {
+    apr_hash_index_t *hi;
+
+    if (certdirs == NULL)
+        return;
+
+    for (hi = apr_hash_first(r->pool, certdirs); hi; hi = apr_hash_next(hi)) {
+        mgs_certdir_t *dir;
+        apr_uint32_t hits, misses, loads, errors, evictions;
+        int count;
+
+        apr_hash_this(hi, NULL, NULL, (void **) &dir);
+        CERTDIR_LOCK(dir);
+        count = dir->certs.count;
+        hits = dir->hits;
+        misses = dir->misses;
+        loads = dir->loads;
+        errors = dir->load_errors;
+        evictions = dir->evictions;
+        CERTDIR_UNLOCK(dir);
+
+        if (flags & AP_STATUS_SHORT) {
+            ap_rprintf(r, "GnuTLSCertificateDirectory: %s\n"
+                    "GnuTLSCertificateDirectoryEntries: %d\n"
+                    "GnuTLSCertificateDirectoryHits: %u\n"
+                    "GnuTLSCertificateDirectoryMisses: %u\n"
+                    "GnuTLSCertificateDirectoryLoads: %u\n"
+                    "GnuTLSCertificateDirectoryLoadErrors: %u\n"
+                    "GnuTLSCertificateDirectoryEvictions: %u\n",
+                    dir->path, count, hits, misses, loads, errors,
+                    evictions);
+            continue;
+        }
+
+        ap_rprintf(r, "<dt>Certificate directory:</dt><dd>%s</dd>\n",
+                ap_escape_html(r->pool, dir->path));
+        ap_rprintf(r, "<dt>Certificates loaded in this process:</dt>"
+                "<dd>%d of at most %d</dd>\n", count, dir->max);
+        ap_rprintf(r, "<dt>Certificate lookups:</dt><dd>%u hits, "
+                "%u misses, %u loads, %u load errors, %u evictions"
+                "</dd>\n", hits, misses, loads, errors, evictions);
+    }
+}
@@ -17,7 +17,21 @@
  *
  */
 
+/* for dladdr() */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "mod_gnutls.h"
+#include "apr_lib.h"
+#include "apr_atomic.h"
+#include "apr_dso.h"
+#include "apr_thread_proc.h"
+
+#include <unistd.h>
+#if HAVE_DLADDR
+#include <dlfcn.h>
+#endif
 
 static int load_datum_from_file(apr_pool_t * pool,
         const char *file, gnutls_datum_t * data) {
@@ -52,118 +66,708 @@ static int load_datum_from_file(apr_pool_t * pool,
     return 0;
 }
 
-const char *mgs_set_dh_file(cmd_parms * parms, void *dummy,
-        const char *arg) {
+/**
+ * Config Registry
+ *
+ * Many virtual hosts tend to name the same CA file, certificate, DH
+ * parameters or priority string.  Each of them is parsed only once
+ * per configuration, and the virtual hosts share the result.  Files
+ * are known by path, size, modification time and inode, so a file
+ * that is replaced while the configuration is read is parsed again.
+ * The registry lives in the configuration pool and starts empty with
+ * every configuration; the files it names are the ones the
+ * credential cache below keeps.
+ */
+
+#define REGISTRY_KEY "mod_gnutls:config_registry"
+
+static apr_hash_t *registry_get_hash(apr_pool_t *pconf) {
+    apr_hash_t *registry = NULL;
+
+    apr_pool_userdata_get((void **) &registry, REGISTRY_KEY, pconf);
+    if (registry == NULL) {
+        registry = apr_hash_make(pconf);
+        apr_pool_userdata_setn(registry, REGISTRY_KEY, NULL, pconf);
+    }
+    return registry;
+}
+
+/* The registry key of FILE parsed as KIND, NULL if FILE is missing */
+static const char *registry_file_key(apr_pool_t *p, const char *kind,
+        const char *file, apr_finfo_t *finfo) {
+    if (apr_stat(finfo, file,
+            APR_FINFO_SIZE | APR_FINFO_MTIME | APR_FINFO_INODE, p)
+            != APR_SUCCESS)
+        return NULL;
+    return apr_psprintf(p, "%s:%" APR_OFF_T_FMT ":%" APR_TIME_T_FMT
+            ":%lu:%s", kind, finfo->size, finfo->mtime,
+            (unsigned long) finfo->inode, file);
+}
+
+static void *registry_get(cmd_parms *parms, const char *key) {
+    if (key == NULL)
+        return NULL;
+    return apr_hash_get(registry_get_hash(parms->pool), key,
+            APR_HASH_KEY_STRING);
+}
+
+static void registry_set(cmd_parms *parms, const char *key, void *value) {
+    if (key == NULL)
+        return;
+    apr_hash_set(registry_get_hash(parms->pool),
+            apr_pstrdup(parms->pool, key), APR_HASH_KEY_STRING, value);
+}
+
+/**
+ * Deferred Loading
+ *
+ * Certificate, key, client CA and DH parameter files only get checked
+ * for existence by their directives.  Parsing them, mostly the private
+ * keys, is what takes long with many virtual hosts, so
+ * mgs_config_load_files() parses all of them together in post_config,
+ * on as many threads as there are CPUs.  Each distinct file is one
+ * job, shared by the virtual hosts naming it through the config
+ * registry.  Errors are reported after all jobs are done, in
+ * configuration order.
+ *
+ * Files found unchanged in the GnuTLSCredentialStore are imported
+ * from the DER stored there instead.
+ */
+
+#define JOBS_KEY "mod_gnutls:config_jobs"
+
+#define INIT_CA_SIZE 128
+
+typedef enum {
+    LOAD_CRT,
+    LOAD_KEY,
+    LOAD_CA,
+    LOAD_DH
+} load_kind_e;
+
+static const char *load_kind_names[] = { "crt", "key", "ca", "dh" };
+static const char *load_kind_desc[] = {
+    "Certificate", "Private Key", "Client CA File", "DH params"
+};
+
+/* Jobs outlive the configuration that created them, see the
+ * credential cache, so they are allocated with malloc() */
+struct mgs_load_job_t {
+    char *key;
+    load_kind_e kind;
+    char *file;
+    apr_off_t size;
+    apr_time_t mtime;
+    apr_ino_t inode;
+    /* LOAD_CRT and LOAD_CA */
+    gnutls_x509_crt_t *certs;
+    unsigned int num;
+    /* LOAD_KEY */
+    gnutls_x509_privkey_t privkey;
+    /* LOAD_DH */
+    gnutls_dh_params_t dh;
+    /* results */
+    int done;
+    int from_store;
+    apr_status_t rv;
     int ret;
-    gnutls_datum_t data;
+};
+
+static void load_job_free(mgs_load_job_t *job) {
+    unsigned int i;
+
+    for (i = 0; i < job->num; i++)
+        gnutls_x509_crt_deinit(job->certs[i]);
+    free(job->certs);
+    if (job->privkey != NULL)
+        gnutls_x509_privkey_deinit(job->privkey);
+    if (job->dh != NULL)
+        gnutls_dh_params_deinit(job->dh);
+    free(job->key);
+    free(job->file);
+    free(job);
+}
+
+static int load_job_failed(mgs_load_job_t *job) {
+    return job->rv != APR_SUCCESS || job->ret < 0;
+}
+
+/**
+ * Credential Cache
+ *
+ * A graceful restart reads the whole configuration again, although
+ * mostly nothing but a few directives changed.  The load jobs are
+ * kept in the process pool under their registry key, so the next
+ * configuration takes the parsed certificates, keys, CA lists and DH
+ * parameters of unchanged files as they are, and a restart only
+ * parses the files that changed.  Jobs the new configuration does not
+ * name anymore are freed by mgs_config_load_files().
+ *
+ * Parsed objects only stay valid while libgnutls stays loaded and
+ * initialized, and the unloading of mod_gnutls on restarts would
+ * unload it as well.  So the cache takes a reference on the library
+ * first; where that is impossible, it lives in the configuration pool
+ * and every configuration parses all files again.
+ */
+
+#define CACHE_KEY "mod_gnutls:credential_cache"
+#define CACHE_PINNED_KEY "mod_gnutls:gnutls_pinned"
+
+/* Keep libgnutls loaded and initialized for the lifetime of POOL */
+static int cache_pin_gnutls(apr_pool_t *pool) {
+#if HAVE_DLADDR
+    apr_dso_handle_t *dso;
+    Dl_info info;
+
+    if (dladdr((void *) gnutls_global_init, &info) == 0
+            || info.dli_fname == NULL)
+        return 0;
+    if (apr_dso_load(&dso, info.dli_fname, pool) != APR_SUCCESS)
+        return 0;
+    /* never released, mgs_cleanup_pre_config() only drops its own */
+    return gnutls_global_init() >= 0;
+#else
+    return 0;
+#endif
+}
+
+static apr_status_t cache_cleanup(void *data) {
+    apr_hash_t *cache = data;
+    apr_hash_index_t *hi;
+
+    for (hi = apr_hash_first(NULL, cache); hi; hi = apr_hash_next(hi)) {
+        void *job;
+
+        apr_hash_this(hi, NULL, NULL, &job);
+        load_job_free(job);
+    }
+    apr_hash_clear(cache);
+    return APR_SUCCESS;
+}
+
+static apr_hash_t *cache_get_hash(process_rec *process, apr_pool_t *pconf) {
+    apr_hash_t *cache = NULL;
+    void *pinned = NULL;
+    apr_pool_t *p = process->pool;
+
+    /* the keys are copied: this module may be unloaded on restart,
+     * the process pool stays */
+    apr_pool_userdata_get(&pinned, CACHE_PINNED_KEY, p);
+    if (pinned == NULL) {
+        pinned = apr_pstrdup(p, cache_pin_gnutls(p) ? "yes" : "no");
+        apr_pool_userdata_set(pinned, CACHE_PINNED_KEY,
+                apr_pool_cleanup_null, p);
+    }
+    if (strcmp(pinned, "yes") != 0)
+        p = pconf;
+
+    apr_pool_userdata_get((void **) &cache, CACHE_KEY, p);
+    if (cache == NULL) {
+        cache = apr_hash_make(p);
+        apr_pool_userdata_set(cache, CACHE_KEY, apr_pool_cleanup_null, p);
+        /* runs before gnutls_global_deinit(), which was registered
+         * earlier by pre_config */
+        if (p == pconf)
+            apr_pool_cleanup_register(p, cache, cache_cleanup,
+                    apr_pool_cleanup_null);
+    }
+    return cache;
+}
+
+/* Frees the jobs that the configuration in PCONF does not use */
+static int cache_prune(process_rec *process, apr_pool_t *pconf) {
+    apr_hash_t *cache = cache_get_hash(process, pconf);
+    apr_hash_t *registry = registry_get_hash(pconf);
+    apr_hash_index_t *hi;
+    int freed = 0;
+
+    for (hi = apr_hash_first(NULL, cache); hi; hi = apr_hash_next(hi)) {
+        mgs_load_job_t *job;
+        void *val;
+
+        apr_hash_this(hi, NULL, NULL, &val);
+        job = val;
+        if (apr_hash_get(registry, job->key, APR_HASH_KEY_STRING) == job)
+            continue;
+        /* deleting the current entry keeps the iteration valid */
+        apr_hash_set(cache, job->key, APR_HASH_KEY_STRING, NULL);
+        load_job_free(job);
+        freed++;
+    }
+    return freed;
+}
+
+static mgs_load_job_t *load_job_get(cmd_parms *parms, load_kind_e kind,
+        const char *arg, const char **err) {
+    apr_array_header_t *jobs = NULL;
+    apr_hash_t *cache;
+    mgs_load_job_t *job;
+    apr_finfo_t finfo;
     const char *file;
-    apr_pool_t *spool;
+    const char *key;
+
+    file = ap_server_root_relative(parms->pool, arg);
+    if (file == NULL) {
+        *err = apr_psprintf(parms->pool, "GnuTLS: Invalid path '%s'", arg);
+        return NULL;
+    }
+
+    key = registry_file_key(parms->temp_pool, load_kind_names[kind], file,
+            &finfo);
+    if (key == NULL) {
+        *err = apr_psprintf(parms->pool, "GnuTLS: Error Reading %s '%s'",
+                load_kind_desc[kind], file);
+        return NULL;
+    }
+
+    job = registry_get(parms, key);
+    if (job != NULL)
+        return job;
+
+    cache = cache_get_hash(parms->server->process, parms->pool);
+    job = apr_hash_get(cache, key, APR_HASH_KEY_STRING);
+    if (job != NULL && load_job_failed(job)) {
+        /* try again, the error may have been fixed */
+        apr_hash_set(cache, key, APR_HASH_KEY_STRING, NULL);
+        load_job_free(job);
+        job = NULL;
+    }
+
+    if (job == NULL) {
+        job = calloc(1, sizeof (*job));
+        if (job == NULL
+                || (job->key = strdup(key)) == NULL
+                || (job->file = strdup(file)) == NULL
+                || (kind == LOAD_CRT && (job->certs =
+                calloc(MAX_CHAIN_SIZE, sizeof (*job->certs))) == NULL)) {
+            if (job != NULL)
+                load_job_free(job);
+            *err = "GnuTLS: Out of memory";
+            return NULL;
+        }
+        job->kind = kind;
+        job->size = finfo.size;
+        job->mtime = finfo.mtime;
+        job->inode = finfo.inode;
+        apr_hash_set(cache, job->key, APR_HASH_KEY_STRING, job);
+    }
+    registry_set(parms, key, job);
+
+    apr_pool_userdata_get((void **) &jobs, JOBS_KEY, parms->pool);
+    if (jobs == NULL) {
+        jobs = apr_array_make(parms->pool, 16, sizeof (mgs_load_job_t *));
+        apr_pool_userdata_setn(jobs, JOBS_KEY, NULL, parms->pool);
+    }
+    APR_ARRAY_PUSH(jobs, mgs_load_job_t *) = job;
+
+    return job;
+}
+
+const char *mgs_set_cert_file(cmd_parms * parms, void *dummy, const char *arg) {
+    const char *err = NULL;
+
+    mgs_srvconf_rec *sc = (mgs_srvconf_rec *) ap_get_module_config(parms->server->module_config, &gnutls_module);
+
+    sc->cert_load = load_job_get(parms, LOAD_CRT, arg, &err);
+    return err;
+}
+
+const char *mgs_set_key_file(cmd_parms * parms, void *dummy, const char *arg) {
+    const char *err = NULL;
+
+	mgs_srvconf_rec *sc = (mgs_srvconf_rec *) ap_get_module_config(parms->server->module_config, &gnutls_module);
+
+    sc->key_load = load_job_get(parms, LOAD_KEY, arg, &err);
+    return err;
+}
+
+const char *mgs_set_client_ca_file(cmd_parms * parms, void *dummy,
+        const char *arg) {
+    const char *err = NULL;
+
     mgs_srvconf_rec *sc =
             (mgs_srvconf_rec *) ap_get_module_config(parms->server->
             module_config,
             &gnutls_module);
 
-    apr_pool_create(&spool, parms->pool);
+    sc->ca_load = load_job_get(parms, LOAD_CA, arg, &err);
+    return err;
+}
 
-    file = ap_server_root_relative(spool, arg);
+const char *mgs_set_dh_file(cmd_parms * parms, void *dummy,
+        const char *arg) {
+    const char *err = NULL;
 
-    if (load_datum_from_file(spool, file, &data) != 0) {
-        return apr_psprintf(parms->pool, "GnuTLS: Error Reading "
-                "DH params '%s'", file);
-    }
+    mgs_srvconf_rec *sc =
+            (mgs_srvconf_rec *) ap_get_module_config(parms->server->
+            module_config,
+            &gnutls_module);
 
-    ret = gnutls_dh_params_init(&sc->dh_params);
-    if (ret < 0) {
-        return apr_psprintf(parms->pool,
-                "GnuTLS: Failed to initialize"
-                ": (%d) %s", ret,
-                gnutls_strerror(ret));
-    }
+    sc->dh_load = load_job_get(parms, LOAD_DH, arg, &err);
+    return err;
+}
 
-    ret =
-            gnutls_dh_params_import_pkcs3(sc->dh_params, &data,
-            GNUTLS_X509_FMT_PEM);
-    if (ret < 0) {
-        return apr_psprintf(parms->pool,
-                "GnuTLS: Failed to Import "
-                "DH params '%s': (%d) %s", file, ret,
-                gnutls_strerror(ret));
+const char *mgs_set_cred_store(cmd_parms * parms, void *dummy,
+        const char *arg) {
+    const char *file;
+    const char *err;
+    mgs_srvconf_rec *sc =
+            ap_get_module_config(parms->server->module_config,
+            &gnutls_module);
+
+    if ((err = ap_check_cmd_context(parms, GLOBAL_ONLY))) {
+        return err;
     }
 
-    apr_pool_destroy(spool);
+    file = ap_server_root_relative(parms->pool, arg);
+    if (file == NULL)
+        return apr_psprintf(parms->pool, "GnuTLSCredentialStore: "
+                "Invalid path '%s'", arg);
+
+    err = mgs_credstore_open(parms->pool, file, &sc->cred_store);
+    if (err != NULL)
+        return apr_pstrcat(parms->pool, "GnuTLSCredentialStore: ", err,
+                NULL);
 
     return NULL;
 }
 
-const char *mgs_set_cert_file(cmd_parms * parms, void *dummy, const char *arg) {
+/* Import the DER items of JOB found in the credential store */
+static void load_job_import(mgs_load_job_t *job, gnutls_datum_t *der,
+        unsigned int n) {
+    unsigned int i;
 
-    int ret;
+    if (job->kind == LOAD_KEY) {
+        job->ret = gnutls_x509_privkey_init(&job->privkey);
+        if (job->ret < 0) {
+            job->privkey = NULL;
+            return;
+        }
+        job->ret = gnutls_x509_privkey_import(job->privkey, &der[0],
+                GNUTLS_X509_FMT_DER);
+        if (job->ret < 0)
+            job->ret = gnutls_x509_privkey_import_pkcs8(job->privkey,
+                    &der[0], GNUTLS_X509_FMT_DER, NULL, GNUTLS_PKCS_PLAIN);
+        return;
+    }
+
+    if (job->kind == LOAD_CRT && n > MAX_CHAIN_SIZE)
+        n = MAX_CHAIN_SIZE;
+    if (job->kind == LOAD_CA) {
+        job->certs = malloc(n * sizeof (*job->certs));
+        if (job->certs == NULL) {
+            job->ret = GNUTLS_E_MEMORY_ERROR;
+            return;
+        }
+    }
+
+    for (job->num = 0; job->num < n; job->num++) {
+        i = job->num;
+        job->ret = gnutls_x509_crt_init(&job->certs[i]);
+        if (job->ret < 0)
+            break;
+        job->ret = gnutls_x509_crt_import(job->certs[i], &der[i],
+                GNUTLS_X509_FMT_DER);
+        if (job->ret < 0) {
+            gnutls_x509_crt_deinit(job->certs[i]);
+            break;
+        }
+    }
+    if (job->ret < 0)
+        job->num = 0;
+}
+
+/* Parse a PEM encoded list of CA certificates of any length */
+static void load_job_ca(mgs_load_job_t *job, gnutls_datum_t *data) {
+    job->num = INIT_CA_SIZE;
+    job->certs = malloc(job->num * sizeof (*job->certs));
+    if (job->certs == NULL) {
+        job->ret = GNUTLS_E_MEMORY_ERROR;
+        return;
+    }
+
+    job->ret = gnutls_x509_crt_list_import(job->certs, &job->num, data,
+            GNUTLS_X509_FMT_PEM, GNUTLS_X509_CRT_LIST_IMPORT_FAIL_IF_EXCEED);
+    if (job->ret == GNUTLS_E_SHORT_MEMORY_BUFFER && INIT_CA_SIZE < job->num) {
+        gnutls_x509_crt_t *certs = realloc(job->certs,
+                job->num * sizeof (*job->certs));
+
+        if (certs == NULL) {
+            job->ret = GNUTLS_E_MEMORY_ERROR;
+            return;
+        }
+        job->certs = certs;
+
+        /* re-read */
+        job->ret = gnutls_x509_crt_list_import(job->certs, &job->num, data,
+                GNUTLS_X509_FMT_PEM, 0);
+    }
+    if (job->ret < 0)
+        job->num = 0;
+}
+
+static void load_job_run(apr_pool_t *p, mgs_credstore_t *store,
+        mgs_load_job_t *job) {
     gnutls_datum_t data;
-    const char *file;
-    apr_pool_t *spool;
+    gnutls_datum_t *der;
+    int n;
+
+    /* the store has no DH parameters */
+    n = job->kind == LOAD_DH ? 0 : mgs_credstore_find(store, p, job->file,
+            job->kind == LOAD_KEY ? CREDSTORE_KEY : CREDSTORE_CRT,
+            job->size, job->mtime, &der);
+    if (n > 0) {
+        job->from_store = 1;
+        load_job_import(job, der, n);
+        return;
+    }
 
-    mgs_srvconf_rec *sc = (mgs_srvconf_rec *) ap_get_module_config(parms->server->module_config, &gnutls_module);
-    apr_pool_create(&spool, parms->pool);
+    job->rv = load_datum_from_file(p, job->file, &data);
+    if (job->rv != APR_SUCCESS)
+        return;
 
-    file = ap_server_root_relative(spool, arg);
+    if (job->kind == LOAD_CRT) {
+        job->num = MAX_CHAIN_SIZE;
+        job->ret = gnutls_x509_crt_list_import(job->certs, &job->num, &data,
+                GNUTLS_X509_FMT_PEM, 0);
+        if (job->ret < 0)
+            job->num = 0;
+        return;
+    }
 
-    if (load_datum_from_file(spool, file, &data) != 0) {
-		apr_pool_destroy(spool);
-        return apr_psprintf(parms->pool, "GnuTLS: Error Reading Certificate '%s'", file);
+    if (job->kind == LOAD_CA) {
+        load_job_ca(job, &data);
+        return;
     }
 
-    sc->certs_x509_chain_num = MAX_CHAIN_SIZE;
-    ret = gnutls_x509_crt_list_import(sc->certs_x509_chain, &sc->certs_x509_chain_num, &data, GNUTLS_X509_FMT_PEM, 0);
-    if (ret < 0) {
-		apr_pool_destroy(spool);
-        return apr_psprintf(parms->pool, "GnuTLS: Failed to Import Certificate '%s': (%d) %s", file, ret, gnutls_strerror(ret));
+    if (job->kind == LOAD_DH) {
+        job->ret = gnutls_dh_params_init(&job->dh);
+        if (job->ret < 0) {
+            job->dh = NULL;
+            return;
+        }
+        job->ret = gnutls_dh_params_import_pkcs3(job->dh, &data,
+                GNUTLS_X509_FMT_PEM);
+        return;
     }
 
-	apr_pool_destroy(spool);
-    return NULL;
+    job->ret = gnutls_x509_privkey_init(&job->privkey);
+    if (job->ret < 0) {
+        job->privkey = NULL;
+        return;
+    }
 
+    job->ret = gnutls_x509_privkey_import(job->privkey, &data,
+            GNUTLS_X509_FMT_PEM);
+    if (job->ret < 0)
+        job->ret = gnutls_x509_privkey_import_pkcs8(job->privkey, &data,
+                GNUTLS_X509_FMT_PEM, NULL, GNUTLS_PKCS_PLAIN);
 }
 
-const char *mgs_set_key_file(cmd_parms * parms, void *dummy, const char *arg) {
+/* The error of a finished job, NULL if it succeeded */
+static const char *load_job_error(apr_pool_t *p, mgs_load_job_t *job) {
+    const char *what = load_kind_desc[job->kind];
 
-    int ret;
-    gnutls_datum_t data;
-    const char *file;
-    apr_pool_t *spool;
-    const char *out;
+    if (job->rv != APR_SUCCESS)
+        return apr_psprintf(p, "Error Reading %s '%s'", what, job->file);
+    if (job->ret < 0)
+        return apr_psprintf(p, "Failed to Import %s '%s': (%d) %s",
+                what, job->file, job->ret, gnutls_strerror(job->ret));
+    return NULL;
+}
 
-	mgs_srvconf_rec *sc = (mgs_srvconf_rec *) ap_get_module_config(parms->server->module_config, &gnutls_module);
+typedef struct {
+    apr_array_header_t *jobs;
+    mgs_credstore_t *store;
+    volatile apr_uint32_t next;
+} load_queue_t;
 
-	apr_pool_create(&spool, parms->pool);
+static void load_queue_run(apr_pool_t *p, load_queue_t *q) {
+    apr_uint32_t i;
 
-    file = ap_server_root_relative(spool, arg);
+    while ((i = apr_atomic_inc32(&q->next)) < (apr_uint32_t) q->jobs->nelts) {
+        load_job_run(p, q->store,
+                APR_ARRAY_IDX(q->jobs, i, mgs_load_job_t *));
+        apr_pool_clear(p);
+    }
+}
 
-    if (load_datum_from_file(spool, file, &data) != 0) {
-        out = apr_psprintf(parms->pool, "GnuTLS: Error Reading Private Key '%s'", file);
-		apr_pool_destroy(spool);
-        return out;
+#if APR_HAS_THREADS
+static void *APR_THREAD_FUNC load_thread(apr_thread_t *thd, void *data) {
+    load_queue_t *q = data;
+    apr_pool_t *p;
+
+    /* every thread allocates from its own pool */
+    apr_pool_create_unmanaged_ex(&p, NULL, NULL);
+    load_queue_run(p, q);
+    apr_pool_destroy(p);
+    apr_thread_exit(thd, APR_SUCCESS);
+    return NULL;
+}
+#endif
+
+int mgs_config_load_files(apr_pool_t *p, apr_pool_t *ptemp,
+        server_rec *base_server) {
+    mgs_srvconf_rec *sc_base = (mgs_srvconf_rec *)
+            ap_get_module_config(base_server->module_config, &gnutls_module);
+    apr_array_header_t *jobs = NULL;
+    load_queue_t q;
+    server_rec *s;
+    apr_pool_t *lp;
+    int nthreads = 1;
+    int failed = 0;
+    int i, stored = 0, freed;
+
+    /* drop what the previous configuration left behind */
+    freed = cache_prune(base_server->process, p);
+
+    apr_pool_userdata_get((void **) &jobs, JOBS_KEY, p);
+    if (jobs == NULL)
+        return 0;
+    /* the files of a configuration are only parsed once */
+    apr_pool_userdata_setn(NULL, JOBS_KEY, NULL, p);
+
+    /* files unchanged since the previous configuration are done */
+    q.jobs = apr_array_make(ptemp, jobs->nelts, sizeof (mgs_load_job_t *));
+    q.store = sc_base->cred_store;
+    q.next = 0;
+    for (i = 0; i < jobs->nelts; i++) {
+        mgs_load_job_t *job = APR_ARRAY_IDX(jobs, i, mgs_load_job_t *);
+
+        if (!job->done)
+            APR_ARRAY_PUSH(q.jobs, mgs_load_job_t *) = job;
     }
 
-    ret = gnutls_x509_privkey_init(&sc->privkey_x509);
+#if APR_HAS_THREADS
+    {
+        apr_thread_t **threads;
+        apr_status_t rv;
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+        if (cpus > 1)
+            nthreads = cpus < q.jobs->nelts ? (int) cpus : q.jobs->nelts;
+
+        /* this thread takes jobs as well */
+        threads = apr_pcalloc(ptemp, nthreads * sizeof (*threads));
+        for (i = 1; i < nthreads; i++) {
+            rv = apr_thread_create(&threads[i], NULL, load_thread, &q, ptemp);
+            if (rv != APR_SUCCESS) {
+                threads[i] = NULL;
+                break;
+            }
+        }
+        nthreads = i;
 
-    if (ret < 0) {
-		apr_pool_destroy(spool);
-        return apr_psprintf(parms->pool, "GnuTLS: Failed to initialize: (%d) %s", ret, gnutls_strerror(ret));
+        apr_pool_create(&lp, ptemp);
+        load_queue_run(lp, &q);
+        for (i = 1; i < nthreads; i++)
+            apr_thread_join(&rv, threads[i]);
     }
+#else
+    apr_pool_create(&lp, ptemp);
+    load_queue_run(lp, &q);
+#endif
 
-    ret = gnutls_x509_privkey_import(sc->privkey_x509, &data, GNUTLS_X509_FMT_PEM);
+    for (i = 0; i < q.jobs->nelts; i++) {
+        mgs_load_job_t *job = APR_ARRAY_IDX(q.jobs, i, mgs_load_job_t *);
 
-    if (ret < 0) {
-        ret = gnutls_x509_privkey_import_pkcs8(sc->privkey_x509, &data, GNUTLS_X509_FMT_PEM, NULL, GNUTLS_PKCS_PLAIN);
-	}
+        job->done = 1;
+        stored += job->from_store;
+    }
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, base_server,
+            "GnuTLS: Parsed %d certificate and key files on %d threads, "
+            "%d of them from the credential store, reused %d unchanged "
+            "ones and freed %d", q.jobs->nelts, nthreads, stored,
+            jobs->nelts - q.jobs->nelts, freed);
+
+    /* hand out the results, and report errors per virtual host */
+    for (s = base_server; s; s = s->next) {
+        mgs_srvconf_rec *sc = (mgs_srvconf_rec *)
+                ap_get_module_config(s->module_config, &gnutls_module);
+        const char *err;
+
+        if (sc->cert_load != NULL) {
+            err = load_job_error(ptemp, sc->cert_load);
+            if (err != NULL) {
+                ap_log_error(APLOG_MARK, APLOG_STARTUP, 0, s,
+                        "GnuTLS: Host '%s:%d': %s",
+                        s->server_hostname, s->port, err);
+                failed++;
+            }
+            sc->certs_x509_chain = sc->cert_load->certs;
+            sc->certs_x509_chain_num = sc->cert_load->num;
+        }
 
-    if (ret < 0) {
-        out = apr_psprintf(parms->pool, "GnuTLS: Failed to Import Private Key '%s': (%d) %s", file, ret, gnutls_strerror(ret));
-		apr_pool_destroy(spool);
-        return out;
+        if (sc->key_load != NULL) {
+            err = load_job_error(ptemp, sc->key_load);
+            if (err != NULL) {
+                ap_log_error(APLOG_MARK, APLOG_STARTUP, 0, s,
+                        "GnuTLS: Host '%s:%d': %s",
+                        s->server_hostname, s->port, err);
+                failed++;
+            } else {
+                sc->privkey_x509 = sc->key_load->privkey;
+            }
+        }
+
+        if (sc->ca_load != NULL) {
+            err = load_job_error(ptemp, sc->ca_load);
+            if (err != NULL) {
+                ap_log_error(APLOG_MARK, APLOG_STARTUP, 0, s,
+                        "GnuTLS: Host '%s:%d': %s",
+                        s->server_hostname, s->port, err);
+                failed++;
+            }
+            sc->ca_list = sc->ca_load->certs;
+            sc->ca_list_size = sc->ca_load->num;
+        }
+
+        if (sc->dh_load != NULL) {
+            err = load_job_error(ptemp, sc->dh_load);
+            if (err != NULL) {
+                ap_log_error(APLOG_MARK, APLOG_STARTUP, 0, s,
+                        "GnuTLS: Host '%s:%d': %s",
+                        s->server_hostname, s->port, err);
+                failed++;
+            } else {
+                sc->dh_params = sc->dh_load->dh;
+            }
+        }
     }
 
-    apr_pool_destroy(spool);
+    return failed;
+}
+
+const char *mgs_config_load_file(mgs_load_job_t *job, apr_finfo_t *finfo) {
+    finfo->size = job->size;
+    finfo->mtime = job->mtime;
+    finfo->inode = job->inode;
+    return job->file;
+}
+
+const char *mgs_set_cert_dir(cmd_parms * parms, void *dummy,
+        const char *dir, const char *max) {
+    apr_finfo_t finfo;
+    mgs_srvconf_rec *sc =
+            ap_get_module_config(parms->server->module_config,
+            &gnutls_module);
+
+    sc->cert_dir = ap_server_root_relative(parms->pool, dir);
+    if (sc->cert_dir == NULL)
+        return apr_psprintf(parms->pool, "GnuTLSCertificateDirectory: "
+                "Invalid path '%s'", dir);
+
+    if (apr_stat(&finfo, sc->cert_dir, APR_FINFO_TYPE, parms->temp_pool)
+            != APR_SUCCESS || finfo.filetype != APR_DIR)
+        return apr_psprintf(parms->pool, "GnuTLSCertificateDirectory: "
+                "'%s' is not a directory", sc->cert_dir);
+
+    if (max) {
+        if (atoi(max) < 1)
+            return "GnuTLSCertificateDirectory: the number of certificates "
+                    "to keep loaded must be positive";
+        sc->cert_dir_max = atoi(max);
+    }
 
     return NULL;
 }
@@ -264,6 +868,95 @@ const char *mgs_set_tickets(cmd_parms * parms, void *dummy,
     return NULL;
 }
 
+const char *mgs_set_session_context(cmd_parms * parms, void *dummy,
+        const char *arg) {
+    mgs_srvconf_rec *sc =
+            (mgs_srvconf_rec *) ap_get_module_config(parms->server->
+            module_config,
+            &gnutls_module);
+
+    sc->session_context = apr_pstrdup(parms->pool, arg);
+
+    return NULL;
+}
+
+const char *mgs_set_sni_reject_unknown(cmd_parms * parms, void *dummy,
+        const char *arg) {
+    mgs_srvconf_rec *sc =
+            (mgs_srvconf_rec *) ap_get_module_config(parms->server->
+            module_config,
+            &gnutls_module);
+
+    if (!strcasecmp(arg, "On")) {
+        sc->sni_reject_unknown = GNUTLS_ENABLED_TRUE;
+    } else if (!strcasecmp(arg, "Off")) {
+        sc->sni_reject_unknown = GNUTLS_ENABLED_FALSE;
+    } else {
+        return "GnuTLSSNIRejectUnknown must be set to 'On' or 'Off'";
+    }
+
+    return NULL;
+}
+
+const char *mgs_set_sni_deny(cmd_parms * parms, void *dummy,
+        const char *arg) {
+    mgs_srvconf_rec *sc =
+            (mgs_srvconf_rec *) ap_get_module_config(parms->server->
+            module_config,
+            &gnutls_module);
+    char *name = apr_pstrdup(parms->pool, arg);
+    char *c;
+
+    for (c = name; *c; c++)
+        *c = apr_tolower(*c);
+
+    if (sc->sni_deny_names == NULL) {
+        sc->sni_deny_names = apr_hash_make(parms->pool);
+        sc->sni_deny_patterns = apr_array_make(parms->pool, 4,
+                sizeof (char *));
+    }
+    if (apr_fnmatch_test(name))
+        *(char **) apr_array_push(sc->sni_deny_patterns) = name;
+    else
+        apr_hash_set(sc->sni_deny_names, name, APR_HASH_KEY_STRING, name);
+
+    return NULL;
+}
+
+const char *mgs_set_ticket_key_file(cmd_parms * parms, void *dummy,
+        const char *file, const char *rotate, const char *keep) {
+    const char *err;
+    mgs_srvconf_rec *sc =
+            ap_get_module_config(parms->server->module_config,
+            &gnutls_module);
+
+    if ((err = ap_check_cmd_context(parms, GLOBAL_ONLY))) {
+        return err;
+    }
+
+    sc->ticket_key_file = ap_server_root_relative(parms->pool, file);
+    if (sc->ticket_key_file == NULL)
+        return apr_psprintf(parms->pool, "GnuTLSSessionTicketKeyFile: "
+                "Invalid path '%s'", file);
+
+    if (rotate) {
+        if (atoi(rotate) < 0)
+            return "GnuTLSSessionTicketKeyFile: rotation interval must be "
+                    "a number of seconds";
+        sc->ticket_key_rotate = apr_time_from_sec(atoi(rotate));
+    }
+
+    if (keep) {
+        sc->ticket_key_keep = atoi(keep);
+        if (sc->ticket_key_keep < 0
+                || sc->ticket_key_keep >= MAX_TICKET_KEYS)
+            return apr_psprintf(parms->pool, "GnuTLSSessionTicketKeyFile: "
+                    "can keep 0 to %d previous keys", MAX_TICKET_KEYS - 1);
+    }
+
+    return NULL;
+}
+
 
 #ifdef ENABLE_SRP
 
@@ -304,6 +997,17 @@ const char *mgs_set_cache(cmd_parms * parms, void *dummy,
         return err;
     }
 
+#if HAVE_AP_SOCACHE
+    /* GnuTLSCache socache:NAME[:ARGS] */
+    if (strncasecmp("socache:", type, 8) == 0) {
+        if (arg != NULL)
+            return "GnuTLSCache socache takes a single argument";
+        sc->cache_type = mgs_cache_socache;
+        sc->cache_config = apr_pstrdup(parms->pool, type + 8);
+        return NULL;
+    }
+#endif
+
     if (strcasecmp("none", type) == 0) {
         sc->cache_type = mgs_cache_none;
         sc->cache_config = NULL;
@@ -312,7 +1016,14 @@ const char *mgs_set_cache(cmd_parms * parms, void *dummy,
         sc->cache_type = mgs_cache_dbm;
     } else if (strcasecmp("gdbm", type) == 0) {
         sc->cache_type = mgs_cache_gdbm;
+    } else if (strcasecmp("shm", type) == 0) {
+        sc->cache_type = mgs_cache_shm;
+    }
+#if HAVE_LMDB
+    else if (strcasecmp("lmdb", type) == 0) {
+        sc->cache_type = mgs_cache_lmdb;
     }
+#endif
 #if HAVE_APR_MEMCACHE
     else if (strcasecmp("memcache", type) == 0) {
         sc->cache_type = mgs_cache_memcache;
@@ -326,9 +1037,17 @@ const char *mgs_set_cache(cmd_parms * parms, void *dummy,
         return "Invalid argument 2 for GnuTLSCache!";
 
     if (sc->cache_type == mgs_cache_dbm
-            || sc->cache_type == mgs_cache_gdbm) {
+            || sc->cache_type == mgs_cache_gdbm
+#if HAVE_LMDB
+            || sc->cache_type == mgs_cache_lmdb
+#endif
+            ) {
         sc->cache_config =
                 ap_server_root_relative(parms->pool, arg);
+    } else if (sc->cache_type == mgs_cache_shm) {
+        if (apr_atoi64(arg) <= 0)
+            return "GnuTLSCache shm: size must be a positive number of bytes";
+        sc->cache_config = apr_pstrdup(parms->pool, arg);
     } else {
         sc->cache_config = apr_pstrdup(parms->pool, arg);
     }
@@ -339,16 +1058,11 @@ const char *mgs_set_cache(cmd_parms * parms, void *dummy,
 const char *mgs_set_cache_timeout(cmd_parms * parms, void *dummy,
         const char *arg) {
     int argint;
-    const char *err;
     mgs_srvconf_rec *sc =
             (mgs_srvconf_rec *) ap_get_module_config(parms->server->
             module_config,
             &gnutls_module);
 
-    if ((err = ap_check_cmd_context(parms, GLOBAL_ONLY))) {
-        return err;
-    }
-
     argint = atoi(arg);
 
     if (argint < 0) {
@@ -362,6 +1076,174 @@ const char *mgs_set_cache_timeout(cmd_parms * parms, void *dummy,
     return NULL;
 }
 
+const char *mgs_set_cache_local(cmd_parms * parms, void *dummy,
+        const char *arg) {
+    apr_int64_t size;
+    const char *err;
+    mgs_srvconf_rec *sc =
+            ap_get_module_config(parms->server->module_config,
+            &gnutls_module);
+
+    if ((err = ap_check_cmd_context(parms, GLOBAL_ONLY))) {
+        return err;
+    }
+
+    size = apr_atoi64(arg);
+    if (size < 0)
+        return "GnuTLSCacheLocal: size must be a number of bytes";
+
+    sc->cache_local_size = (apr_size_t) size;
+
+    return NULL;
+}
+
+const char *mgs_set_cache_replicas(cmd_parms * parms, void *dummy,
+        const char *arg) {
+    int argint;
+    const char *err;
+    mgs_srvconf_rec *sc =
+            ap_get_module_config(parms->server->module_config,
+            &gnutls_module);
+
+    if ((err = ap_check_cmd_context(parms, GLOBAL_ONLY))) {
+        return err;
+    }
+
+    argint = atoi(arg);
+    if (argint < 1 || argint > MAX_CACHE_REPLICAS)
+        return apr_psprintf(parms->pool, "GnuTLSCacheReplicas: must be "
+                "between 1 and %d", MAX_CACHE_REPLICAS);
+
+    sc->cache_replicas = argint;
+
+    return NULL;
+}
+
+const char *mgs_set_cache_shards(cmd_parms * parms, void *dummy,
+        const char *arg) {
+    int argint;
+    const char *err;
+    mgs_srvconf_rec *sc =
+            ap_get_module_config(parms->server->module_config,
+            &gnutls_module);
+
+    if ((err = ap_check_cmd_context(parms, GLOBAL_ONLY))) {
+        return err;
+    }
+
+    argint = atoi(arg);
+    if (argint < 1 || argint > MAX_CACHE_SHARDS)
+        return apr_psprintf(parms->pool, "GnuTLSCacheShards: must be "
+                "between 1 and %d", MAX_CACHE_SHARDS);
+
+    sc->cache_shards = argint;
+
+    return NULL;
+}
+
+const char *mgs_set_cache_filter(cmd_parms * parms, void *dummy,
+        const char *arg) {
+    apr_int64_t size;
+    const char *err;
+    mgs_srvconf_rec *sc =
+            ap_get_module_config(parms->server->module_config,
+            &gnutls_module);
+
+    if ((err = ap_check_cmd_context(parms, GLOBAL_ONLY))) {
+        return err;
+    }
+
+    size = apr_atoi64(arg);
+    if (size < 0)
+        return "GnuTLSCacheFilter: size must be a number of bytes";
+
+    sc->cache_filter_size = (apr_size_t) size;
+
+    return NULL;
+}
+
+const char *mgs_set_cache_quota(cmd_parms * parms, void *dummy,
+        const char *arg) {
+    mgs_srvconf_rec *sc =
+            ap_get_module_config(parms->server->module_config,
+            &gnutls_module);
+    int quota = atoi(arg);
+
+    if (quota < 0 || quota > 100)
+        return "GnuTLSCacheQuota: must be a percentage from 0 to 100";
+
+    sc->cache_quota = quota;
+
+    return NULL;
+}
+
+const char *mgs_set_cache_snapshot(cmd_parms * parms, void *dummy,
+        const char *file, const char *interval) {
+    const char *err;
+    mgs_srvconf_rec *sc =
+            ap_get_module_config(parms->server->module_config,
+            &gnutls_module);
+
+    if ((err = ap_check_cmd_context(parms, GLOBAL_ONLY))) {
+        return err;
+    }
+
+    sc->cache_snapshot_file = ap_server_root_relative(parms->pool, file);
+    if (sc->cache_snapshot_file == NULL)
+        return apr_psprintf(parms->pool, "GnuTLSCacheSnapshot: "
+                "Invalid path '%s'", file);
+
+    if (interval) {
+        if (atoi(interval) < 0)
+            return "GnuTLSCacheSnapshot: interval must be a number of "
+                    "seconds";
+        sc->cache_snapshot_interval = apr_time_from_sec(atoi(interval));
+    }
+
+    return NULL;
+}
+
+const char *mgs_set_reload_interval(cmd_parms * parms, void *dummy,
+        const char *arg) {
+    const char *err;
+    mgs_srvconf_rec *sc =
+            ap_get_module_config(parms->server->module_config,
+            &gnutls_module);
+
+    if ((err = ap_check_cmd_context(parms, GLOBAL_ONLY))) {
+        return err;
+    }
+
+    if (atoi(arg) < 0 || !apr_isdigit(*arg))
+        return "GnuTLSReloadInterval: interval must be a number of seconds";
+    sc->reload_interval = apr_time_from_sec(atoi(arg));
+
+    return NULL;
+}
+
+const char *mgs_set_cache_pool(cmd_parms * parms, void *dummy,
+        const char *min, const char *smax, const char *max) {
+    const char *err;
+    mgs_srvconf_rec *sc =
+            ap_get_module_config(parms->server->module_config,
+            &gnutls_module);
+
+    if ((err = ap_check_cmd_context(parms, GLOBAL_ONLY))) {
+        return err;
+    }
+
+    sc->cache_pool_min = atoi(min);
+    sc->cache_pool_smax = atoi(smax);
+    sc->cache_pool_max = atoi(max);
+
+    if (sc->cache_pool_min < 0 || sc->cache_pool_max < 1
+            || sc->cache_pool_min > sc->cache_pool_smax
+            || sc->cache_pool_smax > sc->cache_pool_max)
+        return "GnuTLSCachePool: need 0 <= MIN <= SOFTMAX <= MAX, MAX >= 1";
+
+    return NULL;
+}
+
 const char *mgs_set_client_verify_method(cmd_parms * parms, void *dummy,
         const char *arg) {
     mgs_srvconf_rec *sc = (mgs_srvconf_rec *)ap_get_module_config(parms->server->module_config, &gnutls_module);
@@ -411,70 +1293,6 @@ const char *mgs_set_client_verify(cmd_parms * parms, void *dummy,
     return NULL;
 }
 
-#define INIT_CA_SIZE 128
-
-const char *mgs_set_client_ca_file(cmd_parms * parms, void *dummy,
-        const char *arg) {
-    int rv;
-    const char *file;
-    apr_pool_t *spool;
-    gnutls_datum_t data;
-
-    mgs_srvconf_rec *sc =
-            (mgs_srvconf_rec *) ap_get_module_config(parms->server->
-            module_config,
-            &gnutls_module);
-    apr_pool_create(&spool, parms->pool);
-
-    file = ap_server_root_relative(spool, arg);
-
-    if (load_datum_from_file(spool, file, &data) != 0) {
-        return apr_psprintf(parms->pool, "GnuTLS: Error Reading "
-                "Client CA File '%s'", file);
-    }
-
-    sc->ca_list_size = INIT_CA_SIZE;
-    sc->ca_list = malloc(sc->ca_list_size * sizeof (*sc->ca_list));
-    if (sc->ca_list == NULL) {
-        return apr_psprintf(parms->pool,
-                "mod_gnutls: Memory allocation error");
-    }
-
-    rv = gnutls_x509_crt_list_import(sc->ca_list, &sc->ca_list_size,
-            &data, GNUTLS_X509_FMT_PEM,
-            GNUTLS_X509_CRT_LIST_IMPORT_FAIL_IF_EXCEED);
-    if (rv < 0 && rv != GNUTLS_E_SHORT_MEMORY_BUFFER) {
-        return apr_psprintf(parms->pool, "GnuTLS: Failed to load "
-                "Client CA File '%s': (%d) %s", file,
-                rv, gnutls_strerror(rv));
-    }
-
-    if (INIT_CA_SIZE < sc->ca_list_size) {
-        sc->ca_list =
-                realloc(sc->ca_list,
-                sc->ca_list_size * sizeof (*sc->ca_list));
-        if (sc->ca_list == NULL) {
-            return apr_psprintf(parms->pool,
-                    "mod_gnutls: Memory allocation error");
-        }
-
-        /* re-read */
-        rv = gnutls_x509_crt_list_import(sc->ca_list,
-                &sc->ca_list_size, &data,
-                GNUTLS_X509_FMT_PEM, 0);
-
-        if (rv < 0) {
-            return apr_psprintf(parms->pool,
-                    "GnuTLS: Failed to load "
-                    "Client CA File '%s': (%d) %s",
-                    file, rv, gnutls_strerror(rv));
-        }
-    }
-
-    apr_pool_destroy(spool);
-    return NULL;
-}
-
 const char *mgs_set_keyring_file(cmd_parms * parms, void *dummy,
         const char *arg) {
     int rv;
@@ -567,10 +1385,16 @@ const char *mgs_set_priorities(cmd_parms * parms, void *dummy, const char *arg)
 
 	int ret;
     const char *err;
+    const char *key;
 
     mgs_srvconf_rec *sc = (mgs_srvconf_rec *)
 						  ap_get_module_config(parms->server->module_config, &gnutls_module);
 
+    key = apr_pstrcat(parms->temp_pool, "priorities:", arg, NULL);
+    sc->priorities = registry_get(parms, key);
+    if (sc->priorities != NULL)
+        return NULL;
+
     ret = gnutls_priority_init(&sc->priorities, arg, &err);
 
     if (ret < 0) {
@@ -581,57 +1405,61 @@ const char *mgs_set_priorities(cmd_parms * parms, void *dummy, const char *arg)
         return "Error setting priorities";
     }
 
+    registry_set(parms, key, sc->priorities);
     return NULL;
 }
 
+/* The credentials of a virtual host are only allocated in post_config,
+ * and only if it enables TLS, see mgs_config_credentials_init(). */
 static mgs_srvconf_rec *_mgs_config_server_create(apr_pool_t * p, char** err) {
     mgs_srvconf_rec *sc = apr_pcalloc(p, sizeof (*sc));
-    int ret;
 
     sc->enabled = GNUTLS_ENABLED_UNSET;
 
-    ret = gnutls_certificate_allocate_credentials(&sc->certs);
-    if (ret < 0) {
-        *err = apr_psprintf(p, "GnuTLS: Failed to initialize"
-                            ": (%d) %s", ret,
-                            gnutls_strerror(ret));
-        return NULL;
-    }
-
-    ret = gnutls_anon_allocate_server_credentials(&sc->anon_creds);
-    if (ret < 0) {
-        *err = apr_psprintf(p, "GnuTLS: Failed to initialize"
-                            ": (%d) %s", ret,
-                            gnutls_strerror(ret));
-        return NULL;
-    }
+    sc->certs = NULL;
+    sc->anon_creds = NULL;
 #ifdef ENABLE_SRP
-    ret = gnutls_srp_allocate_server_credentials(&sc->srp_creds);
-    if (ret < 0) {
-        *err =  apr_psprintf(p, "GnuTLS: Failed to initialize"
-                             ": (%d) %s", ret,
-                             gnutls_strerror(ret));
-        return NULL;
-    }
-
+    sc->srp_creds = NULL;
     sc->srp_tpasswd_conf_file = NULL;
     sc->srp_tpasswd_file = NULL;
 #endif
 
     sc->privkey_x509 = NULL;
-	/* Initialize all Certificate Chains */
+	/* Certificate Chains are shared with the config registry */
     /* FIXME: how do we indicate that this is unset for a merge? (that
      * is, how can a subordinate server override the chain by setting
      * an empty one?  what would that even look like in the
      * configuration?) */
-	sc->certs_x509_chain = malloc(MAX_CHAIN_SIZE * sizeof (*sc->certs_x509_chain));
+	sc->certs_x509_chain = NULL;
     sc->certs_x509_chain_num = 0;
     sc->cache_timeout = -1; /* -1 means "unset" */
+    sc->cache_quota = 0;
     sc->cache_type = mgs_cache_unset;
     sc->cache_config = NULL;
+    sc->cache_local_size = 0;
+    sc->cache_replicas = 1;
+    sc->cache_shards = 1;
+    sc->cache_pool_min = -1;
+    sc->cache_pool_smax = -1;
+    sc->cache_pool_max = -1;
+    sc->cache_filter_size = 0;
+    sc->cache_snapshot_file = NULL;
+    sc->cache_snapshot_interval = 0;
+    sc->reload_interval = 0;
     sc->tickets = GNUTLS_ENABLED_UNSET;
+    sc->ticket_key_file = NULL;
+    sc->ticket_key_rotate = 0;
+    sc->ticket_key_keep = 2;
+    sc->session_context = NULL;
+    sc->vhost_id = 0;
+    sc->sni_reject_unknown = GNUTLS_ENABLED_UNSET;
+    sc->sni_deny_names = NULL;
+    sc->sni_deny_patterns = NULL;
+    sc->cert_dir = NULL;
+    sc->cert_dir_max = -1;
     sc->priorities = NULL;
     sc->dh_params = NULL;
+    sc->dh_load = NULL;
     sc->proxy_enabled = GNUTLS_ENABLED_UNSET;
     sc->export_certificates_enabled = GNUTLS_ENABLED_UNSET;
     sc->client_verify_method = mgs_cvm_unset;
@@ -642,6 +1470,38 @@ static mgs_srvconf_rec *_mgs_config_server_create(apr_pool_t * p, char** err) {
     return sc;
 }
 
+const char *mgs_config_credentials_init(apr_pool_t *p,
+        mgs_srvconf_rec *sc) {
+    int ret;
+
+    if (sc->certs == NULL) {
+        ret = gnutls_certificate_allocate_credentials(&sc->certs);
+        if (ret < 0)
+            return apr_psprintf(p, "GnuTLS: Failed to initialize"
+                                ": (%d) %s", ret,
+                                gnutls_strerror(ret));
+    }
+
+    if (sc->anon_creds == NULL) {
+        ret = gnutls_anon_allocate_server_credentials(&sc->anon_creds);
+        if (ret < 0)
+            return apr_psprintf(p, "GnuTLS: Failed to initialize"
+                                ": (%d) %s", ret,
+                                gnutls_strerror(ret));
+    }
+#ifdef ENABLE_SRP
+    if (sc->srp_creds == NULL) {
+        ret = gnutls_srp_allocate_server_credentials(&sc->srp_creds);
+        if (ret < 0)
+            return apr_psprintf(p, "GnuTLS: Failed to initialize"
+                                ": (%d) %s", ret,
+                                gnutls_strerror(ret));
+    }
+#endif
+
+    return NULL;
+}
+
 void *mgs_config_server_create(apr_pool_t * p, server_rec * s) {
     char *err = NULL;
     mgs_srvconf_rec *sc = _mgs_config_server_create(p, &err);
@@ -661,6 +1521,14 @@ void *mgs_config_server_merge(apr_pool_t *p, void *BASE, void *ADD) {
 
     gnutls_srvconf_merge(enabled, GNUTLS_ENABLED_UNSET);
     gnutls_srvconf_merge(tickets, GNUTLS_ENABLED_UNSET);
+    gnutls_srvconf_merge(session_context, NULL);
+    gnutls_srvconf_merge(cache_timeout, -1);
+    gnutls_srvconf_merge(cache_quota, 0);
+    gnutls_srvconf_merge(sni_reject_unknown, GNUTLS_ENABLED_UNSET);
+    gnutls_srvconf_merge(sni_deny_names, NULL);
+    gnutls_srvconf_merge(sni_deny_patterns, NULL);
+    gnutls_srvconf_merge(cert_dir, NULL);
+    gnutls_srvconf_merge(cert_dir_max, -1);
     gnutls_srvconf_merge(proxy_enabled, GNUTLS_ENABLED_UNSET);
     gnutls_srvconf_merge(export_certificates_enabled, GNUTLS_ENABLED_UNSET);
     gnutls_srvconf_merge(client_verify_method, mgs_cvm_unset);
@@ -668,8 +1536,10 @@ void *mgs_config_server_merge(apr_pool_t *p, void *BASE, void *ADD) {
     gnutls_srvconf_merge(srp_tpasswd_file, NULL);
     gnutls_srvconf_merge(srp_tpasswd_conf_file, NULL);
     gnutls_srvconf_merge(privkey_x509, NULL);
+    gnutls_srvconf_merge(key_load, NULL);
     gnutls_srvconf_merge(priorities, NULL);
     gnutls_srvconf_merge(dh_params, NULL);
+    gnutls_srvconf_merge(dh_load, NULL);
 
     /* FIXME: the following items are pre-allocated, and should be
      * properly disposed of before assigning in order to avoid leaks;
@@ -683,6 +1553,7 @@ void *mgs_config_server_merge(apr_pool_t *p, void *BASE, void *ADD) {
     gnutls_srvconf_assign(srp_creds);
     gnutls_srvconf_assign(certs_x509_chain);
     gnutls_srvconf_assign(certs_x509_chain_num);
+    gnutls_srvconf_assign(cert_load);
 
     /* how do these get transferred cleanly before the data from ADD
      * goes away? */
@@ -691,6 +1562,7 @@ void *mgs_config_server_merge(apr_pool_t *p, void *BASE, void *ADD) {
         gnutls_srvconf_assign(cert_san[i]);
     gnutls_srvconf_assign(ca_list);
     gnutls_srvconf_assign(ca_list_size);
+    gnutls_srvconf_assign(ca_load);
     gnutls_srvconf_assign(cert_pgp);
     gnutls_srvconf_assign(pgp_list);
     gnutls_srvconf_assign(privkey_pgp);
@@ -0,0 +1,196 @@
+/**
+ *  Copyright 2004-2005 Paul Querna
+ *  Copyright 2008 Nikos Mavrogiannopoulos
+ *  Copyright 2011 Dash Shendy
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include "mod_gnutls.h"
+
+#include "apr_mmap.h"
+
+#include <gnutls/crypto.h>
+
+/**
+ * Credential Store
+ *
+ * A GnuTLSCredentialStore holds the certificates and keys of the
+ * configuration in DER, so they are imported without reading every
+ * file and decoding PEM.  The store is mapped read-only, checked once
+ * against its SHA-256, and looked up by binary search over the index.
+ * See mod_gnutls.h for the layout, and mgs_credstore.c for the tool
+ * that writes it.
+ */
+
+struct mgs_credstore_t {
+    const char *file;
+    const unsigned char *base;
+    apr_size_t size;
+    apr_uint32_t count;
+};
+
+static apr_uint32_t credstore_u32(const unsigned char *p) {
+    return ((apr_uint32_t) p[0] << 24) | ((apr_uint32_t) p[1] << 16)
+            | ((apr_uint32_t) p[2] << 8) | (apr_uint32_t) p[3];
+}
+
+static apr_uint64_t credstore_u64(const unsigned char *p) {
+    return ((apr_uint64_t) credstore_u32(p) << 32) | credstore_u32(p + 4);
+}
+
+/* Does the range OFF, LEN lie within the store? */
+static int credstore_in(mgs_credstore_t *store, apr_uint32_t off,
+        apr_uint32_t len) {
+    return off <= store->size && len <= store->size - off;
+}
+
+const char *mgs_credstore_open(apr_pool_t *p, const char *file,
+        mgs_credstore_t **store) {
+    mgs_credstore_t *cs;
+    apr_file_t *fp;
+    apr_finfo_t finfo;
+    apr_mmap_t *mm;
+    unsigned char digest[32];
+    apr_status_t rv;
+    char err[256];
+    int ret;
+
+    rv = apr_file_open(&fp, file, APR_READ | APR_BINARY, APR_OS_DEFAULT, p);
+    if (rv == APR_SUCCESS)
+        rv = apr_file_info_get(&finfo, APR_FINFO_SIZE, fp);
+    if (rv != APR_SUCCESS)
+        return apr_psprintf(p, "Cannot open '%s': %s", file,
+                apr_strerror(rv, err, sizeof (err)));
+    if (finfo.size < CREDSTORE_HEADER_LEN) {
+        apr_file_close(fp);
+        return apr_psprintf(p, "'%s' is too short", file);
+    }
+
+    /* items are imported straight from the mapping, nothing is copied */
+    rv = apr_mmap_create(&mm, fp, 0, (apr_size_t) finfo.size,
+            APR_MMAP_READ, p);
+    apr_file_close(fp);
+    if (rv != APR_SUCCESS)
+        return apr_psprintf(p, "Cannot map '%s': %s", file,
+                apr_strerror(rv, err, sizeof (err)));
+
+    cs = apr_pcalloc(p, sizeof (*cs));
+    cs->file = file;
+    cs->base = mm->mm;
+    cs->size = mm->size;
+
+    if (memcmp(cs->base, CREDSTORE_MAGIC, 8) != 0)
+        return apr_psprintf(p, "'%s' is not a credential store", file);
+    if (credstore_u32(cs->base + 8) != CREDSTORE_VERSION)
+        return apr_psprintf(p, "'%s' has version %u, expected %u, "
+                "recreate it with mgs_credstore", file,
+                credstore_u32(cs->base + 8), CREDSTORE_VERSION);
+    cs->count = credstore_u32(cs->base + 12);
+    if (credstore_u32(cs->base + 16) != cs->size
+            || cs->count > (cs->size - CREDSTORE_HEADER_LEN)
+            / CREDSTORE_ENTRY_LEN)
+        return apr_psprintf(p, "'%s' is truncated", file);
+
+    ret = gnutls_hash_fast(GNUTLS_DIG_SHA256,
+            cs->base + CREDSTORE_HEADER_LEN,
+            cs->size - CREDSTORE_HEADER_LEN, digest);
+    if (ret < 0)
+        return apr_psprintf(p, "Cannot check '%s': (%d) %s", file, ret,
+                gnutls_strerror(ret));
+    if (memcmp(digest, cs->base + 24, sizeof (digest)) != 0)
+        return apr_psprintf(p, "'%s' is corrupted, its checksum does not "
+                "match", file);
+
+    *store = cs;
+    return NULL;
+}
+
+/* Entries are sorted by path, then kind: a file can hold both a
+ * certificate chain and a key. */
+static int credstore_cmp(mgs_credstore_t *store, const unsigned char *entry,
+        const char *file, apr_size_t len, apr_uint32_t kind) {
+    apr_uint32_t off = credstore_u32(entry);
+    apr_uint32_t elen = credstore_u32(entry + 4);
+    apr_uint32_t ekind = credstore_u32(entry + 8);
+    int c;
+
+    if (!credstore_in(store, off, elen))
+        return 1;
+    c = memcmp(file, store->base + off, len < elen ? len : elen);
+    if (c != 0)
+        return c;
+    if (len != elen)
+        return len < elen ? -1 : 1;
+    return kind < ekind ? -1 : kind > ekind ? 1 : 0;
+}
+
+int mgs_credstore_find(mgs_credstore_t *store, apr_pool_t *p,
+        const char *file, int kind, apr_off_t size, apr_time_t mtime,
+        gnutls_datum_t **der) {
+    const unsigned char *entry = NULL;
+    const unsigned char *data;
+    apr_uint32_t lo = 0, hi, off, len, n, i;
+    apr_size_t flen = strlen(file);
+
+    if (store == NULL)
+        return 0;
+
+    hi = store->count;
+    while (lo < hi) {
+        apr_uint32_t mid = lo + (hi - lo) / 2;
+        const unsigned char *e = store->base + CREDSTORE_HEADER_LEN
+                + (apr_size_t) mid * CREDSTORE_ENTRY_LEN;
+        int c = credstore_cmp(store, e, file, flen, (apr_uint32_t) kind);
+
+        if (c == 0) {
+            entry = e;
+            break;
+        }
+        if (c < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    if (entry == NULL)
+        return 0;
+
+    /* a file that changed since the store was written is read again */
+    if (credstore_u64(entry + 24) != (apr_uint64_t) size
+            || credstore_u64(entry + 32) != (apr_uint64_t) mtime)
+        return 0;
+
+    n = credstore_u32(entry + 12);
+    off = credstore_u32(entry + 16);
+    len = credstore_u32(entry + 20);
+    if (n == 0 || !credstore_in(store, off, len) || n > len / 4)
+        return 0;
+
+    *der = apr_palloc(p, n * sizeof (**der));
+    data = store->base + off;
+    for (i = 0; i < n; i++) {
+        apr_uint32_t ilen;
+
+        if (len < 4)
+            return 0;
+        ilen = credstore_u32(data);
+        if (ilen > len - 4)
+            return 0;
+        (*der)[i].data = (unsigned char *) data + 4;
+        (*der)[i].size = ilen;
+        data += 4 + ilen;
+        len -= 4 + ilen;
+    }
+    return (int) n;
+}
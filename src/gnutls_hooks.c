@@ -21,6 +21,8 @@
 #include "http_vhost.h"
 #include "ap_mpm.h"
 #include "mod_status.h"
+#include "apr_base64.h"
+#include "apr_lib.h"
 
 #ifdef ENABLE_MSVA
 #include <msv/msv.h>
@@ -36,12 +38,30 @@ static apr_file_t *debug_log_fp;
 
 static gnutls_datum_t session_ticket_key = {NULL, 0};
 
+/* Session ticket keys: the first one encrypts new tickets, the
+ * others only decrypt tickets issued before the last rotation */
+static gnutls_datum_t session_ticket_keys[MAX_TICKET_KEYS];
+static int session_ticket_nkeys = 0;
+/* Pick the decryption key by the key name a ticket starts with */
+static int session_ticket_select = 0;
+
+#define TICKET_KEY_NAME_SIZE 16
+#define TLS_EXT_SESSION_TICKET 35
+
+/* Virtual hosts by the ID stored with their cached sessions */
+static apr_hash_t *vhost_ids = NULL;
+/* Stands in for hosts whose IDs collide */
+static char vhost_id_ambiguous;
+
 static int mgs_cert_verify(request_rec * r, mgs_handle_t * ctxt);
 /* use side==0 for server and side==1 for client */
 static void mgs_add_common_cert_vars(request_rec * r, gnutls_x509_crt_t cert, int side, int export_full_cert);
 static void mgs_add_common_pgpcert_vars(request_rec * r, gnutls_openpgp_crt_t cert, int side, int export_full_cert);
 static const char* mgs_x509_construct_uid(request_rec * pool, gnutls_x509_crt_t cert);
 static int mgs_status_hook(request_rec *r, int flags);
+#if USING_2_1_RECENT
+static void mgs_sni_index_build(apr_pool_t *p, server_rec *base_server);
+#endif
 
 /* Pool Cleanup Function */
 apr_status_t mgs_cleanup_pre_config(void *data) {
@@ -54,6 +74,291 @@ apr_status_t mgs_cleanup_pre_config(void *data) {
     return APR_SUCCESS;
 }
 
+/* Reads up to MAX_TICKET_KEYS base64 encoded keys, one per line, from
+ * FILE.  Returns the number of keys read, 0 if FILE does not exist
+ * yet, or -1 on errors. */
+static int ticket_keys_read(apr_pool_t *p, server_rec *s, const char *file,
+        gnutls_datum_t *keys, apr_time_t *mtime) {
+    apr_file_t *fp;
+    apr_finfo_t finfo;
+    apr_status_t rv;
+    char line[512];
+    int n = 0;
+
+    rv = apr_file_open(&fp, file, APR_READ, APR_OS_DEFAULT, p);
+    if (APR_STATUS_IS_ENOENT(rv)) {
+        return 0;
+    } else if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_STARTUP, rv, s,
+                "GnuTLS: Cannot open session ticket key file '%s'", file);
+        return -1;
+    }
+
+    rv = apr_file_info_get(&finfo, APR_FINFO_MTIME, fp);
+    *mtime = (rv == APR_SUCCESS) ? finfo.mtime : 0;
+
+    while (apr_file_gets(line, sizeof line, fp) == APR_SUCCESS) {
+        char *b64 = line;
+        char *end;
+        int len;
+
+        while (apr_isspace(*b64))
+            b64++;
+        for (end = b64 + strlen(b64); end > b64 && apr_isspace(end[-1]); end--)
+            *(end - 1) = '\0';
+        if (*b64 == '\0' || *b64 == '#')
+            continue;
+
+        if (n == MAX_TICKET_KEYS) {
+            ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+                    "GnuTLS: Ignoring keys after the first %d in '%s'",
+                    MAX_TICKET_KEYS, file);
+            break;
+        }
+
+        keys[n].data = apr_palloc(p, apr_base64_decode_len(b64));
+        len = apr_base64_decode((char *) keys[n].data, b64);
+        if (len != (int) session_ticket_key.size) {
+            ap_log_error(APLOG_MARK, APLOG_STARTUP, 0, s,
+                    "GnuTLS: Session ticket key %d in '%s' is not a "
+                    "base64 encoded %u byte key", n + 1, file,
+                    session_ticket_key.size);
+            apr_file_close(fp);
+            return -1;
+        }
+        keys[n].size = len;
+        n++;
+    }
+
+    apr_file_close(fp);
+    return n;
+}
+
+/* Replaces FILE with KEYS, newest first.  The file is only readable
+ * by its owner, usually root. */
+static apr_status_t ticket_keys_write(apr_pool_t *p, const char *file,
+        const gnutls_datum_t *keys, int nkeys) {
+    apr_file_t *fp;
+    char *tmp = apr_pstrcat(p, file, ".XXXXXX", NULL);
+    apr_status_t rv;
+    int i;
+
+    rv = apr_file_mktemp(&fp, tmp, APR_CREATE | APR_WRITE | APR_EXCL, p);
+    if (rv != APR_SUCCESS)
+        return rv;
+
+    apr_file_printf(fp, "# mod_gnutls session ticket keys, newest first\n");
+    for (i = 0; i < nkeys && rv == APR_SUCCESS; i++) {
+        char *b64 = apr_palloc(p, apr_base64_encode_len(keys[i].size) + 1);
+        int len = apr_base64_encode(b64, (const char *) keys[i].data,
+                keys[i].size);
+
+        /* apr_base64_encode_len() counts the trailing NUL */
+        b64[len - 1] = '\n';
+        rv = apr_file_write_full(fp, b64, len, NULL);
+    }
+
+    if (rv == APR_SUCCESS)
+        rv = apr_file_close(fp);
+    else
+        apr_file_close(fp);
+    if (rv == APR_SUCCESS)
+        rv = apr_file_rename(tmp, file, p);
+    if (rv != APR_SUCCESS)
+        apr_file_remove(tmp, p);
+    return rv;
+}
+
+/* Sets up the session ticket keys for this configuration: the key
+ * generated in pre_config, or the ones in GnuTLSSessionTicketKeyFile.
+ * A missing key file is created, one older than the rotation
+ * interval gets a new primary key in front of the previous ones. */
+static int mgs_ticket_keys_init(apr_pool_t *p, server_rec *s,
+        mgs_srvconf_rec *sc) {
+    gnutls_datum_t keys[MAX_TICKET_KEYS];
+    apr_time_t mtime = 0;
+    apr_status_t rv;
+    int n, ret;
+
+    session_ticket_nkeys = 0;
+    session_ticket_select = 0;
+
+    if (session_ticket_key.data == NULL)
+        return 0;
+
+    if (sc->ticket_key_file == NULL) {
+        session_ticket_keys[0] = session_ticket_key;
+        session_ticket_nkeys = 1;
+        return 0;
+    }
+
+    n = ticket_keys_read(p, s, sc->ticket_key_file, keys, &mtime);
+    if (n < 0)
+        return -1;
+
+    if (n == 0 || (sc->ticket_key_rotate > 0
+            && mtime + sc->ticket_key_rotate <= apr_time_now())) {
+        gnutls_datum_t key;
+
+        ret = gnutls_session_ticket_key_generate(&key);
+        if (ret < 0) {
+            ap_log_error(APLOG_MARK, APLOG_STARTUP, 0, s,
+                    "GnuTLS: Cannot generate a session ticket key: (%d) %s",
+                    ret, gnutls_strerror(ret));
+            return -1;
+        }
+
+        if (n > sc->ticket_key_keep)
+            n = sc->ticket_key_keep;
+        memmove(&keys[1], &keys[0], n * sizeof (keys[0]));
+        keys[0].data = apr_pmemdup(p, key.data, key.size);
+        keys[0].size = key.size;
+        gnutls_free(key.data);
+        n++;
+
+        rv = ticket_keys_write(p, sc->ticket_key_file, keys, n);
+        if (rv != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_STARTUP, rv, s,
+                    "GnuTLS: Cannot write session ticket key file '%s'",
+                    sc->ticket_key_file);
+            return -1;
+        }
+        ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, s,
+                "GnuTLS: New primary session ticket key in '%s', "
+                "%d previous keys kept", sc->ticket_key_file, n - 1);
+    }
+
+    memcpy(session_ticket_keys, keys, n * sizeof (keys[0]));
+    session_ticket_nkeys = n;
+
+    if (n > 1) {
+#if GNUTLS_VERSION_NUMBER >= 0x030100
+        /* GnuTLS 3.6.4 and later derive rotating ticket keys from the
+         * primary key themselves, so tickets no longer carry the name
+         * of a key from this file */
+        if (gnutls_check_version("3.6.4") == NULL)
+            session_ticket_select = 1;
+#endif
+        if (session_ticket_select == 0)
+            ap_log_error(APLOG_MARK, APLOG_INFO, 0, s,
+                    "GnuTLS: This GnuTLS cannot decrypt tickets with the "
+                    "previous keys in '%s'", sc->ticket_key_file);
+    }
+
+    return 0;
+}
+
+/* Gives a virtual host its session context and the ID stored with
+ * its cached sessions.  The ID is a hash of the host's name, so it
+ * stays the same across restarts; hosts whose IDs collide are found
+ * by SNI on resumption instead. */
+static void mgs_vhost_id_init(apr_pool_t *p, server_rec *s,
+        mgs_srvconf_rec *sc) {
+    const char *name = apr_psprintf(p, "%s:%d", s->server_hostname, s->port);
+    apr_ssize_t len = strlen(name);
+    void *other;
+
+    if (sc->session_context == NULL)
+        sc->session_context = name;
+
+    sc->vhost_id = apr_hashfunc_default(name, &len);
+    if (sc->vhost_id == 0)
+        sc->vhost_id = 1;
+
+    other = apr_hash_get(vhost_ids, &sc->vhost_id, sizeof (sc->vhost_id));
+    if (other == NULL) {
+        apr_hash_set(vhost_ids, &sc->vhost_id, sizeof (sc->vhost_id), sc);
+    } else if (other != &vhost_id_ambiguous) {
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
+                "GnuTLS: Host '%s' shares its session ID with another "
+                "host, resumed sessions are matched by SNI", name);
+        apr_hash_set(vhost_ids, &sc->vhost_id, sizeof (sc->vhost_id),
+                &vhost_id_ambiguous);
+    }
+}
+
+mgs_srvconf_rec *mgs_find_vhost_id(apr_uint32_t id) {
+    mgs_srvconf_rec *sc;
+
+    if (vhost_ids == NULL || id == 0)
+        return NULL;
+
+    sc = apr_hash_get(vhost_ids, &id, sizeof (id));
+    if (sc == (void *) &vhost_id_ambiguous)
+        return NULL;
+    return sc;
+}
+
+#if GNUTLS_VERSION_NUMBER >= 0x030100
+/* Looks for a session ticket in the ClientHello and enables tickets
+ * with the previous key it names, or with the primary key.  Renewed
+ * tickets are encrypted with the same key and expire along with it. */
+static int mgs_ticket_key_select_cb(gnutls_session_t session,
+        unsigned int htype, unsigned when, unsigned int incoming,
+        const gnutls_datum_t *msg) {
+    const gnutls_datum_t *key = &session_ticket_keys[0];
+    const unsigned char *p = msg->data;
+    size_t left = msg->size;
+    size_t len;
+    int i;
+
+    /* version and random */
+    if (left < 34)
+        goto done;
+    p += 34;
+    left -= 34;
+    /* session id */
+    if (left < 1 || left < 1 + (size_t) p[0])
+        goto done;
+    len = 1 + p[0];
+    p += len;
+    left -= len;
+    /* cipher suites */
+    if (left < 2 || left < 2 + (size_t) ((p[0] << 8) | p[1]))
+        goto done;
+    len = 2 + ((p[0] << 8) | p[1]);
+    p += len;
+    left -= len;
+    /* compression methods */
+    if (left < 1 || left < 1 + (size_t) p[0])
+        goto done;
+    len = 1 + p[0];
+    p += len;
+    left -= len;
+    /* extensions */
+    if (left < 2)
+        goto done;
+    p += 2;
+    left -= 2;
+    while (left >= 4) {
+        unsigned int type = (p[0] << 8) | p[1];
+
+        len = (p[2] << 8) | p[3];
+        p += 4;
+        left -= 4;
+        if (len > left)
+            break;
+        if (type == TLS_EXT_SESSION_TICKET) {
+            for (i = 1; len >= TICKET_KEY_NAME_SIZE
+                    && i < session_ticket_nkeys; i++) {
+                if (memcmp(p, session_ticket_keys[i].data,
+                        TICKET_KEY_NAME_SIZE) == 0) {
+                    key = &session_ticket_keys[i];
+                    break;
+                }
+            }
+            break;
+        }
+        p += len;
+        left -= len;
+    }
+
+done:
+    gnutls_session_ticket_enable_server(session, key);
+    return 0;
+}
+#endif
+
 /* Logging Function for Maintainers */
 #if MOD_GNUTLS_DEBUG
 static void gnutls_debug_log_all(int level, const char *str) {
@@ -119,24 +424,109 @@ int mgs_hook_pre_config(apr_pool_t * pconf, apr_pool_t * plog, apr_pool_t * ptem
     return OK;
 }
 
+/* Abort the handshake with an unrecognized_name alert.  Without
+ * GNUTLS_E_UNRECOGNIZED_NAME no error code maps to that alert, so it
+ * is sent here and the handshake code sends no other one. */
+static int mgs_sni_reject(mgs_handle_t *ctxt) {
+#ifdef GNUTLS_E_UNRECOGNIZED_NAME
+    return GNUTLS_E_UNRECOGNIZED_NAME;
+#else
+    gnutls_alert_send(ctxt->session, GNUTLS_AL_FATAL,
+            GNUTLS_A_UNRECOGNIZED_NAME);
+    ctxt->alert_sent = 1;
+    return GNUTLS_E_INTERNAL_ERROR;
+#endif
+}
+
+/* Is the SNI name on the GnuTLSSNIDeny list of the server? */
+static int mgs_sni_denied(mgs_srvconf_rec *sc, char *name) {
+    char **patterns;
+    char *c;
+    int i;
+
+    if (sc->sni_deny_names == NULL)
+        return 0;
+
+    for (c = name; *c; c++)
+        *c = apr_tolower(*c);
+    if (apr_hash_get(sc->sni_deny_names, name, APR_HASH_KEY_STRING))
+        return 1;
+
+    patterns = (char **) sc->sni_deny_patterns->elts;
+    for (i = 0; i < sc->sni_deny_patterns->nelts; i++) {
+        if (apr_fnmatch(patterns[i], name, APR_FNM_CASE_BLIND
+                | APR_FNM_PERIOD | APR_FNM_PATHNAME | APR_FNM_NOESCAPE)
+                == APR_SUCCESS)
+            return 1;
+    }
+    return 0;
+}
+
 static int mgs_select_virtual_server_cb(gnutls_session_t session) {
 
     mgs_handle_t *ctxt = NULL;
     mgs_srvconf_rec *tsc = NULL;
+    char sni_name[MAX_HOST_LEN];
+    size_t sni_len = sizeof (sni_name);
+    unsigned int sni_type;
     int ret = 0;
 
     _gnutls_log(debug_log_fp, "%s: %d\n", __func__, __LINE__);
 
     ctxt = gnutls_transport_get_ptr(session);
 
+    /* Names we do not serve are turned away here, before the key
+     * exchange costs a private key operation.  The settings of the
+     * server the connection came in on apply. */
+    if ((ctxt->sc->sni_reject_unknown == GNUTLS_ENABLED_TRUE
+            || ctxt->sc->sni_deny_names != NULL)
+            && gnutls_server_name_get(session, sni_name, &sni_len,
+            &sni_type, 0) == 0 && sni_type == GNUTLS_NAME_DNS) {
+        if (mgs_sni_denied(ctxt->sc, sni_name)) {
+            ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, ctxt->c->base_server,
+                    "GnuTLS: Rejecting denied SNI name '%s'", sni_name);
+            return mgs_sni_reject(ctxt);
+        }
+        if (ctxt->sc->sni_reject_unknown == GNUTLS_ENABLED_TRUE) {
+            tsc = mgs_find_sni_server(session);
+            if (tsc == NULL) {
+                ap_log_error(APLOG_MARK, APLOG_DEBUG, 0,
+                        ctxt->c->base_server,
+                        "GnuTLS: Rejecting unknown SNI name '%s'", sni_name);
+                return mgs_sni_reject(ctxt);
+            }
+        }
+    }
+
     /* find the virtual server */
-    tsc = mgs_find_sni_server(session);
+    if (tsc == NULL)
+        tsc = mgs_find_sni_server(session);
 
     if (tsc != NULL) {
         // Found a TLS vhost based on the SNI from the client; use it instead.
         ctxt->sc = tsc;
 	}
 
+    /* Load the certificate for the name from the certificate directory */
+    if (ctxt->sc->cert_dir != NULL && ctxt->dir_cert == NULL) {
+        sni_len = sizeof (sni_name);
+        if (gnutls_server_name_get(session, sni_name, &sni_len,
+                &sni_type, 0) == 0 && sni_type == GNUTLS_NAME_DNS)
+            ctxt->dir_cert = mgs_certdir_acquire(ctxt, sni_name);
+        if (ctxt->dir_cert == NULL && ctxt->sc->certs_x509_chain_num == 0
+                && ctxt->sc->cert_pgp == NULL) {
+            ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, ctxt->c->base_server,
+                    "GnuTLS: No certificate in '%s' for the SNI name",
+                    ctxt->sc->cert_dir);
+            return mgs_sni_reject(ctxt);
+        }
+    }
+
+    /* Keep the certificate of the virtual host for this connection,
+     * GnuTLSReloadInterval may swap it while the handshake runs */
+    if (ctxt->dir_cert == NULL && ctxt->reload_cert == NULL)
+        ctxt->reload_cert = mgs_reload_acquire(ctxt);
+
     gnutls_certificate_server_set_request(session, ctxt->sc->client_verify_mode);
 
     /* Set Anon credentials */
@@ -184,8 +574,20 @@ static int cert_retrieve_fn(gnutls_session_t session,
 		// X509 CERTIFICATE
 		ret->cert_type = GNUTLS_CRT_X509;
 		ret->key_type = GNUTLS_PRIVKEY_X509;
-        ret->ncerts = ctxt->sc->certs_x509_chain_num;
         ret->deinit_all = 0;
+        if (ctxt->dir_cert != NULL) {
+            ret->ncerts = ctxt->dir_cert->certs_x509_chain_num;
+            ret->cert.x509 = ctxt->dir_cert->certs_x509_chain;
+            ret->key.x509 = ctxt->dir_cert->privkey_x509;
+            return 0;
+        }
+        if (ctxt->reload_cert != NULL) {
+            ret->ncerts = ctxt->reload_cert->certs_x509_chain_num;
+            ret->cert.x509 = ctxt->reload_cert->certs_x509_chain;
+            ret->key.x509 = ctxt->reload_cert->privkey_x509;
+            return 0;
+        }
+        ret->ncerts = ctxt->sc->certs_x509_chain_num;
         ret->cert.x509 = ctxt->sc->certs_x509_chain;
         ret->key.x509 = ctxt->sc->privkey_x509;
         return 0;
@@ -306,6 +708,7 @@ int mgs_hook_post_config(apr_pool_t * p, apr_pool_t * plog, apr_pool_t * ptemp,
     mgs_srvconf_rec *sc_base;
     void *data = NULL;
     const char *userdata_key = "mgs_init";
+    const char *err;
 
     _gnutls_log(debug_log_fp, "%s: %d\n", __func__, __LINE__);
 
@@ -318,6 +721,10 @@ int mgs_hook_post_config(apr_pool_t * p, apr_pool_t * plog, apr_pool_t * ptemp,
     s = base_server;
     sc_base = (mgs_srvconf_rec *) ap_get_module_config(s->module_config, &gnutls_module);
 
+    /* Parse the certificate and key files on all CPUs */
+    if (mgs_config_load_files(p, ptemp, base_server) > 0)
+        exit(-1);
+
     gnutls_dh_params_init(&dh_params);
 
     if (sc_base->dh_params == NULL) {
@@ -349,6 +756,21 @@ int mgs_hook_post_config(apr_pool_t * p, apr_pool_t * plog, apr_pool_t * ptemp,
         dh_params = sc_base->dh_params;
     }
 
+    if (mgs_ticket_keys_init(p, s, sc_base) != 0) {
+        ap_log_error(APLOG_MARK, APLOG_STARTUP, 0, s,
+                "GnuTLS: Session ticket keys unavailable. Shutting Down.");
+        exit(-1);
+    }
+
+    vhost_ids = apr_hash_make(p);
+    for (s = base_server; s; s = s->next) {
+        sc = (mgs_srvconf_rec *) ap_get_module_config(s->module_config, &gnutls_module);
+        mgs_vhost_id_init(p, s, sc);
+        if (sc->enabled == GNUTLS_ENABLED_TRUE)
+            mgs_cache_partition_add(p, s, sc);
+    }
+
+    s = base_server;
     rv = mgs_cache_post_config(p, s, sc_base);
     if (rv != 0) {
         ap_log_error(APLOG_MARK, APLOG_STARTUP, rv, s,
@@ -361,7 +783,17 @@ int mgs_hook_post_config(apr_pool_t * p, apr_pool_t * plog, apr_pool_t * ptemp,
         sc = (mgs_srvconf_rec *) ap_get_module_config(s->module_config, &gnutls_module);
         sc->cache_type = sc_base->cache_type;
         sc->cache_config = sc_base->cache_config;
-        sc->cache_timeout = sc_base->cache_timeout;
+        if (sc->cache_timeout == -1)
+            sc->cache_timeout = sc_base->cache_timeout;
+        sc->cache_local_size = sc_base->cache_local_size;
+        sc->cache_replicas = sc_base->cache_replicas;
+        sc->cache_shards = sc_base->cache_shards;
+        sc->cache_pool_min = sc_base->cache_pool_min;
+        sc->cache_pool_smax = sc_base->cache_pool_smax;
+        sc->cache_pool_max = sc_base->cache_pool_max;
+        sc->cache_filter_size = sc_base->cache_filter_size;
+        sc->cache_snapshot_file = sc_base->cache_snapshot_file;
+        sc->cache_snapshot_interval = sc_base->cache_snapshot_interval;
 
         /* defaults for unset values: */
         if (sc->enabled == GNUTLS_ENABLED_UNSET)
@@ -384,6 +816,16 @@ int mgs_hook_post_config(apr_pool_t * p, apr_pool_t * plog, apr_pool_t * ptemp,
             exit(-1);
         }
 
+        /* Hosts without TLS get no credentials at all */
+        if (sc->enabled != GNUTLS_ENABLED_TRUE)
+            continue;
+
+        err = mgs_config_credentials_init(p, sc);
+        if (err != NULL) {
+            ap_log_error(APLOG_MARK, APLOG_STARTUP, 0, s, "%s", err);
+            exit(-1);
+        }
+
         /* Check if DH params have been set per host */
         if (sc->dh_params != NULL) {
             gnutls_certificate_set_dh_params(sc->certs, sc->dh_params);
@@ -413,6 +855,12 @@ int mgs_hook_post_config(apr_pool_t * p, apr_pool_t * plog, apr_pool_t * ptemp,
         }
 #endif
 
+        /* hosts with a certificate directory load their certificates
+         * when clients ask for them */
+        if (sc->cert_dir != NULL && sc->certs_x509_chain_num < 1
+                && sc->cert_pgp == NULL)
+            continue;
+
         if ((sc->certs_x509_chain == NULL || sc->certs_x509_chain_num < 1) &&
             sc->cert_pgp == NULL && sc->enabled == GNUTLS_ENABLED_TRUE) {
 			ap_log_error(APLOG_MARK, APLOG_STARTUP, 0, s,
@@ -450,11 +898,26 @@ int mgs_hook_post_config(apr_pool_t * p, apr_pool_t * plog, apr_pool_t * ptemp,
     }
 
 
+#if USING_2_1_RECENT
+    mgs_sni_index_build(p, base_server);
+#endif
+
     ap_add_version_component(p, "mod_gnutls/" MOD_GNUTLS_VERSION);
 
     return OK;
 }
 
+/* Parse the certificate and key files for "apachectl configtest" too,
+ * which does not run post_config */
+void mgs_hook_test_config(apr_pool_t * pconf, server_rec * s) {
+    apr_pool_t *ptemp;
+
+    apr_pool_create(&ptemp, pconf);
+    if (mgs_config_load_files(pconf, ptemp, s) > 0)
+        exit(1);
+    apr_pool_destroy(ptemp);
+}
+
 void mgs_hook_child_init(apr_pool_t * p, server_rec * s) {
     apr_status_t rv = APR_SUCCESS;
     mgs_srvconf_rec *sc = ap_get_module_config(s->module_config,
@@ -468,6 +931,8 @@ void mgs_hook_child_init(apr_pool_t * p, server_rec * s) {
                     "[GnuTLS] - Failed to run Cache Init");
         }
     }
+    mgs_certdir_child_init(p, s);
+    mgs_reload_child_init(p, s);
     /* Block SIGPIPE Signals */
     rv = apr_signal_block(SIGPIPE);
     if(rv != APR_SUCCESS) {
@@ -513,8 +978,6 @@ apr_port_t mgs_hook_default_port(const request_rec * r) {
     return 443;
 }
 
-#define MAX_HOST_LEN 255
-
 #if USING_2_1_RECENT
 
 typedef struct {
@@ -581,11 +1044,14 @@ static int vhost_cb(void *baton, conn_rec * conn, server_rec * s) {
     tsc = (mgs_srvconf_rec *) ap_get_module_config(s->module_config,
             &gnutls_module);
 
-    if (tsc->enabled != GNUTLS_ENABLED_TRUE || tsc->cert_cn == NULL) {
+    if (tsc->enabled != GNUTLS_ENABLED_TRUE
+            || (tsc->cert_cn == NULL && tsc->cert_dir == NULL)) {
         return 0;
     }
 
-    if (tsc->certs_x509_chain_num > 0) {
+    if (tsc->cert_dir != NULL) {
+        /* the certificate is picked by the name later */
+    } else if (tsc->certs_x509_chain_num > 0) {
         /* why are we doing this check? */
         ret = gnutls_x509_crt_check_hostname(tsc->certs_x509_chain[0], s->server_hostname);
         if (0 == ret)
@@ -599,6 +1065,296 @@ static int vhost_cb(void *baton, conn_rec * conn, server_rec * s) {
     }
 	return check_server_aliases(x, s, tsc);
 }
+
+/**
+ * SNI Index
+ *
+ * Looking a name up with vhost_cb() compares it with every name of
+ * every virtual host on the address.  Instead, post_config indexes the
+ * name based virtual hosts of every listener address: a hash of the
+ * exact names, and a trie of wildcard names with one node per label,
+ * starting from the last one, so "*.example.com" is found at
+ * com -> example.  A lookup costs one hash lookup per label of the
+ * name.  Hosts are tried in this order:
+ *
+ *   1. ServerName and ServerAlias, the first host to name it wins
+ *   2. wildcard ServerAlias "*.DOMAIN", the longest DOMAIN wins
+ *   3. other ServerAlias patterns, with apr_fnmatch()
+ *   4. DNS names in the certificates, then their wildcards
+ *
+ * Connections on addresses that are not in the index, e.g. those
+ * served by the main server only, still go through vhost_cb().
+ */
+
+typedef struct sni_node_t sni_node_t;
+
+struct sni_node_t {
+    /* by label, in lower case */
+    apr_hash_t *children;
+    /* "*.DOMAIN" ServerAlias, matches any number of labels */
+    mgs_srvconf_rec *alias;
+    /* "*.DOMAIN" certificate name, matches a single label */
+    mgs_srvconf_rec *cert;
+};
+
+typedef struct {
+    const char *pattern;
+    mgs_srvconf_rec *sc;
+} sni_pattern_t;
+
+typedef struct {
+    apr_hash_t *names;
+    apr_hash_t *cert_names;
+    sni_node_t wildcards;
+    apr_array_header_t *patterns;
+} sni_index_t;
+
+/* by listener address, see sni_addr_key() */
+static apr_hash_t *sni_indexes = NULL;
+
+/* "IP:PORT", with "*" for a wildcard address and 0 for any port.
+ * IPv4 mapped IPv6 addresses are given as plain IPv4. */
+static void sni_addr_key(char *key, apr_size_t len, apr_sockaddr_t *sa,
+        const char *ip, apr_port_t port) {
+    char buf[64];
+
+    if (ip == NULL) {
+        if (apr_sockaddr_ip_getbuf(buf, sizeof (buf), sa) != APR_SUCCESS)
+            buf[0] = '\0';
+        ip = buf;
+        if (strncasecmp(ip, "::ffff:", 7) == 0 && strchr(ip, '.') != NULL)
+            ip += 7;
+        if (strcmp(ip, "0.0.0.0") == 0 || strcmp(ip, "::") == 0
+                || strcmp(ip, "255.255.255.255") == 0)
+            ip = "*";
+    }
+    apr_snprintf(key, len, "%s:%u", ip, (unsigned int) port);
+}
+
+static char *sni_lower(apr_pool_t *p, const char *name) {
+    char *lower = apr_pstrdup(p, name);
+    char *c;
+
+    for (c = lower; *c; c++)
+        *c = apr_tolower(*c);
+    return lower;
+}
+
+/* The trie node for DOMAIN, created if needed */
+static sni_node_t *sni_node_get(apr_pool_t *p, sni_node_t *node,
+        const char *domain) {
+    const char *end = domain + strlen(domain);
+
+    while (end > domain) {
+        const char *label = end;
+        sni_node_t *child;
+
+        while (label > domain && label[-1] != '.')
+            label--;
+        if (node->children == NULL)
+            node->children = apr_hash_make(p);
+        child = apr_hash_get(node->children, label, end - label);
+        if (child == NULL) {
+            child = apr_pcalloc(p, sizeof (*child));
+            apr_hash_set(node->children, apr_pstrndup(p, label, end - label),
+                    end - label, child);
+        }
+        node = child;
+        end = label > domain ? label - 1 : domain;
+    }
+    return node;
+}
+
+static void sni_add_name(apr_pool_t *p, sni_index_t *idx, const char *name,
+        mgs_srvconf_rec *sc, int from_cert) {
+    char *lower;
+
+    if (name == NULL || *name == '\0')
+        return;
+    lower = sni_lower(p, name);
+
+    if (strncmp(lower, "*.", 2) == 0 && !apr_fnmatch_test(lower + 2)) {
+        sni_node_t *node = sni_node_get(p, &idx->wildcards, lower + 2);
+
+        if (!from_cert && node->alias == NULL)
+            node->alias = sc;
+        else if (from_cert && node->cert == NULL)
+            node->cert = sc;
+    } else if (apr_fnmatch_test(lower)) {
+        if (!from_cert) {
+            sni_pattern_t *pat = apr_array_push(idx->patterns);
+            pat->pattern = lower;
+            pat->sc = sc;
+        }
+    } else {
+        apr_hash_t *names = from_cert ? idx->cert_names : idx->names;
+
+        if (apr_hash_get(names, lower, APR_HASH_KEY_STRING) == NULL)
+            apr_hash_set(names, lower, APR_HASH_KEY_STRING, sc);
+    }
+}
+
+/* Index the DNS names of the certificate of a host */
+static void sni_add_cert_names(apr_pool_t *p, sni_index_t *idx,
+        mgs_srvconf_rec *sc) {
+    char name[MAX_HOST_LEN + 1];
+    size_t len;
+    int i, rv;
+
+    sni_add_name(p, idx, sc->cert_cn, sc, 1);
+    if (sc->certs_x509_chain_num == 0)
+        return;
+
+    for (i = 0;; i++) {
+        len = sizeof (name) - 1;
+        rv = gnutls_x509_crt_get_subject_alt_name(sc->certs_x509_chain[0],
+                i, name, &len, NULL);
+        if (rv == GNUTLS_E_REQUESTED_DATA_NOT_AVAILABLE)
+            break;
+        if (rv == GNUTLS_SAN_DNSNAME) {
+            name[len] = '\0';
+            sni_add_name(p, idx, name, sc, 1);
+        }
+    }
+}
+
+static sni_index_t *sni_index_get(apr_pool_t *p, const char *key) {
+    sni_index_t *idx = apr_hash_get(sni_indexes, key, APR_HASH_KEY_STRING);
+
+    if (idx == NULL) {
+        idx = apr_pcalloc(p, sizeof (*idx));
+        idx->names = apr_hash_make(p);
+        idx->cert_names = apr_hash_make(p);
+        idx->patterns = apr_array_make(p, 4, sizeof (sni_pattern_t));
+        apr_hash_set(sni_indexes, apr_pstrdup(p, key), APR_HASH_KEY_STRING,
+                idx);
+    }
+    return idx;
+}
+
+static void mgs_sni_index_build(apr_pool_t *p, server_rec *base_server) {
+    server_rec *s;
+    int pass, i;
+
+    sni_indexes = apr_hash_make(p);
+
+    /* all the configured names first, then those of the certificates */
+    for (pass = 0; pass < 2; pass++) {
+        for (s = base_server->next; s; s = s->next) {
+            mgs_srvconf_rec *sc = (mgs_srvconf_rec *)
+                    ap_get_module_config(s->module_config, &gnutls_module);
+            server_addr_rec *addr;
+
+            if (sc->enabled != GNUTLS_ENABLED_TRUE
+                    || (sc->cert_cn == NULL && sc->cert_dir == NULL))
+                continue;
+
+            for (addr = s->addrs; addr; addr = addr->next) {
+                char key[128];
+                sni_index_t *idx;
+                char **names;
+
+                sni_addr_key(key, sizeof (key), addr->host_addr, NULL,
+                        addr->host_port);
+                idx = sni_index_get(p, key);
+
+                if (pass == 1) {
+                    sni_add_cert_names(p, idx, sc);
+                    continue;
+                }
+
+                sni_add_name(p, idx, s->server_hostname, sc, 0);
+                names = (char **) s->names->elts;
+                for (i = 0; i < s->names->nelts; i++)
+                    sni_add_name(p, idx, names[i], sc, 0);
+                names = (char **) s->wild_names->elts;
+                for (i = 0; i < s->wild_names->nelts; i++)
+                    sni_add_name(p, idx, names[i], sc, 0);
+            }
+        }
+    }
+
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, base_server,
+            "GnuTLS: SNI index covers %u listener addresses",
+            apr_hash_count(sni_indexes));
+}
+
+/* Look up the name in the index of the connection's address.  Returns
+ * 1 and sets *sc (NULL if nothing matches) if the address is indexed,
+ * 0 if not. */
+static int sni_index_lookup(conn_rec *c, char *name, mgs_srvconf_rec **sc) {
+    sni_index_t *idx = NULL;
+    sni_node_t *node;
+    mgs_srvconf_rec *found;
+    const char *end;
+    char key[128];
+    int depth, i;
+
+    if (sni_indexes == NULL)
+        return 0;
+
+    /* IP:PORT, IP:0, *:PORT, *:0 */
+    for (i = 0; i < 4 && idx == NULL; i++) {
+        sni_addr_key(key, sizeof (key), c->local_addr, i < 2 ? NULL : "*",
+                i % 2 ? 0 : c->local_addr->port);
+        idx = apr_hash_get(sni_indexes, key, APR_HASH_KEY_STRING);
+    }
+    if (idx == NULL)
+        return 0;
+
+    for (i = 0; name[i]; i++)
+        name[i] = apr_tolower(name[i]);
+
+    found = apr_hash_get(idx->names, name, APR_HASH_KEY_STRING);
+    if (found != NULL) {
+        *sc = found;
+        return 1;
+    }
+
+    /* walk the wildcard trie from the last label, keeping the deepest
+     * ServerAlias and the certificate wildcard for the first label */
+    node = &idx->wildcards;
+    end = name + strlen(name);
+    found = NULL;
+    *sc = NULL;
+    for (depth = 0; end > name && node->children != NULL; depth++) {
+        const char *label = end;
+
+        while (label > name && label[-1] != '.')
+            label--;
+        if (label == name)
+            break;
+        node = apr_hash_get(node->children, label, end - label);
+        if (node == NULL)
+            break;
+        end = label - 1;
+        if (node->alias != NULL)
+            found = node->alias;
+        if (node->cert != NULL && memchr(name, '.', end - name) == NULL)
+            *sc = node->cert;
+    }
+    if (found != NULL) {
+        *sc = found;
+        return 1;
+    }
+
+    for (i = 0; i < idx->patterns->nelts; i++) {
+        sni_pattern_t *pat = &APR_ARRAY_IDX(idx->patterns, i,
+                sni_pattern_t);
+
+        if (apr_fnmatch(pat->pattern, name, APR_FNM_CASE_BLIND
+                | APR_FNM_PERIOD | APR_FNM_PATHNAME | APR_FNM_NOESCAPE)
+                == APR_SUCCESS) {
+            *sc = pat->sc;
+            return 1;
+        }
+    }
+
+    found = apr_hash_get(idx->cert_names, name, APR_HASH_KEY_STRING);
+    if (found != NULL)
+        *sc = found;
+    return 1;
+}
 #endif
 
 mgs_srvconf_rec *mgs_find_sni_server(gnutls_session_t session) {
@@ -640,6 +1396,9 @@ mgs_srvconf_rec *mgs_find_sni_server(gnutls_session_t session) {
      * for this IP/Port combo.  Trust that the core did the 'right' thing.
      */
 #if USING_2_1_RECENT
+    if (sni_index_lookup(ctxt->c, sni_name, &cbx.sc))
+        return cbx.sc;
+
     cbx.ctxt = ctxt;
     cbx.sc = NULL;
     cbx.sni_name = sni_name;
@@ -673,6 +1432,7 @@ static void create_gnutls_handle(conn_rec * c) {
     ctxt = apr_pcalloc(c->pool, sizeof (*ctxt));
     ctxt->c = c;
     ctxt->sc = sc;
+    ctxt->session_context = sc->session_context;
     ctxt->status = 0;
     ctxt->input_rc = APR_SUCCESS;
     ctxt->input_bb = apr_brigade_create(c->pool, c->bucket_alloc);
@@ -684,8 +1444,16 @@ static void create_gnutls_handle(conn_rec * c) {
     /* Initialize GnuTLS Library */
     gnutls_init(&ctxt->session, GNUTLS_SERVER);
     /* Initialize Session Tickets */
-    if (session_ticket_key.data != NULL && ctxt->sc->tickets != 0) {
-        gnutls_session_ticket_enable_server(ctxt->session,&session_ticket_key);
+    if (session_ticket_nkeys > 0 && ctxt->sc->tickets != 0) {
+#if GNUTLS_VERSION_NUMBER >= 0x030100
+        if (session_ticket_select)
+            gnutls_handshake_set_hook_function(ctxt->session,
+                    GNUTLS_HANDSHAKE_CLIENT_HELLO, GNUTLS_HOOK_PRE,
+                    mgs_ticket_key_select_cb);
+        else
+#endif
+        gnutls_session_ticket_enable_server(ctxt->session,
+                &session_ticket_keys[0]);
     }
 
     /* Set Default Priority */
@@ -801,7 +1569,13 @@ int mgs_hook_fixups(request_rec * r) {
     tmp = mgs_session_id2sz(sbuf, len, buf, sizeof (buf));
     apr_table_setn(env, "SSL_SESSION_ID", apr_pstrdup(r->pool, tmp));
 
-    if (gnutls_certificate_type_get(ctxt->session) == GNUTLS_CRT_X509) {
+    if (gnutls_certificate_type_get(ctxt->session) == GNUTLS_CRT_X509
+            && ctxt->dir_cert != NULL) {
+		mgs_add_common_cert_vars(r, ctxt->dir_cert->certs_x509_chain[0], 0, ctxt->sc->export_certificates_enabled);
+	} else if (gnutls_certificate_type_get(ctxt->session) == GNUTLS_CRT_X509
+            && ctxt->reload_cert != NULL) {
+		mgs_add_common_cert_vars(r, ctxt->reload_cert->certs_x509_chain[0], 0, ctxt->sc->export_certificates_enabled);
+	} else if (gnutls_certificate_type_get(ctxt->session) == GNUTLS_CRT_X509) {
 		mgs_add_common_cert_vars(r, ctxt->sc->certs_x509_chain[0], 0, ctxt->sc->export_certificates_enabled);
 	} else if (gnutls_certificate_type_get(ctxt->session) == GNUTLS_CRT_OPENPGP) {
         mgs_add_common_pgpcert_vars(r, ctxt->sc->cert_pgp, 0, ctxt->sc->export_certificates_enabled);
@@ -1522,6 +2296,13 @@ static int mgs_status_hook(request_rec *r, int flags)
 
     _gnutls_log(debug_log_fp, "%s: %d\n", __func__, __LINE__);
 
+    if (flags & AP_STATUS_SHORT) {
+        mgs_cache_status(r, flags);
+        mgs_certdir_status(r, flags);
+        mgs_reload_status(r, flags);
+        return OK;
+    }
+
     ap_rputs("<hr>\n", r);
     ap_rputs("<h2>GnuTLS Information:</h2>\n<dl>\n", r);
 
@@ -1547,6 +2328,9 @@ static int mgs_status_hook(request_rec *r, int flags)
 #endif
         }
     }
+    mgs_cache_status(r, flags);
+    mgs_certdir_status(r, flags);
+    mgs_reload_status(r, flags);
 
     ap_rputs("</dl>\n", r);
     return OK;
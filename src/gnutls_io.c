@@ -424,9 +424,10 @@ tryagain:
 #endif
         ctxt->status = -1;
         if (ctxt->session) {
-            gnutls_alert_send(ctxt->session, GNUTLS_AL_FATAL,
-                    gnutls_error_to_alert(ret,
-                    NULL));
+            if (!ctxt->alert_sent)
+                gnutls_alert_send(ctxt->session, GNUTLS_AL_FATAL,
+                        gnutls_error_to_alert(ret,
+                        NULL));
             gnutls_deinit(ctxt->session);
         }
         ctxt->session = NULL;
@@ -435,11 +436,17 @@ tryagain:
         /* all done with the handshake */
         ctxt->status = 1;
         /* If the session was resumed, we did not set the correct
-         * server_rec in ctxt->sc.  Go Find it. (ick!)
+         * server_rec in ctxt->sc.  Take the one the cached session was
+         * established with, or go find it by SNI for tickets and
+         * sessions cached without one.
          */
         if (gnutls_session_is_resumed(ctxt->session)) {
             mgs_srvconf_rec *sc;
-            sc = mgs_find_sni_server(ctxt->session);
+            sc = mgs_find_vhost_id(ctxt->session_vhost_id);
+            if (sc == NULL || sc->enabled != GNUTLS_ENABLED_TRUE
+                    || strcmp(sc->session_context,
+                    ctxt->session_context) != 0)
+                sc = mgs_find_sni_server(ctxt->session);
             if (sc) {
                 ctxt->sc = sc;
             }
@@ -0,0 +1,501 @@
+/**
+ *  Copyright 2004-2005 Paul Querna
+ *  Copyright 2008 Nikos Mavrogiannopoulos
+ *  Copyright 2011 Dash Shendy
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include "mod_gnutls.h"
+
+#include "apr_hash.h"
+#include "apr_thread_cond.h"
+#include "apr_thread_mutex.h"
+#include "apr_thread_proc.h"
+
+#include "mod_status.h"
+
+/**
+ * Certificate Reloading
+ *
+ * With GnuTLSReloadInterval, a thread in every child checks the
+ * GnuTLSCertificateFile and GnuTLSKeyFile of the virtual hosts that
+ * often, and when one of them changed, parses both and swaps them in
+ * without a restart.  Handshakes take a reference to the certificate
+ * that is current when they start, so a swap never changes the
+ * certificate of a running handshake, and the old one is freed once
+ * its last connection has closed.
+ *
+ * A new certificate is only used if it matches the new key, so
+ * replacing the two files one after the other is safe: the old pair
+ * stays in use until both are in place.  Virtual hosts are still
+ * found by the names of the certificate they were started with: the
+ * SNI index and the server names are built once in the parent, so a
+ * reload that changes the names only logs a warning.
+ */
+
+#if APR_HAS_THREADS
+
+typedef struct {
+    /* must come first, connections only see this part */
+    mgs_dir_cert_t cert;
+    /* one for the watcher, one for every connection using it */
+    int refs;
+    /* parsed by the watcher, the first one belongs to the config */
+    int owned;
+} reload_cert_t;
+
+/* A certificate and key file pair, shared by the servers naming it */
+typedef struct {
+    const char *cert_file;
+    const char *key_file;
+    apr_finfo_t cert_info;
+    apr_finfo_t key_info;
+    reload_cert_t *current;
+} reload_files_t;
+
+static struct {
+    /* reload_files_t by server config, NULL if nothing is watched */
+    apr_hash_t *servers;
+    apr_array_header_t *files;
+    apr_interval_time_t interval;
+    int stop;
+    /* guards the current certificates, their references and stop */
+    apr_thread_mutex_t *mutex;
+    apr_thread_cond_t *cond;
+    apr_thread_t *thread;
+    apr_pool_t *pool;
+    server_rec *s;
+    /* counters of this child: every child reloads a changed file on
+     * its own, so each change is counted once in every child */
+    apr_uint32_t reloads;
+    apr_uint32_t reload_errors;
+} reload;
+
+#define RELOAD_FINFO (APR_FINFO_SIZE | APR_FINFO_MTIME | APR_FINFO_INODE)
+
+static void reload_cert_free(reload_cert_t *c) {
+    unsigned int i;
+
+    if (c->owned) {
+        for (i = 0; i < c->cert.certs_x509_chain_num; i++)
+            gnutls_x509_crt_deinit(c->cert.certs_x509_chain[i]);
+        if (c->cert.privkey_x509 != NULL)
+            gnutls_x509_privkey_deinit(c->cert.privkey_x509);
+    }
+    free(c);
+}
+
+/* Drop a reference, with the lock held. */
+static void reload_cert_unref(reload_cert_t *c) {
+    if (--c->refs == 0)
+        reload_cert_free(c);
+}
+
+static apr_status_t reload_release(void *data) {
+    apr_thread_mutex_lock(reload.mutex);
+    reload_cert_unref(data);
+    apr_thread_mutex_unlock(reload.mutex);
+    return APR_SUCCESS;
+}
+
+static int reload_changed(apr_finfo_t *a, apr_finfo_t *b) {
+    return a->size != b->size || a->mtime != b->mtime
+            || a->inode != b->inode;
+}
+
+static apr_status_t reload_read(apr_pool_t *p, const char *file,
+        gnutls_datum_t *data) {
+    apr_file_t *fp;
+    apr_finfo_t finfo;
+    apr_size_t br = 0;
+    apr_status_t rv;
+
+    rv = apr_file_open(&fp, file, APR_READ | APR_BINARY, APR_OS_DEFAULT, p);
+    if (rv != APR_SUCCESS)
+        return rv;
+
+    rv = apr_file_info_get(&finfo, APR_FINFO_SIZE, fp);
+    if (rv == APR_SUCCESS) {
+        data->data = apr_palloc(p, finfo.size + 1);
+        rv = apr_file_read_full(fp, data->data, finfo.size, &br);
+    }
+    apr_file_close(fp);
+    if (rv != APR_SUCCESS)
+        return rv;
+
+    data->data[br] = '\0';
+    data->size = br;
+    return APR_SUCCESS;
+}
+
+/* Parse the files of F into C, returns an error message or NULL */
+static const char *reload_load(apr_pool_t *p, reload_files_t *f,
+        reload_cert_t *c) {
+    unsigned char cert_id[20], key_id[20];
+    size_t cert_id_len = sizeof (cert_id), key_id_len = sizeof (key_id);
+    gnutls_datum_t data;
+    apr_status_t rv;
+    int ret;
+
+    rv = reload_read(p, f->cert_file, &data);
+    if (rv != APR_SUCCESS)
+        return apr_psprintf(p, "Error Reading Certificate '%s'",
+                f->cert_file);
+
+    c->cert.certs_x509_chain_num = MAX_CHAIN_SIZE;
+    ret = gnutls_x509_crt_list_import(c->cert.certs_x509_chain,
+            &c->cert.certs_x509_chain_num, &data, GNUTLS_X509_FMT_PEM, 0);
+    if (ret < 0 || c->cert.certs_x509_chain_num == 0) {
+        c->cert.certs_x509_chain_num = 0;
+        return apr_psprintf(p, "Failed to Import Certificate '%s': "
+                "(%d) %s", f->cert_file, ret, gnutls_strerror(ret));
+    }
+
+    rv = reload_read(p, f->key_file, &data);
+    if (rv != APR_SUCCESS)
+        return apr_psprintf(p, "Error Reading Private Key '%s'",
+                f->key_file);
+
+    ret = gnutls_x509_privkey_init(&c->cert.privkey_x509);
+    if (ret < 0) {
+        c->cert.privkey_x509 = NULL;
+        return apr_psprintf(p, "Failed to initialize: (%d) %s",
+                ret, gnutls_strerror(ret));
+    }
+
+    ret = gnutls_x509_privkey_import(c->cert.privkey_x509, &data,
+            GNUTLS_X509_FMT_PEM);
+    if (ret < 0)
+        ret = gnutls_x509_privkey_import_pkcs8(c->cert.privkey_x509, &data,
+                GNUTLS_X509_FMT_PEM, NULL, GNUTLS_PKCS_PLAIN);
+    if (ret < 0)
+        return apr_psprintf(p, "Failed to Import Private Key '%s': "
+                "(%d) %s", f->key_file, ret, gnutls_strerror(ret));
+
+    /* one of the files may not have been replaced yet */
+    if (gnutls_x509_crt_get_key_id(c->cert.certs_x509_chain[0], 0,
+            cert_id, &cert_id_len) < 0
+            || gnutls_x509_privkey_get_key_id(c->cert.privkey_x509, 0,
+            key_id, &key_id_len) < 0
+            || cert_id_len != key_id_len
+            || memcmp(cert_id, key_id, key_id_len) != 0)
+        return apr_psprintf(p, "Private Key '%s' does not match "
+                "Certificate '%s'", f->key_file, f->cert_file);
+
+    return NULL;
+}
+
+/* The DNS names of CRT, its CN and its dNSName subjectAltNames */
+static apr_hash_t *reload_names(apr_pool_t *p, gnutls_x509_crt_t crt) {
+    apr_hash_t *names = apr_hash_make(p);
+    char name[256];
+    size_t len;
+    unsigned int i;
+    int ret;
+
+    len = sizeof (name);
+    if (gnutls_x509_crt_get_dn_by_oid(crt, GNUTLS_OID_X520_COMMON_NAME,
+            0, 0, name, &len) == 0)
+        apr_hash_set(names, apr_pstrdup(p, name), APR_HASH_KEY_STRING, "");
+
+    for (i = 0;; i++) {
+        len = sizeof (name) - 1;
+        ret = gnutls_x509_crt_get_subject_alt_name(crt, i, name, &len,
+                NULL);
+        if (ret == GNUTLS_E_REQUESTED_DATA_NOT_AVAILABLE)
+            break;
+        if (ret != GNUTLS_SAN_DNSNAME)
+            continue;
+        name[len] = '\0';
+        apr_hash_set(names, apr_pstrdup(p, name), APR_HASH_KEY_STRING, "");
+    }
+
+    return names;
+}
+
+static int reload_same_names(apr_pool_t *p, gnutls_x509_crt_t a,
+        gnutls_x509_crt_t b) {
+    apr_hash_t *na = reload_names(p, a);
+    apr_hash_t *nb = reload_names(p, b);
+    apr_hash_index_t *hi;
+    const void *name;
+
+    if (apr_hash_count(na) != apr_hash_count(nb))
+        return 0;
+    for (hi = apr_hash_first(p, na); hi; hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, &name, NULL, NULL);
+        if (apr_hash_get(nb, name, APR_HASH_KEY_STRING) == NULL)
+            return 0;
+    }
+    return 1;
+}
+
+/* Swap in the files of F if they changed since they were last seen */
+static void reload_check(apr_pool_t *p, reload_files_t *f) {
+    apr_finfo_t cert_info, key_info;
+    reload_cert_t *c, *old;
+    const char *err;
+
+    /* a file that is missing is probably being replaced */
+    if (apr_stat(&cert_info, f->cert_file, RELOAD_FINFO, p) != APR_SUCCESS
+            || apr_stat(&key_info, f->key_file, RELOAD_FINFO, p)
+            != APR_SUCCESS)
+        return;
+    if (!reload_changed(&cert_info, &f->cert_info)
+            && !reload_changed(&key_info, &f->key_info))
+        return;
+    /* failures are only logged once per change */
+    f->cert_info = cert_info;
+    f->key_info = key_info;
+
+    c = calloc(1, sizeof (*c));
+    if (c == NULL)
+        return;
+    c->refs = 1;
+    c->owned = 1;
+
+    err = reload_load(p, f, c);
+    if (err != NULL) {
+        reload_cert_free(c);
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, reload.s,
+                "GnuTLS: Not reloading '%s': %s", f->cert_file, err);
+        apr_thread_mutex_lock(reload.mutex);
+        reload.reload_errors++;
+        apr_thread_mutex_unlock(reload.mutex);
+        return;
+    }
+
+    /* only this thread changes f->current */
+    if (!reload_same_names(p, f->current->cert.certs_x509_chain[0],
+            c->cert.certs_x509_chain[0]))
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, reload.s,
+                "GnuTLS: The names in '%s' changed, virtual hosts are "
+                "still found by the names it had at startup until "
+                "Apache is restarted", f->cert_file);
+
+    apr_thread_mutex_lock(reload.mutex);
+    old = f->current;
+    f->current = c;
+    reload.reloads++;
+    reload_cert_unref(old);
+    apr_thread_mutex_unlock(reload.mutex);
+
+    ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, reload.s,
+            "GnuTLS: Reloaded Certificate '%s' and Private Key '%s'",
+            f->cert_file, f->key_file);
+}
+
+static void *APR_THREAD_FUNC reload_thread(apr_thread_t *thd, void *data) {
+    int i;
+
+    apr_thread_mutex_lock(reload.mutex);
+    while (!reload.stop) {
+        if (apr_thread_cond_timedwait(reload.cond, reload.mutex,
+                reload.interval) != APR_TIMEUP)
+            continue;
+        apr_thread_mutex_unlock(reload.mutex);
+
+        for (i = 0; i < reload.files->nelts; i++)
+            reload_check(reload.pool,
+                    APR_ARRAY_IDX(reload.files, i, reload_files_t *));
+        apr_pool_clear(reload.pool);
+
+        apr_thread_mutex_lock(reload.mutex);
+    }
+    apr_thread_mutex_unlock(reload.mutex);
+
+    apr_thread_exit(thd, APR_SUCCESS);
+    return NULL;
+}
+
+/* Runs when the child exits: stop the thread */
+static apr_status_t reload_cleanup(void *data) {
+    apr_status_t rv;
+
+    if (reload.thread == NULL)
+        return APR_SUCCESS;
+
+    apr_thread_mutex_lock(reload.mutex);
+    reload.stop = 1;
+    apr_thread_cond_signal(reload.cond);
+    apr_thread_mutex_unlock(reload.mutex);
+
+    apr_thread_join(&rv, reload.thread);
+    reload.thread = NULL;
+
+    return APR_SUCCESS;
+}
+
+void mgs_reload_child_init(apr_pool_t *p, server_rec *s) {
+    mgs_srvconf_rec *sc_base = (mgs_srvconf_rec *)
+            ap_get_module_config(s->module_config, &gnutls_module);
+    apr_hash_t *by_name;
+    apr_status_t rv;
+
+    reload.servers = NULL;
+    if (sc_base->reload_interval <= 0)
+        return;
+
+    reload.interval = sc_base->reload_interval;
+    reload.stop = 0;
+    reload.s = s;
+    reload.files = apr_array_make(p, 8, sizeof (reload_files_t *));
+    by_name = apr_hash_make(p);
+
+    rv = apr_thread_mutex_create(&reload.mutex, APR_THREAD_MUTEX_DEFAULT,
+            p);
+    if (rv == APR_SUCCESS)
+        rv = apr_thread_cond_create(&reload.cond, p);
+    if (rv == APR_SUCCESS)
+        rv = apr_pool_create(&reload.pool, p);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_EMERG, rv, s,
+                "GnuTLS: Cannot set up certificate reloading");
+        return;
+    }
+
+    reload.servers = apr_hash_make(p);
+    for (; s; s = s->next) {
+        mgs_srvconf_rec *sc = (mgs_srvconf_rec *)
+                ap_get_module_config(s->module_config, &gnutls_module);
+        mgs_srvconf_rec **key;
+        reload_files_t *f;
+        const char *cert_file, *key_file, *name;
+        apr_finfo_t cert_info, key_info;
+        reload_cert_t *c;
+
+        if (sc->enabled != GNUTLS_ENABLED_TRUE || sc->cert_load == NULL
+                || sc->key_load == NULL || sc->certs_x509_chain_num == 0
+                || sc->privkey_x509 == NULL)
+            continue;
+
+        /* start from the files as they were parsed, so changes made
+         * since then are picked up right away */
+        cert_file = mgs_config_load_file(sc->cert_load, &cert_info);
+        key_file = mgs_config_load_file(sc->key_load, &key_info);
+        name = apr_pstrcat(p, cert_file, "\n", key_file, NULL);
+
+        f = apr_hash_get(by_name, name, APR_HASH_KEY_STRING);
+        if (f == NULL) {
+            c = calloc(1, sizeof (*c));
+            if (c == NULL)
+                continue;
+            c->refs = 1;
+            c->cert.certs_x509_chain_num = sc->certs_x509_chain_num;
+            if (c->cert.certs_x509_chain_num > MAX_CHAIN_SIZE)
+                c->cert.certs_x509_chain_num = MAX_CHAIN_SIZE;
+            memcpy(c->cert.certs_x509_chain, sc->certs_x509_chain,
+                    c->cert.certs_x509_chain_num
+                    * sizeof (*c->cert.certs_x509_chain));
+            c->cert.privkey_x509 = sc->privkey_x509;
+
+            f = apr_pcalloc(p, sizeof (*f));
+            f->cert_file = cert_file;
+            f->key_file = key_file;
+            f->cert_info = cert_info;
+            f->key_info = key_info;
+            f->current = c;
+            apr_hash_set(by_name, name, APR_HASH_KEY_STRING, f);
+            APR_ARRAY_PUSH(reload.files, reload_files_t *) = f;
+        }
+
+        key = apr_palloc(p, sizeof (*key));
+        *key = sc;
+        apr_hash_set(reload.servers, key, sizeof (*key), f);
+    }
+
+    if (reload.files->nelts == 0) {
+        reload.servers = NULL;
+        return;
+    }
+
+    rv = apr_thread_create(&reload.thread, NULL, reload_thread, NULL, p);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_EMERG, rv, reload.s,
+                "GnuTLS: Cannot start the certificate reload thread");
+        reload.thread = NULL;
+        reload.servers = NULL;
+        return;
+    }
+
+    /* before the pool the thread uses goes away */
+    apr_pool_pre_cleanup_register(p, NULL, reload_cleanup);
+}
+
+mgs_dir_cert_t *mgs_reload_acquire(mgs_handle_t *ctxt) {
+    reload_files_t *f;
+    reload_cert_t *c;
+
+    if (reload.servers == NULL)
+        return NULL;
+    f = apr_hash_get(reload.servers, &ctxt->sc, sizeof (ctxt->sc));
+    if (f == NULL)
+        return NULL;
+
+    apr_thread_mutex_lock(reload.mutex);
+    c = f->current;
+    c->refs++;
+    apr_thread_mutex_unlock(reload.mutex);
+
+    apr_pool_cleanup_register(ctxt->c->pool, c, reload_release,
+            apr_pool_cleanup_null);
+    return &c->cert;
+}
+
+void mgs_reload_status(request_rec *r, int flags) {
+    apr_uint32_t reloads, errors;
+
+    if (reload.servers == NULL)
+        return;
+
+    apr_thread_mutex_lock(reload.mutex);
+    reloads = reload.reloads;
+    errors = reload.reload_errors;
+    apr_thread_mutex_unlock(reload.mutex);
+
+    if (flags & AP_STATUS_SHORT) {
+        ap_rprintf(r, "GnuTLSChildCertificateReloads: %u\n"
+                "GnuTLSChildCertificateReloadErrors: %u\n",
+                reloads, errors);
+        return;
+    }
+
+    ap_rprintf(r, "<dt>Certificates watched for changes:</dt>"
+            "<dd>%d, checked every %" APR_TIME_T_FMT " seconds</dd>\n",
+            reload.files->nelts, apr_time_sec(reload.interval));
+    ap_rprintf(r, "<dt>Certificate reloads in this child:</dt>"
+            "<dd>%u, %u failed</dd>\n", reloads, errors);
+}
+
+#else
+
+void mgs_reload_child_init(apr_pool_t *p, server_rec *s) {
+    mgs_srvconf_rec *sc = (mgs_srvconf_rec *)
+            ap_get_module_config(s->module_config, &gnutls_module);
+
+    if (sc->reload_interval > 0)
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+                "GnuTLS: GnuTLSReloadInterval needs thread support, "
+                "certificates are not reloaded");
+}
+
+mgs_dir_cert_t *mgs_reload_acquire(mgs_handle_t *ctxt) {
+    return NULL;
+}
+
+void mgs_reload_status(request_rec *r, int flags) {
+}
+
+#endif
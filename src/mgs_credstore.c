@@ -0,0 +1,334 @@
+/**
+ *  Copyright 2011 Dash Shendy
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+/**
+ * Credential store compiler
+ *
+ * Writes the certificate chains, CA lists and private keys of the
+ * given PEM files to a GnuTLSCredentialStore in DER, indexed by the
+ * absolute path of each file, the way mod_gnutls resolves it:
+ *
+ *   cd /etc/apache2
+ *   src/mgs_credstore -o conf/credentials.store ssl/site1.crt ssl/site1.key
+ *
+ * Relative paths are taken from the current directory, so run it from
+ * the ServerRoot or give absolute paths.  A file holding both a chain
+ * and a key gets an entry for each.  Files changed after the store was
+ * written are parsed by mod_gnutls as usual, so the store only has to
+ * be recreated to get the speed back.
+ */
+
+#include "mod_gnutls.h"
+#include "apr_getopt.h"
+
+#include <gnutls/crypto.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct {
+    const char *path;
+    apr_uint32_t kind;
+    apr_off_t size;
+    apr_time_t mtime;
+    gnutls_datum_t *items;
+    unsigned int n;
+} store_entry_t;
+
+static void put_u32(unsigned char *p, apr_uint32_t v) {
+    p[0] = (v >> 24) & 0xff;
+    p[1] = (v >> 16) & 0xff;
+    p[2] = (v >> 8) & 0xff;
+    p[3] = v & 0xff;
+}
+
+static void put_u64(unsigned char *p, apr_uint64_t v) {
+    put_u32(p, (apr_uint32_t) (v >> 32));
+    put_u32(p + 4, (apr_uint32_t) v);
+}
+
+static int entry_cmp(const void *a, const void *b) {
+    const store_entry_t *ea = a, *eb = b;
+    int c = strcmp(ea->path, eb->path);
+
+    if (c != 0)
+        return c;
+    return ea->kind < eb->kind ? -1 : ea->kind > eb->kind ? 1 : 0;
+}
+
+/* DER of every certificate in DATA, 0 if there are none */
+static unsigned int read_certs(apr_pool_t *p, gnutls_datum_t *data,
+        gnutls_datum_t **items) {
+    gnutls_x509_crt_t *certs;
+    unsigned int n = 16, i;
+    int ret;
+
+    certs = apr_palloc(p, n * sizeof (*certs));
+    ret = gnutls_x509_crt_list_import(certs, &n, data, GNUTLS_X509_FMT_PEM,
+            GNUTLS_X509_CRT_LIST_IMPORT_FAIL_IF_EXCEED);
+    if (ret == GNUTLS_E_SHORT_MEMORY_BUFFER) {
+        certs = apr_palloc(p, n * sizeof (*certs));
+        ret = gnutls_x509_crt_list_import(certs, &n, data,
+                GNUTLS_X509_FMT_PEM, 0);
+    }
+    if (ret <= 0)
+        return 0;
+
+    *items = apr_palloc(p, n * sizeof (**items));
+    for (i = 0; i < n; i++) {
+        size_t size = 0;
+
+        gnutls_x509_crt_export(certs[i], GNUTLS_X509_FMT_DER, NULL, &size);
+        (*items)[i].data = apr_palloc(p, size);
+        ret = gnutls_x509_crt_export(certs[i], GNUTLS_X509_FMT_DER,
+                (*items)[i].data, &size);
+        gnutls_x509_crt_deinit(certs[i]);
+        if (ret < 0) {
+            fprintf(stderr, "Cannot export certificate: %s\n",
+                    gnutls_strerror(ret));
+            exit(1);
+        }
+        (*items)[i].size = size;
+    }
+    return n;
+}
+
+/* DER of the private key in DATA, 0 if there is none */
+static unsigned int read_key(apr_pool_t *p, gnutls_datum_t *data,
+        gnutls_datum_t **items) {
+    gnutls_x509_privkey_t key;
+    size_t size = 0;
+    int ret;
+
+    if (gnutls_x509_privkey_init(&key) < 0)
+        return 0;
+    ret = gnutls_x509_privkey_import(key, data, GNUTLS_X509_FMT_PEM);
+    if (ret < 0)
+        ret = gnutls_x509_privkey_import_pkcs8(key, data,
+                GNUTLS_X509_FMT_PEM, NULL, GNUTLS_PKCS_PLAIN);
+    if (ret < 0) {
+        gnutls_x509_privkey_deinit(key);
+        return 0;
+    }
+
+    *items = apr_palloc(p, sizeof (**items));
+    gnutls_x509_privkey_export(key, GNUTLS_X509_FMT_DER, NULL, &size);
+    (*items)[0].data = apr_palloc(p, size);
+    ret = gnutls_x509_privkey_export(key, GNUTLS_X509_FMT_DER,
+            (*items)[0].data, &size);
+    gnutls_x509_privkey_deinit(key);
+    if (ret < 0) {
+        fprintf(stderr, "Cannot export private key: %s\n",
+                gnutls_strerror(ret));
+        exit(1);
+    }
+    (*items)[0].size = size;
+    return 1;
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: mgs_credstore -o STORE FILE...\n"
+            "  -o STORE  the GnuTLSCredentialStore to write\n"
+            "  -v        list the entries written\n");
+    exit(1);
+}
+
+int main(int argc, const char *const *argv) {
+    apr_pool_t *p;
+    apr_getopt_t *opt;
+    apr_array_header_t *entries;
+    store_entry_t *e;
+    const char *out = NULL;
+    const char *arg;
+    const char *tmp;
+    unsigned char *buf;
+    apr_size_t size, off, poff;
+    apr_file_t *fp;
+    apr_status_t rv;
+    char optch;
+    char err[256];
+    int verbose = 0;
+    int i, n;
+    unsigned int j;
+
+    apr_app_initialize(&argc, &argv, NULL);
+    atexit(apr_terminate);
+    apr_pool_create(&p, NULL);
+    gnutls_global_init();
+
+    apr_getopt_init(&opt, p, argc, argv);
+    while ((rv = apr_getopt(opt, "o:v", &optch, &arg)) == APR_SUCCESS) {
+        switch (optch) {
+        case 'o': out = arg; break;
+        case 'v': verbose = 1; break;
+        }
+    }
+    if (rv != APR_EOF || out == NULL || opt->ind >= argc)
+        usage();
+
+    entries = apr_array_make(p, argc, sizeof (store_entry_t));
+    for (i = opt->ind; i < argc; i++) {
+        char *path;
+        apr_finfo_t finfo;
+        gnutls_datum_t data;
+        gnutls_datum_t *items;
+        apr_size_t br = 0;
+        int found = 0;
+
+        /* the same resolution as ap_server_root_relative() */
+        rv = apr_filepath_merge(&path, NULL, argv[i],
+                APR_FILEPATH_TRUENAME, p);
+        if (rv == APR_SUCCESS)
+            rv = apr_file_open(&fp, path, APR_READ | APR_BINARY,
+                    APR_OS_DEFAULT, p);
+        if (rv == APR_SUCCESS)
+            rv = apr_file_info_get(&finfo, APR_FINFO_SIZE | APR_FINFO_MTIME,
+                    fp);
+        if (rv == APR_SUCCESS) {
+            data.data = apr_palloc(p, finfo.size + 1);
+            rv = apr_file_read_full(fp, data.data, finfo.size, &br);
+            apr_file_close(fp);
+        }
+        if (rv != APR_SUCCESS) {
+            fprintf(stderr, "Cannot read %s: %s\n", argv[i],
+                    apr_strerror(rv, err, sizeof (err)));
+            return 1;
+        }
+        data.data[br] = '\0';
+        data.size = br;
+
+        n = read_certs(p, &data, &items);
+        if (n > 0) {
+            e = apr_array_push(entries);
+            e->path = path;
+            e->kind = CREDSTORE_CRT;
+            e->size = finfo.size;
+            e->mtime = finfo.mtime;
+            e->items = items;
+            e->n = n;
+            found = 1;
+        }
+        n = read_key(p, &data, &items);
+        if (n > 0) {
+            e = apr_array_push(entries);
+            e->path = path;
+            e->kind = CREDSTORE_KEY;
+            e->size = finfo.size;
+            e->mtime = finfo.mtime;
+            e->items = items;
+            e->n = n;
+            found = 1;
+        }
+        if (!found) {
+            fprintf(stderr, "%s holds neither certificates nor a private "
+                    "key\n", path);
+            return 1;
+        }
+    }
+
+    qsort(entries->elts, entries->nelts, sizeof (store_entry_t), entry_cmp);
+
+    /* drop files named twice */
+    e = (store_entry_t *) entries->elts;
+    n = 0;
+    for (i = 0; i < entries->nelts; i++) {
+        if (n == 0 || entry_cmp(&e[n - 1], &e[i]) != 0)
+            e[n++] = e[i];
+    }
+    entries->nelts = n;
+
+    /* header, index, paths, then the items of every entry */
+    size = CREDSTORE_HEADER_LEN + (apr_size_t) n * CREDSTORE_ENTRY_LEN;
+    for (i = 0; i < n; i++) {
+        size += strlen(e[i].path);
+        for (j = 0; j < e[i].n; j++)
+            size += 4 + e[i].items[j].size;
+    }
+    if (size > 0xffffffffUL) {
+        fprintf(stderr, "The store would be larger than 4GB\n");
+        return 1;
+    }
+
+    buf = apr_pcalloc(p, size);
+    memcpy(buf, CREDSTORE_MAGIC, 8);
+    put_u32(buf + 8, CREDSTORE_VERSION);
+    put_u32(buf + 12, n);
+    put_u32(buf + 16, size);
+
+    poff = CREDSTORE_HEADER_LEN + (apr_size_t) n * CREDSTORE_ENTRY_LEN;
+    for (i = 0; i < n; i++) {
+        apr_size_t len = strlen(e[i].path);
+
+        memcpy(buf + poff, e[i].path, len);
+        put_u32(buf + CREDSTORE_HEADER_LEN + i * CREDSTORE_ENTRY_LEN, poff);
+        put_u32(buf + CREDSTORE_HEADER_LEN + i * CREDSTORE_ENTRY_LEN + 4,
+                len);
+        poff += len;
+    }
+
+    off = poff;
+    for (i = 0; i < n; i++) {
+        unsigned char *entry = buf + CREDSTORE_HEADER_LEN
+                + i * CREDSTORE_ENTRY_LEN;
+        apr_size_t start = off;
+
+        for (j = 0; j < e[i].n; j++) {
+            put_u32(buf + off, e[i].items[j].size);
+            memcpy(buf + off + 4, e[i].items[j].data, e[i].items[j].size);
+            off += 4 + e[i].items[j].size;
+        }
+        put_u32(entry + 8, e[i].kind);
+        put_u32(entry + 12, e[i].n);
+        put_u32(entry + 16, start);
+        put_u32(entry + 20, off - start);
+        put_u64(entry + 24, (apr_uint64_t) e[i].size);
+        put_u64(entry + 32, (apr_uint64_t) e[i].mtime);
+
+        if (verbose)
+            printf("%s: %u %s\n", e[i].path, e[i].n,
+                    e[i].kind == CREDSTORE_KEY ? "private key"
+                    : "certificates");
+    }
+
+    if (gnutls_hash_fast(GNUTLS_DIG_SHA256, buf + CREDSTORE_HEADER_LEN,
+            size - CREDSTORE_HEADER_LEN, buf + 24) < 0) {
+        fprintf(stderr, "Cannot compute the checksum\n");
+        return 1;
+    }
+
+    /* the store holds private keys */
+    tmp = apr_pstrcat(p, out, ".tmp", NULL);
+    rv = apr_file_open(&fp, tmp, APR_WRITE | APR_CREATE | APR_TRUNCATE
+            | APR_BINARY, APR_FPROT_UREAD | APR_FPROT_UWRITE, p);
+    if (rv == APR_SUCCESS) {
+        rv = apr_file_write_full(fp, buf, size, NULL);
+        if (apr_file_close(fp) != APR_SUCCESS && rv == APR_SUCCESS)
+            rv = APR_EGENERAL;
+    }
+    if (rv == APR_SUCCESS)
+        rv = apr_file_rename(tmp, out, p);
+    if (rv != APR_SUCCESS) {
+        fprintf(stderr, "Cannot write %s: %s\n", out,
+                apr_strerror(rv, err, sizeof (err)));
+        apr_file_remove(tmp, p);
+        return 1;
+    }
+
+    printf("Wrote %d entries, %lu bytes to %s\n", n, (unsigned long) size,
+            out);
+    return 0;
+}
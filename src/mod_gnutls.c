@@ -37,6 +37,10 @@ static void gnutls_hooks(apr_pool_t * p) {
     /* Pre-Config Hook */
     ap_hook_pre_config(mgs_hook_pre_config, NULL, NULL,
             APR_HOOK_MIDDLE);
+#if AP_SERVER_MINORVERSION_NUMBER >= 4
+    /* Config-Test Hook */
+    ap_hook_test_config(mgs_hook_test_config, NULL, NULL, APR_HOOK_MIDDLE);
+#endif
     /* Child-Init Hook */
     ap_hook_child_init(mgs_hook_child_init, NULL, NULL,
             APR_HOOK_MIDDLE);
@@ -132,6 +136,18 @@ static const command_rec mgs_config_cmds[] = {
     NULL,
     RSRC_CONF,
     "SSL Server X509 Private Key file"),
+    AP_INIT_TAKE12("GnuTLSCertificateDirectory", mgs_set_cert_dir,
+    NULL,
+    RSRC_CONF,
+    "Directory to load X509 certificates and keys from by SNI name"),
+    AP_INIT_TAKE1("GnuTLSCredentialStore", mgs_set_cred_store,
+    NULL,
+    RSRC_CONF,
+    "Precompiled certificates and keys written by mgs_credstore"),
+    AP_INIT_TAKE1("GnuTLSReloadInterval", mgs_set_reload_interval,
+    NULL,
+    RSRC_CONF,
+    "Seconds between checks for changed certificate and key files"),
     AP_INIT_TAKE1("GnuTLSX509CertificateFile", mgs_set_cert_file,
     NULL,
     RSRC_CONF,
@@ -167,10 +183,54 @@ static const command_rec mgs_config_cmds[] = {
     NULL,
     RSRC_CONF,
     "Cache Configuration"),
+    AP_INIT_TAKE1("GnuTLSCacheLocal", mgs_set_cache_local,
+    NULL,
+    RSRC_CONF,
+    "Size of the local shared memory cache in front of memcache"),
+    AP_INIT_TAKE1("GnuTLSCacheReplicas", mgs_set_cache_replicas,
+    NULL,
+    RSRC_CONF,
+    "Number of memcache servers each session is stored on"),
+    AP_INIT_TAKE1("GnuTLSCacheShards", mgs_set_cache_shards,
+    NULL,
+    RSRC_CONF,
+    "Number of DBM files the sessions are spread over"),
+    AP_INIT_TAKE1("GnuTLSCacheFilter", mgs_set_cache_filter,
+    NULL,
+    RSRC_CONF,
+    "Size of the filter of issued session IDs"),
+    AP_INIT_TAKE1("GnuTLSCacheQuota", mgs_set_cache_quota,
+    NULL,
+    RSRC_CONF,
+    "Percent of the shm session cache this server may fill"),
+    AP_INIT_TAKE12("GnuTLSCacheSnapshot", mgs_set_cache_snapshot,
+    NULL,
+    RSRC_CONF,
+    "File to save the shm session cache to, and how often"),
+    AP_INIT_TAKE3("GnuTLSCachePool", mgs_set_cache_pool,
+    NULL,
+    RSRC_CONF,
+    "Minimum, soft maximum and maximum connections per memcache server"),
     AP_INIT_TAKE1("GnuTLSSessionTickets", mgs_set_tickets,
     NULL,
     RSRC_CONF,
     "Session Tickets Configuration"),
+    AP_INIT_TAKE123("GnuTLSSessionTicketKeyFile", mgs_set_ticket_key_file,
+    NULL,
+    RSRC_CONF,
+    "Session Ticket keys file, rotation interval and previous keys kept"),
+    AP_INIT_TAKE1("GnuTLSSNIRejectUnknown", mgs_set_sni_reject_unknown,
+    NULL,
+    RSRC_CONF,
+    "Whether to abort handshakes for SNI names no virtual host serves"),
+    AP_INIT_ITERATE("GnuTLSSNIDeny", mgs_set_sni_deny,
+    NULL,
+    RSRC_CONF,
+    "SNI names and patterns to abort handshakes for"),
+    AP_INIT_TAKE1("GnuTLSSessionContext", mgs_set_session_context,
+    NULL,
+    RSRC_CONF,
+    "Name shared by the servers that may resume each other's sessions"),
     AP_INIT_RAW_ARGS("GnuTLSPriorities", mgs_set_priorities,
     NULL,
     RSRC_CONF,